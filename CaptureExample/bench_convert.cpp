@@ -0,0 +1,117 @@
+// Compares libsndfile's float -> PCM conversion with PcmConverter + sf_write_raw.
+//
+// usage: capture_bench_convert [ channels ] [ seconds ]
+//
+// Output goes to a discarding virtual file so only conversion and
+// libsndfile overhead is measured, not the disk.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include <sndfile.h>
+#include "pcm_convert.h"
+
+constexpr int kRate = 48000;
+constexpr size_t kBlockFrames = 4096;
+
+struct NullFile
+{
+    sf_count_t pos = 0;
+    sf_count_t len = 0;
+};
+
+static sf_count_t null_len(void* user) { return ((NullFile*)user)->len; }
+static sf_count_t null_tell(void* user) { return ((NullFile*)user)->pos; }
+static sf_count_t null_read(void*, sf_count_t, void*) { return 0; }
+
+static sf_count_t null_seek(sf_count_t offset, int whence, void* user)
+{
+    NullFile* f = (NullFile*)user;
+    switch(whence)
+    {
+        case SEEK_SET: f->pos = offset; break;
+        case SEEK_CUR: f->pos += offset; break;
+        case SEEK_END: f->pos = f->len + offset; break;
+    }
+    return f->pos;
+}
+
+static sf_count_t null_write(const void*, sf_count_t count, void* user)
+{
+    NullFile* f = (NullFile*)user;
+    f->pos += count;
+    if(f->pos > f->len)
+        f->len = f->pos;
+    return count;
+}
+
+static SNDFILE* open_null(NullFile* f, int channels, int format)
+{
+    static SF_VIRTUAL_IO vio = {null_len, null_seek, null_read, null_write, null_tell};
+    SF_INFO info = {};
+    info.samplerate = kRate;
+    info.channels = channels;
+    info.format = SF_FORMAT_WAV | format;
+    return sf_open_virtual(&vio, SFM_WRITE, &info, f);
+}
+
+int main(int argc, char* argv[])
+{
+    int channels = argc > 1 ? atoi(argv[1]) : 32;
+    int seconds = argc > 2 ? atoi(argv[2]) : 20;
+    size_t frames = size_t(kRate) * seconds;
+
+    std::vector<float> block(kBlockFrames * channels);
+    for(size_t i = 0; i < block.size(); i++)
+        block[i] = 0.8f * sinf(0.001f * i) + 0.05f * (rand() / float(RAND_MAX) - 0.5f);
+    std::vector<char> pcmbuf(block.size() * 3);
+
+    printf("%d channels, %d s of audio per run\n", channels, seconds);
+    printf("%-6s %-28s %10s %12s\n", "bits", "method", "ms", "ns/sample");
+
+    for(int bits : {16, 24})
+    {
+        int format = bits == 16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24;
+        double base_ms = 0.0;
+
+        for(int method = 0; method < 3; method++)
+        {
+            NullFile nf;
+            SNDFILE* sf = open_null(&nf, channels, format);
+            PcmConverter pcm;
+            pcm.Init(bits, method == 1);
+
+            auto start = std::chrono::steady_clock::now();
+            for(size_t done = 0; done < frames; done += kBlockFrames)
+            {
+                size_t n = kBlockFrames * channels;
+                if(method == 0)
+                {
+                    sf_writef_float(sf, block.data(), kBlockFrames);
+                }
+                else
+                {
+                    size_t bytes = pcm.ToPcm(block.data(), n, pcmbuf.data());
+                    sf_write_raw(sf, pcmbuf.data(), bytes);
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            sf_close(sf);
+
+            double ms = std::chrono::duration<double, std::milli>(end - start).count();
+            if(method == 0)
+                base_ms = ms;
+            static const char* names[] = {"sf_writef_float",
+                                          "PcmConverter TPDF + raw",
+                                          "PcmConverter plain + raw"};
+            printf("%-6d %-28s %10.1f %12.2f", bits, names[method], ms,
+                   ms * 1e6 / (double(frames) * channels));
+            if(method > 0)
+                printf("   x%.1f", base_ms / ms);
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+#pragma once
+#ifndef CAPTURE_TELEMETRY_H
+#define CAPTURE_TELEMETRY_H
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <jack/jack.h>
+
+/** Live health counters for the capture path.
+
+Every field has exactly one writer (process() or the disk thread) and is
+published with relaxed atomics, so a monitor thread can read a
+consistent-enough view while recording without taking any lock.
+
+Overrun events carry the jack_frame_time() of the cycle that was dropped
+and go through a small single-producer ring; if the monitor falls behind
+the oldest events are kept and the rest are only counted.
+
+Writer latency is the time the disk thread spends in one write step
+(sf_write* for WAV, waiting for an encoder slot for FLAC). It is kept in
+a log-linear histogram (8 steps per octave above 16 us) from which
+percentiles are read.
+*/
+class CaptureTelemetry
+{
+  public:
+    struct OverrunEvent
+    {
+        jack_nframes_t frame_time;
+        uint32_t first_channel; // first ring that was short, 0 based
+    };
+
+    static constexpr unsigned kEvents = 256;
+    static constexpr unsigned kBuckets = 16 + 21 * 8;
+
+    // ---- process() side ----
+
+    inline void Cycle(jack_nframes_t nframes)
+    {
+        Bump(cycles_);
+        frames_in_.store(frames_in_.load(std::memory_order_relaxed) + nframes,
+                         std::memory_order_relaxed);
+    }
+
+    inline void Overrun(jack_nframes_t frame_time, uint32_t first_channel)
+    {
+        Bump(overruns_);
+        unsigned head = ev_head_.load(std::memory_order_relaxed);
+        if(head - ev_tail_.load(std::memory_order_acquire) < kEvents)
+        {
+            events_[head % kEvents] = {frame_time, first_channel};
+            ev_head_.store(head + 1, std::memory_order_release);
+        }
+    }
+
+    /** ring fill in bytes after this cycle's write */
+    inline void Fill(size_t bytes)
+    {
+        if(bytes > fill_hwm_.load(std::memory_order_relaxed))
+            fill_hwm_.store(bytes, std::memory_order_relaxed);
+    }
+
+    // ---- disk thread side ----
+
+    inline void Written(jack_nframes_t frames, uint64_t latency_us)
+    {
+        frames_out_.store(frames_out_.load(std::memory_order_relaxed) + frames,
+                          std::memory_order_relaxed);
+        Bump(hist_[Bucket(latency_us)]);
+        if(latency_us > max_latency_.load(std::memory_order_relaxed))
+            max_latency_.store(latency_us, std::memory_order_relaxed);
+    }
+
+    // ---- monitor side ----
+
+    /** pops the next overrun event, false if none pending */
+    bool NextOverrun(OverrunEvent& ev)
+    {
+        unsigned tail = ev_tail_.load(std::memory_order_relaxed);
+        if(tail == ev_head_.load(std::memory_order_acquire))
+            return false;
+        ev = events_[tail % kEvents];
+        ev_tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t Overruns() const { return overruns_.load(std::memory_order_relaxed); }
+    uint64_t FramesIn() const { return frames_in_.load(std::memory_order_relaxed); }
+    uint64_t FramesOut() const { return frames_out_.load(std::memory_order_relaxed); }
+    size_t FillHighWater() const { return fill_hwm_.load(std::memory_order_relaxed); }
+    uint64_t MaxLatencyUs() const { return max_latency_.load(std::memory_order_relaxed); }
+
+    /** upper bound in us of the p-th (0..1) write latency percentile */
+    uint64_t LatencyPercentileUs(double p) const
+    {
+        uint64_t counts[kBuckets];
+        uint64_t total = 0;
+        for(unsigned b = 0; b < kBuckets; b++)
+            total += counts[b] = hist_[b].load(std::memory_order_relaxed);
+        if(total == 0)
+            return 0;
+        uint64_t target = uint64_t(p * double(total));
+        uint64_t seen = 0;
+        for(unsigned b = 0; b < kBuckets; b++)
+        {
+            seen += counts[b];
+            if(seen > target)
+                return BucketUpper(b);
+        }
+        return MaxLatencyUs();
+    }
+
+    /** ring size in frames (a power of two) that would absorb the observed
+        p99.9 write stall twice over, plus the block being written */
+    jack_nframes_t RecommendedRingFrames(jack_nframes_t sample_rate,
+                                         jack_nframes_t block_frames) const
+    {
+        uint64_t stall_us = LatencyPercentileUs(0.999);
+        uint64_t frames = 2 * (stall_us * sample_rate / 1000000 + block_frames);
+        jack_nframes_t rec = 1024;
+        while(rec < frames && rec < (1u << 30))
+            rec <<= 1;
+        return rec;
+    }
+
+  private:
+    template <typename T>
+    static inline void Bump(std::atomic<T>& a)
+    {
+        // single writer, so no read-modify-write needed
+        a.store(a.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static inline unsigned Bucket(uint64_t us)
+    {
+        if(us < 16)
+            return unsigned(us);
+        unsigned e = 63 - __builtin_clzll(us);
+        unsigned b = 16 + (e - 4) * 8 + unsigned((us >> (e - 3)) & 7);
+        return b < kBuckets ? b : kBuckets - 1;
+    }
+
+    static inline uint64_t BucketUpper(unsigned b)
+    {
+        if(b < 16)
+            return b + 1;
+        unsigned e = (b - 16) / 8 + 4;
+        unsigned sub = (b - 16) % 8;
+        return (uint64_t(8 + sub + 1) << (e - 3));
+    }
+
+    std::atomic<uint64_t> cycles_{0};
+    std::atomic<uint64_t> frames_in_{0};
+    std::atomic<uint64_t> overruns_{0};
+    std::atomic<size_t> fill_hwm_{0};
+    std::atomic<unsigned> ev_head_{0};
+    std::atomic<unsigned> ev_tail_{0};
+    OverrunEvent events_[kEvents];
+
+    std::atomic<uint64_t> frames_out_{0};
+    std::atomic<uint64_t> max_latency_{0};
+    std::atomic<uint32_t> hist_[kBuckets] = {};
+};
+
+#endif
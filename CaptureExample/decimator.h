@@ -0,0 +1,185 @@
+#pragma once
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+/** Polyphase FIR sample rate reducer for the capture writer.
+
+Converts by the rational factor up/down = out_rate/in_rate (reduced by
+their gcd), e.g. 1/3 for 96 kHz -> 32 kHz or 160/441 for 44.1 kHz ->
+16 kHz. The prototype low pass is a Kaiser windowed sinc that passes
+0.84 of the output Nyquist and stops at the output Nyquist, about
+100 dB down. It is split into up phases of taps_ coefficients each,
+computed once in Init() and stored reversed, so every output sample is
+one contiguous dot product over the input history. The dot product
+works on four samples at a time using GCC vector extensions, as
+PcmConverter does.
+
+One instance per channel, used from one thread; nothing allocates after
+Init(). Output lags the input by half the filter length.
+*/
+class Decimator
+{
+  public:
+    typedef float f32x4 __attribute__((vector_size(16)));
+
+    /** false unless 0 < out_rate < in_rate with a manageable ratio;
+        max_in is the most input frames per Process() call */
+    bool Init(unsigned in_rate, unsigned out_rate, size_t max_in)
+    {
+        if(out_rate == 0 || out_rate >= in_rate)
+            return false;
+        unsigned g = Gcd(in_rate, out_rate);
+        up_ = out_rate / g;
+        down_ = in_rate / g;
+        if(up_ > kMaxPhases)
+            return false;
+
+        // band edges relative to the input rate
+        const double atten = 100.0;
+        const double pass = 0.42 * out_rate / in_rate;
+        const double stop = 0.5 * out_rate / in_rate;
+        const double beta = 0.1102 * (atten - 8.7);
+        size_t taps = size_t(ceil((atten - 8.0) / (2.285 * 2.0 * M_PI * (stop - pass)))) + 1;
+        taps_ = (taps + 3) & ~size_t(3);
+
+        // prototype at up * in_rate, cut off midway through the transition
+        size_t len = taps_ * up_;
+        double fc = 0.5 * (pass + stop) / up_;
+        double centre = 0.5 * (len - 1);
+        double i0_beta = BesselI0(beta);
+        std::vector<double> h(len);
+        for(size_t i = 0; i < len; i++)
+        {
+            double x = i - centre;
+            double sinc = x == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+            double r = x / centre;
+            h[i] = sinc * BesselI0(beta * sqrt(fmax(0.0, 1.0 - r * r))) / i0_beta;
+        }
+
+        // phase p holds h[p], h[p + up], ..., reversed, each with unity DC gain
+        coefs_.assign(up_ * taps_, 0.0f);
+        for(unsigned p = 0; p < up_; p++)
+        {
+            double sum = 0.0;
+            for(size_t m = 0; m < taps_; m++)
+                sum += h[p + m * up_];
+            for(size_t m = 0; m < taps_; m++)
+                coefs_[p * taps_ + taps_ - 1 - m] = float(h[p + m * up_] / sum);
+        }
+
+        max_in_ = max_in;
+        hist_.assign(taps_ - 1 + max_in, 0.0f);
+        t_ = 0;
+        return true;
+    }
+
+    unsigned Up() const { return up_; }
+    unsigned Down() const { return down_; }
+    size_t Taps() const { return taps_; }
+
+    /** most input frames that produce no more than out_space outputs */
+    size_t MaxInput(size_t out_space) const
+    {
+        size_t n = size_t((t_ + uint64_t(out_space) * down_) / up_);
+        return n < max_in_ ? n : max_in_;
+    }
+
+    /** outputs n input frames would produce */
+    size_t Outputs(size_t n) const
+    {
+        uint64_t end = uint64_t(n) * up_;
+        return end > t_ ? size_t((end - t_ + down_ - 1) / down_) : 0;
+    }
+
+    /** filters n (at most max_in) input frames, returns the number of
+        output frames written to out */
+    size_t Process(const float* in, size_t n, float* out)
+    {
+        float* buf = hist_.data();
+        memcpy(buf + taps_ - 1, in, n * sizeof(float));
+
+        const size_t taps = taps_;
+        const uint64_t end = uint64_t(n) * up_;
+        size_t produced = 0;
+        uint64_t t = t_;
+        for(; t < end; t += down_)
+        {
+            // input index t / up_ is the newest sample under the filter
+            size_t first = size_t(t / up_);
+            const float* c = coefs_.data() + size_t(t % up_) * taps;
+            out[produced++] = Dot(c, buf + first, taps);
+        }
+        t_ = t - end;
+
+        memmove(buf, buf + n, (taps_ - 1) * sizeof(float));
+        return produced;
+    }
+
+  private:
+    static constexpr unsigned kMaxPhases = 1024;
+
+    static inline float Dot(const float* c, const float* x, size_t taps)
+    {
+        f32x4 acc0 = {0.0f, 0.0f, 0.0f, 0.0f};
+        f32x4 acc1 = acc0;
+        size_t i = 0;
+        for(; i + 8 <= taps; i += 8)
+        {
+            f32x4 c0, c1, x0, x1;
+            memcpy(&c0, c + i, sizeof(c0));
+            memcpy(&c1, c + i + 4, sizeof(c1));
+            memcpy(&x0, x + i, sizeof(x0));
+            memcpy(&x1, x + i + 4, sizeof(x1));
+            acc0 += c0 * x0;
+            acc1 += c1 * x1;
+        }
+        if(i < taps)
+        {
+            f32x4 c0, x0;
+            memcpy(&c0, c + i, sizeof(c0));
+            memcpy(&x0, x + i, sizeof(x0));
+            acc0 += c0 * x0;
+        }
+        acc0 += acc1;
+        return (acc0[0] + acc0[1]) + (acc0[2] + acc0[3]);
+    }
+
+    static unsigned Gcd(unsigned a, unsigned b)
+    {
+        while(b)
+        {
+            unsigned r = a % b;
+            a = b;
+            b = r;
+        }
+        return a;
+    }
+
+    static double BesselI0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for(int k = 1; k < 50; k++)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+            if(term < sum * 1e-12)
+                break;
+        }
+        return sum;
+    }
+
+    unsigned           up_ = 1;
+    unsigned           down_ = 1;
+    size_t             taps_ = 0;
+    size_t             max_in_ = 0;
+    uint64_t           t_ = 0; // next output, in 1/up_ input frames from the block start
+    std::vector<float> coefs_;
+    std::vector<float> hist_;
+};
+
+#endif
@@ -0,0 +1,422 @@
+#pragma once
+#ifndef FLAC_ENCODER_H
+#define FLAC_ENCODER_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+/** Minimal FLAC frame encoder
+
+Every frame is self contained (fixed predictor orders 0-4, partitioned
+Rice residual), so blocks can be encoded on any thread in any order and
+simply concatenated by the writer.
+*/
+
+constexpr unsigned FLAC_MAX_CHANNELS = 8;
+constexpr unsigned FLAC_MAX_FIXED_ORDER = 4;
+constexpr unsigned FLAC_MAX_PARTITION_ORDER = 8;
+constexpr size_t FLAC_STREAMINFO_OFFSET = 8; // "fLaC" + metadata block header
+constexpr size_t FLAC_HEADER_SIZE = FLAC_STREAMINFO_OFFSET + 34;
+
+namespace flac_detail
+{
+struct CrcTables
+{
+    uint8_t crc8[256];
+    uint16_t crc16[256];
+
+    CrcTables()
+    {
+        for(unsigned i = 0; i < 256; i++)
+        {
+            uint8_t c8 = i;
+            uint16_t c16 = i << 8;
+            for(int b = 0; b < 8; b++)
+            {
+                c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : (c8 << 1);
+                c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : (c16 << 1);
+            }
+            crc8[i] = c8;
+            crc16[i] = c16;
+        }
+    }
+};
+
+inline const CrcTables& Crc()
+{
+    static const CrcTables tables;
+    return tables;
+}
+
+inline uint8_t Crc8(const uint8_t* data, size_t len)
+{
+    const CrcTables& t = Crc();
+    uint8_t crc = 0;
+    for(size_t i = 0; i < len; i++)
+        crc = t.crc8[crc ^ data[i]];
+    return crc;
+}
+
+inline uint16_t Crc16(const uint8_t* data, size_t len)
+{
+    const CrcTables& t = Crc();
+    uint16_t crc = 0;
+    for(size_t i = 0; i < len; i++)
+        crc = (crc << 8) ^ t.crc16[(crc >> 8) ^ data[i]];
+    return crc;
+}
+
+/** MSB-first bit packer appending to a byte vector */
+class BitWriter
+{
+  public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out_(out) {}
+
+    /** writes the low 'bits' bits of value, bits <= 32 */
+    inline void Put(uint32_t value, unsigned bits)
+    {
+        acc_ = (acc_ << bits) | (value & ((uint64_t(1) << bits) - 1));
+        nbits_ += bits;
+        while(nbits_ >= 8)
+        {
+            nbits_ -= 8;
+            out_.push_back(uint8_t(acc_ >> nbits_));
+        }
+    }
+
+    inline void PutZeros(uint32_t count)
+    {
+        while(count >= 32)
+        {
+            Put(0, 32);
+            count -= 32;
+        }
+        if(count)
+            Put(0, count);
+    }
+
+    /** pads with zero bits up to the next byte boundary */
+    void Align()
+    {
+        if(nbits_)
+            Put(0, 8 - nbits_);
+    }
+
+  private:
+    std::vector<uint8_t>& out_;
+    uint64_t acc_ = 0;
+    unsigned nbits_ = 0;
+};
+} // namespace flac_detail
+
+/** Encodes one block of planar integer samples into a FLAC frame.
+Not thread safe; give each worker its own instance.
+*/
+class FlacFrameEncoder
+{
+  public:
+    /** preallocates scratch for blocks up to max_blocksize frames */
+    void Init(unsigned channels, unsigned bits_per_sample, unsigned max_blocksize)
+    {
+        channels_ = channels;
+        bps_ = bits_per_sample;
+        residual_.assign(max_blocksize, 0);
+        // worst case is a verbatim frame plus headers
+        reserve_ = size_t(max_blocksize) * channels * bits_per_sample / 8 + 64 * channels + 32;
+    }
+
+    /** appends the encoded frame to out, returns the frame size in bytes */
+    size_t Encode(const int32_t* const* planar,
+                  unsigned nframes,
+                  uint64_t frame_number,
+                  std::vector<uint8_t>& out)
+    {
+        size_t start = out.size();
+        out.reserve(start + reserve_);
+        flac_detail::BitWriter bw(out);
+
+        // frame header
+        bw.Put(0x3FFE, 14); // sync
+        bw.Put(0, 1);       // reserved
+        bw.Put(0, 1);       // fixed blocksize stream
+        unsigned bs_code = BlockSizeCode(nframes);
+        bw.Put(bs_code, 4);
+        bw.Put(0, 4); // sample rate from STREAMINFO
+        bw.Put(channels_ - 1, 4);
+        bw.Put(SampleSizeCode(bps_), 3);
+        bw.Put(0, 1);
+        PutUtf8(bw, frame_number);
+        if(bs_code == 7)
+            bw.Put(nframes - 1, 16);
+        bw.Put(flac_detail::Crc8(&out[start], out.size() - start), 8);
+
+        for(unsigned c = 0; c < channels_; c++)
+            EncodeSubframe(bw, planar[c], nframes);
+
+        bw.Align();
+        bw.Put(flac_detail::Crc16(&out[start], out.size() - start), 16);
+        return out.size() - start;
+    }
+
+  private:
+    static unsigned BlockSizeCode(unsigned n)
+    {
+        switch(n)
+        {
+            case 192: return 1;
+            case 576: return 2;
+            case 1152: return 3;
+            case 2304: return 4;
+            case 4608: return 5;
+            case 256: return 8;
+            case 512: return 9;
+            case 1024: return 10;
+            case 2048: return 11;
+            case 4096: return 12;
+            case 8192: return 13;
+            case 16384: return 14;
+            case 32768: return 15;
+            default: return 7; // 16 bit (blocksize-1) after the frame number
+        }
+    }
+
+    static unsigned SampleSizeCode(unsigned bps)
+    {
+        switch(bps)
+        {
+            case 8: return 1;
+            case 12: return 2;
+            case 16: return 4;
+            case 20: return 5;
+            case 24: return 6;
+            default: return 0;
+        }
+    }
+
+    static void PutUtf8(flac_detail::BitWriter& bw, uint64_t v)
+    {
+        if(v < 0x80)
+        {
+            bw.Put(uint32_t(v), 8);
+            return;
+        }
+        // number of continuation bytes
+        unsigned extra = v < 0x800       ? 1
+                         : v < 0x10000   ? 2
+                         : v < 0x200000  ? 3
+                         : v < 0x4000000 ? 4
+                         : v < 0x80000000 ? 5
+                                          : 6;
+        uint32_t lead_mask = (0xFF00u >> (extra + 1)) & 0xFF;
+        bw.Put(lead_mask | uint32_t(v >> (6 * extra)), 8);
+        for(int i = int(extra) - 1; i >= 0; i--)
+            bw.Put(0x80 | uint32_t((v >> (6 * i)) & 0x3F), 8);
+    }
+
+    /** residual of the fixed polynomial predictor of the given order */
+    static inline int32_t FixedResidual(const int32_t* x, unsigned i, unsigned order)
+    {
+        switch(order)
+        {
+            case 0: return x[i];
+            case 1: return x[i] - x[i - 1];
+            case 2: return x[i] - 2 * x[i - 1] + x[i - 2];
+            case 3: return x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+            default:
+                return x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+        }
+    }
+
+    static inline uint32_t ZigZag(int32_t r)
+    {
+        return (uint32_t(r) << 1) ^ uint32_t(r >> 31);
+    }
+
+    /** estimated Rice parameter and coded size for m samples summing to sum */
+    static inline void RiceEstimate(uint64_t sum, uint32_t m, unsigned& k, uint64_t& bits)
+    {
+        k = 0;
+        while(k < 30 && (uint64_t(m) << (k + 1)) < sum)
+            k++;
+        bits = uint64_t(m) * (k + 1) + (sum >> k);
+    }
+
+    void EncodeSubframe(flac_detail::BitWriter& bw, const int32_t* x, unsigned n)
+    {
+        bool constant = true;
+        for(unsigned i = 1; i < n && constant; i++)
+            constant = (x[i] == x[0]);
+        if(constant)
+        {
+            bw.Put(0, 1);
+            bw.Put(0x00, 6);
+            bw.Put(0, 1);
+            bw.Put(uint32_t(x[0]), bps_);
+            return;
+        }
+
+        // pick the fixed order with the smallest total absolute residual
+        unsigned order = 0;
+        if(n > FLAC_MAX_FIXED_ORDER)
+        {
+            uint64_t sums[FLAC_MAX_FIXED_ORDER + 1] = {};
+            for(unsigned i = FLAC_MAX_FIXED_ORDER; i < n; i++)
+            {
+                int64_t e0 = x[i];
+                int64_t e1 = e0 - x[i - 1];
+                int64_t e2 = e1 - (int64_t(x[i - 1]) - x[i - 2]);
+                int64_t e3 = e2 - (int64_t(x[i - 1]) - 2 * int64_t(x[i - 2]) + x[i - 3]);
+                int64_t e4 = e3
+                             - (int64_t(x[i - 1]) - 3 * int64_t(x[i - 2])
+                                + 3 * int64_t(x[i - 3]) - x[i - 4]);
+                sums[0] += e0 < 0 ? -e0 : e0;
+                sums[1] += e1 < 0 ? -e1 : e1;
+                sums[2] += e2 < 0 ? -e2 : e2;
+                sums[3] += e3 < 0 ? -e3 : e3;
+                sums[4] += e4 < 0 ? -e4 : e4;
+            }
+            for(unsigned o = 1; o <= FLAC_MAX_FIXED_ORDER; o++)
+                if(sums[o] < sums[order])
+                    order = o;
+        }
+
+        uint32_t* u = residual_.data();
+        for(unsigned i = order; i < n; i++)
+            u[i] = ZigZag(FixedResidual(x, i, order));
+
+        // choose the partition order from per-partition sums at the finest level
+        unsigned max_porder = 0;
+        while(max_porder < FLAC_MAX_PARTITION_ORDER && (n % (2u << max_porder)) == 0
+              && (n >> (max_porder + 1)) > order)
+            max_porder++;
+
+        uint64_t psum[1u << FLAC_MAX_PARTITION_ORDER];
+        unsigned parts = 1u << max_porder;
+        for(unsigned p = 0; p < parts; p++)
+        {
+            unsigned begin = p == 0 ? order : p * (n >> max_porder);
+            unsigned end = (p + 1) * (n >> max_porder);
+            uint64_t s = 0;
+            for(unsigned i = begin; i < end; i++)
+                s += u[i];
+            psum[p] = s;
+        }
+
+        uint64_t best_bits = ~uint64_t(0);
+        unsigned best_porder = 0;
+        for(int po = int(max_porder); po >= 0; po--)
+        {
+            unsigned np = 1u << po;
+            uint64_t total = 0;
+            for(unsigned p = 0; p < np; p++)
+            {
+                uint32_t m = (n >> po) - (p == 0 ? order : 0);
+                unsigned k;
+                uint64_t bits;
+                RiceEstimate(psum[p], m, k, bits);
+                total += bits + 5;
+            }
+            if(total < best_bits)
+            {
+                best_bits = total;
+                best_porder = unsigned(po);
+            }
+            // merge pairs for the next coarser level
+            for(unsigned p = 0; p < np / 2; p++)
+                psum[p] = psum[2 * p] + psum[2 * p + 1];
+        }
+
+        if(best_bits + order * bps_ >= uint64_t(n) * bps_)
+        {
+            bw.Put(0, 1);
+            bw.Put(0x01, 6);
+            bw.Put(0, 1);
+            for(unsigned i = 0; i < n; i++)
+                bw.Put(uint32_t(x[i]), bps_);
+            return;
+        }
+
+        bw.Put(0, 1);
+        bw.Put(0x08 | order, 6);
+        bw.Put(0, 1);
+        for(unsigned i = 0; i < order; i++)
+            bw.Put(uint32_t(x[i]), bps_);
+
+        // recompute partition parameters for the chosen order
+        unsigned np = 1u << best_porder;
+        unsigned kparam[1u << FLAC_MAX_PARTITION_ORDER];
+        bool rice2 = false;
+        for(unsigned p = 0; p < np; p++)
+        {
+            unsigned begin = p == 0 ? order : p * (n >> best_porder);
+            unsigned end = (p + 1) * (n >> best_porder);
+            uint64_t s = 0;
+            for(unsigned i = begin; i < end; i++)
+                s += u[i];
+            uint64_t bits;
+            RiceEstimate(s, end - begin, kparam[p], bits);
+            rice2 |= kparam[p] > 14;
+        }
+
+        bw.Put(rice2 ? 1 : 0, 2);
+        bw.Put(best_porder, 4);
+        for(unsigned p = 0; p < np; p++)
+        {
+            unsigned begin = p == 0 ? order : p * (n >> best_porder);
+            unsigned end = (p + 1) * (n >> best_porder);
+            unsigned k = kparam[p];
+            bw.Put(k, rice2 ? 5 : 4);
+            uint32_t kmask = (1u << k) - 1;
+            for(unsigned i = begin; i < end; i++)
+            {
+                bw.PutZeros(u[i] >> k);
+                bw.Put((1u << k) | (u[i] & kmask), k + 1);
+            }
+        }
+    }
+
+    unsigned channels_ = 0;
+    unsigned bps_ = 16;
+    size_t reserve_ = 0;
+    std::vector<uint32_t> residual_;
+};
+
+/** Writes the "fLaC" marker and a STREAMINFO block at the current position.
+Call once with zero totals when the file is created and again at offset 0
+once the stream is complete.
+*/
+inline bool FlacWriteStreamHeader(FILE* f,
+                                  unsigned sample_rate,
+                                  unsigned channels,
+                                  unsigned bps,
+                                  unsigned blocksize,
+                                  uint32_t min_frame,
+                                  uint32_t max_frame,
+                                  uint64_t total_samples)
+{
+    std::vector<uint8_t> hdr;
+    hdr.reserve(FLAC_HEADER_SIZE);
+    flac_detail::BitWriter bw(hdr);
+    bw.Put('f', 8);
+    bw.Put('L', 8);
+    bw.Put('a', 8);
+    bw.Put('C', 8);
+    bw.Put(1, 1);  // last metadata block
+    bw.Put(0, 7);  // STREAMINFO
+    bw.Put(34, 24);
+    bw.Put(blocksize, 16);
+    bw.Put(blocksize, 16);
+    bw.Put(min_frame, 24);
+    bw.Put(max_frame, 24);
+    bw.Put(sample_rate, 20);
+    bw.Put(channels - 1, 3);
+    bw.Put(bps - 1, 5);
+    bw.Put(uint32_t(total_samples >> 32), 4);
+    bw.Put(uint32_t(total_samples), 32);
+    for(int i = 0; i < 4; i++)
+        bw.Put(0, 32); // MD5 unknown
+    return fwrite(hdr.data(), 1, hdr.size(), f) == hdr.size();
+}
+
+#endif
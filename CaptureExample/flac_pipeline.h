@@ -0,0 +1,319 @@
+#pragma once
+#ifndef FLAC_PIPELINE_H
+#define FLAC_PIPELINE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "flac_encoder.h"
+#include "pcm_convert.h"
+
+/** Parallel block encoder for the capture disk thread.
+
+The disk thread fills fixed size blocks of planar float samples (channel
+c starts at c * blocksize) and submits them in order. A pool of workers quantizes (PcmConverter, with
+TPDF dither) and encodes blocks concurrently, and a single writer thread
+appends finished frames to the output file(s) strictly in block order.
+FLAC is limited to 8 channels per stream, so wider captures are split
+into groups of up to 8 channels, one file per group.
+
+Slots are allocated once in Open(); nothing allocates per block.
+*/
+class FlacPipeline
+{
+  public:
+    FlacPipeline() {}
+    ~FlacPipeline() { Close(); }
+
+    /** creates the output file(s) and starts the worker and writer threads */
+    bool Open(const char* path,
+              unsigned channels,
+              unsigned sample_rate,
+              unsigned bps,
+              unsigned blocksize,
+              unsigned workers,
+              bool dither = true)
+    {
+        channels_ = channels;
+        sample_rate_ = sample_rate;
+        bps_ = bps;
+        blocksize_ = blocksize;
+        dither_ = dither;
+        next_submit_ = 0;
+        next_write_ = 0;
+        samples_written_ = 0;
+        stop_ = false;
+        failed_ = false;
+
+        unsigned ngroups = (channels + FLAC_MAX_CHANNELS - 1) / FLAC_MAX_CHANNELS;
+        groups_.resize(ngroups);
+        for(unsigned g = 0; g < ngroups; g++)
+        {
+            Group& grp = groups_[g];
+            grp.first = g * FLAC_MAX_CHANNELS;
+            grp.channels = std::min(FLAC_MAX_CHANNELS, channels - grp.first);
+            grp.path = ngroups == 1 ? std::string(path) : GroupPath(path, grp);
+            grp.min_frame = ~0u;
+            grp.max_frame = 0;
+            grp.file = fopen(grp.path.c_str(), "wb");
+            if(!grp.file
+               || !FlacWriteStreamHeader(grp.file, sample_rate_, grp.channels, bps_,
+                                         blocksize_, 0, 0, 0))
+            {
+                fprintf(stderr, "cannot open FLAC output \"%s\"\n", grp.path.c_str());
+                CloseFiles();
+                return false;
+            }
+        }
+
+        // two blocks in flight per worker keeps everyone busy while the
+        // writer drains
+        slots_.resize(workers * 2);
+        for(Slot& s : slots_)
+        {
+            s.frames.assign(size_t(blocksize) * channels, 0.0f);
+            s.samples.assign(size_t(blocksize) * channels, 0);
+            s.encoded.resize(ngroups);
+            for(std::vector<uint8_t>& e : s.encoded)
+                e.reserve(size_t(blocksize) * FLAC_MAX_CHANNELS * bps / 8 + 1024);
+            s.state = Slot::Free;
+        }
+
+        for(unsigned w = 0; w < workers; w++)
+            workers_.emplace_back(&FlacPipeline::WorkerLoop, this, w);
+        writer_ = std::thread(&FlacPipeline::WriterLoop, this);
+        open_ = true;
+        return true;
+    }
+
+    /** returns the planar buffer for the next block, waiting for a free
+        slot if the encoders are behind */
+    float* AcquireBlock()
+    {
+        Slot& s = slots_[next_submit_ % slots_.size()];
+        std::unique_lock<std::mutex> lock(mutex_);
+        slot_free_.wait(lock, [&] { return s.state == Slot::Free; });
+        return s.frames.data();
+    }
+
+    /** queues the block returned by AcquireBlock() holding nframes frames */
+    void Submit(unsigned nframes)
+    {
+        Slot& s = slots_[next_submit_ % slots_.size()];
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            s.nframes = nframes;
+            s.index = next_submit_++;
+            s.state = Slot::Queued;
+        }
+        work_ready_.notify_one();
+    }
+
+    /** false once any write has failed */
+    bool Ok() const { return !failed_; }
+
+    /** drains pending blocks, stops the threads and finalizes STREAMINFO */
+    bool Close()
+    {
+        if(!open_)
+            return !failed_;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_ready_.notify_all();
+        block_done_.notify_all();
+        for(std::thread& t : workers_)
+            t.join();
+        writer_.join();
+        workers_.clear();
+
+        for(Group& grp : groups_)
+        {
+            uint64_t total = uint64_t(samples_written_);
+            if(fseek(grp.file, 0, SEEK_SET) != 0
+               || !FlacWriteStreamHeader(grp.file, sample_rate_, grp.channels, bps_, blocksize_,
+                                         grp.max_frame ? grp.min_frame : 0, grp.max_frame,
+                                         total))
+                failed_ = true;
+        }
+        CloseFiles();
+        open_ = false;
+        return !failed_;
+    }
+
+  private:
+    struct Slot
+    {
+        enum State
+        {
+            Free,
+            Queued,
+            Encoding,
+            Done
+        };
+        std::vector<float> frames;   // planar input
+        std::vector<int32_t> samples; // planar quantized
+        std::vector<std::vector<uint8_t>> encoded; // one frame per group
+        unsigned nframes = 0;
+        uint64_t index = 0;
+        State state = Free;
+    };
+
+    struct Group
+    {
+        unsigned first;
+        unsigned channels;
+        std::string path;
+        FILE* file;
+        uint32_t min_frame;
+        uint32_t max_frame;
+    };
+
+    static std::string GroupPath(const char* path, const Group& grp)
+    {
+        std::string p(path);
+        size_t dot = p.rfind('.');
+        size_t slash = p.rfind('/');
+        if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+            dot = p.size();
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "-ch%02u-%02u", grp.first + 1,
+                 grp.first + grp.channels);
+        return p.substr(0, dot) + suffix + p.substr(dot);
+    }
+
+    void CloseFiles()
+    {
+        for(Group& grp : groups_)
+        {
+            if(grp.file && fclose(grp.file) != 0)
+                failed_ = true;
+            grp.file = nullptr;
+        }
+    }
+
+    void Quantize(Slot& s, PcmConverter& conv)
+    {
+        for(unsigned c = 0; c < channels_; c++)
+            conv.ToInt(&s.frames[size_t(c) * blocksize_], s.nframes,
+                       &s.samples[size_t(c) * blocksize_]);
+    }
+
+    void WorkerLoop(unsigned id)
+    {
+        PcmConverter conv;
+        conv.Init(bps_, dither_, 0x9E3779B9u * (id + 1));
+        std::vector<FlacFrameEncoder> encoders(groups_.size());
+        for(size_t g = 0; g < groups_.size(); g++)
+            encoders[g].Init(groups_[g].channels, bps_, blocksize_);
+        const int32_t* planar[FLAC_MAX_CHANNELS];
+
+        while(true)
+        {
+            Slot* s = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_ready_.wait(lock, [&] { return stop_ || FindQueued() != nullptr; });
+                s = FindQueued();
+                if(!s)
+                    return; // stopping and nothing left to encode
+                s->state = Slot::Encoding;
+            }
+
+            Quantize(*s, conv);
+            for(size_t g = 0; g < groups_.size(); g++)
+            {
+                for(unsigned c = 0; c < groups_[g].channels; c++)
+                    planar[c] = &s->samples[size_t(groups_[g].first + c) * blocksize_];
+                s->encoded[g].clear();
+                encoders[g].Encode(planar, s->nframes, s->index, s->encoded[g]);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                s->state = Slot::Done;
+            }
+            block_done_.notify_all();
+        }
+    }
+
+    /** oldest queued slot, called with mutex_ held */
+    Slot* FindQueued()
+    {
+        Slot* oldest = nullptr;
+        for(Slot& s : slots_)
+            if(s.state == Slot::Queued && (!oldest || s.index < oldest->index))
+                oldest = &s;
+        return oldest;
+    }
+
+    void WriterLoop()
+    {
+        while(true)
+        {
+            Slot& s = slots_[next_write_ % slots_.size()];
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                block_done_.wait(lock, [&] {
+                    return (s.state == Slot::Done && s.index == next_write_)
+                           || (stop_ && next_write_ == next_submit_);
+                });
+                if(s.state != Slot::Done || s.index != next_write_)
+                    return; // stopping, everything written
+            }
+
+            for(size_t g = 0; g < groups_.size(); g++)
+            {
+                Group& grp = groups_[g];
+                const std::vector<uint8_t>& e = s.encoded[g];
+                if(!failed_ && fwrite(e.data(), 1, e.size(), grp.file) != e.size())
+                {
+                    fprintf(stderr, "cannot write FLAC output \"%s\"\n", grp.path.c_str());
+                    failed_ = true;
+                }
+                uint32_t size = uint32_t(e.size());
+                grp.min_frame = std::min(grp.min_frame, size);
+                grp.max_frame = std::max(grp.max_frame, size);
+            }
+            samples_written_ += s.nframes;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                s.state = Slot::Free;
+                next_write_++;
+            }
+            slot_free_.notify_all();
+        }
+    }
+
+    unsigned channels_ = 0;
+    unsigned sample_rate_ = 0;
+    unsigned bps_ = 16;
+    unsigned blocksize_ = 0;
+    bool dither_ = true;
+    bool open_ = false;
+    std::atomic<bool> failed_{false};
+
+    std::vector<Group> groups_;
+    std::vector<Slot> slots_;
+    std::vector<std::thread> workers_;
+    std::thread writer_;
+
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable block_done_;
+    std::condition_variable slot_free_;
+    bool stop_ = false;
+    uint64_t next_submit_ = 0; // disk thread only, read by writer under mutex_
+    uint64_t next_write_ = 0;
+    uint64_t samples_written_ = 0;
+};
+
+#endif
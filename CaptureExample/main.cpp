@@ -29,17 +29,33 @@
 #include <sndfile.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
+#include "flac_pipeline.h"
+#include "pcm_convert.h"
+#include "capture_telemetry.h"
+#include "decimator.h"
 
 typedef struct _thread_info {
     pthread_t thread_id;
     SNDFILE *sf;
-    jack_nframes_t duration;
+    uint64_t duration;		/* capture frames, 0: until stopped */
     jack_nframes_t rb_size;
     jack_client_t *client;
     unsigned int channels;
     int bitdepth;
+    unsigned int out_rate;	/* 0: the JACK rate */
+    int flac;
+    int dither;
+    unsigned int jobs;
+    int stats_interval;
+    int auto_tune;
+    FlacPipeline *encoder;
     char *path;
     volatile int can_capture;
     volatile int can_process;
@@ -53,22 +69,71 @@ jack_default_audio_sample_t **in;
 jack_nframes_t nframes;
 const size_t sample_size = sizeof(jack_default_audio_sample_t);
 
-/* Synchronization between process thread and disk thread. */
+/* Synchronization between process thread and disk thread.  Every
+ * port has its own ringbuffer of non-interleaved samples, so process()
+ * only does one copy per channel; interleaving happens in the disk
+ * thread. */
 #define DEFAULT_RB_SIZE 16384		/* ringbuffer size in frames */
-jack_ringbuffer_t *rb;
+#define DISK_BLOCK_FRAMES 4096		/* frames per disk write / FLAC frame */
+jack_ringbuffer_t **rbs;
+size_t *rb_peak_fill;			/* per channel, in bytes */
+long *channel_overruns;
 pthread_mutex_t disk_thread_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  data_ready = PTHREAD_COND_INITIALIZER;
 long overruns = 0;
+volatile sig_atomic_t stop_requested = 0;
+
+/* Live counters shared by process(), the disk thread and the monitor. */
+CaptureTelemetry telemetry;
+std::atomic<bool> monitor_running{false};
+
+static uint64_t
+monotonic_us ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 
 void *
 disk_thread (void *arg)
 {
 	jack_thread_info_t *info = (jack_thread_info_t *) arg;
-	static jack_nframes_t total_captured = 0;
+	static uint64_t total_captured = 0;
 	jack_nframes_t samples_per_frame = info->channels;
 	size_t bytes_per_frame = samples_per_frame * sample_size;
-	void *framebuf = malloc (bytes_per_frame);
+	float *framebuf = NULL;
+	float *planebuf = NULL;
+	char *pcmbuf = NULL;
+	jack_nframes_t fill = 0;
+	unsigned int chn;
+	PcmConverter pcm;
+	std::vector<Decimator> decimators;
+	float *rawbuf = NULL;
+
+	/* With -r every channel runs through its own decimator on the way
+	 * from the ringbuffers to the block; fill then counts output
+	 * frames, total_captured still counts input frames. */
+	if (info->out_rate) {
+		decimators.resize (info->channels);
+		for (chn = 0; chn < info->channels; chn++)
+			decimators[chn].Init (jack_get_sample_rate (info->client),
+					      info->out_rate, DISK_BLOCK_FRAMES);
+		rawbuf = (float *) malloc (DISK_BLOCK_FRAMES * bytes_per_frame);
+	}
+
+	/* 16 and 24 bit WAV is converted here, a block at a time, and
+	 * written raw; libsndfile only does the float path. */
+	if (!info->encoder) {
+		framebuf = (float *) malloc (DISK_BLOCK_FRAMES * bytes_per_frame);
+		planebuf = (float *) malloc (DISK_BLOCK_FRAMES * bytes_per_frame);
+		if (info->bitdepth == 16 || info->bitdepth == 24) {
+			pcm.Init (info->bitdepth, info->dither);
+			pcmbuf = (char *) malloc (DISK_BLOCK_FRAMES * samples_per_frame *
+						  pcm.BytesPerSample ());
+		}
+	}
 
 	pthread_setcanceltype (PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 	pthread_mutex_lock (&disk_thread_lock);
@@ -77,44 +142,125 @@ disk_thread (void *arg)
 
 	while (1) {
 
-		/* Write the data one frame at a time.  This is
-		 * inefficient, but makes things simpler. */
-		while (info->can_capture &&
-		       (jack_ringbuffer_read_space (rb) >= bytes_per_frame)) {
-
-			jack_ringbuffer_read (rb, (char *)framebuf, bytes_per_frame);
+		/* Move whole blocks out of the ringbuffers.  WAV output is
+		 * interleaved and written as soon as it is read; FLAC
+		 * output stays planar and collects a full
+		 * DISK_BLOCK_FRAMES block before handing it to the
+		 * encoder pool. */
+		while (info->can_capture) {
+
+			/* process() fills every channel or none, but may be
+			 * part way through a cycle, so take the shortest. */
+			jack_nframes_t avail = JACK_MAX_FRAMES;
+			for (chn = 0; chn < nports; chn++) {
+				jack_nframes_t space = jack_ringbuffer_read_space (rbs[chn]) / sample_size;
+				if (space < avail)
+					avail = space;
+			}
+			if (avail == 0)
+				break;
+
+			jack_nframes_t n = DISK_BLOCK_FRAMES - fill;
+			uint64_t write_start = monotonic_us ();
+
+			if (rawbuf)
+				n = decimators[0].MaxInput (DISK_BLOCK_FRAMES - fill);
+			if (n > avail)
+				n = avail;
+			if (info->duration && n > info->duration - total_captured)
+				n = info->duration - total_captured;
+
+			if (info->encoder && fill == 0)
+				framebuf = info->encoder->AcquireBlock ();
+
+			float *planes = info->encoder ? framebuf : planebuf;
+			jack_nframes_t produced = n;
+			for (chn = 0; chn < nports; chn++) {
+				float *dst = planes + chn * DISK_BLOCK_FRAMES + fill;
+
+				if (rawbuf) {
+					float *raw = rawbuf + chn * DISK_BLOCK_FRAMES;
+					jack_ringbuffer_read (rbs[chn], (char *) raw, n * sample_size);
+					produced = decimators[chn].Process (raw, n, dst);
+				} else {
+					jack_ringbuffer_read (rbs[chn], (char *) dst, n * sample_size);
+				}
+			}
+			fill += produced;
+			total_captured += n;
+
+			if (!info->encoder) {
+				for (chn = 0; chn < nports; chn++) {
+					const float *src = planebuf + chn * DISK_BLOCK_FRAMES;
+					float *dst = framebuf + chn;
+					for (jack_nframes_t i = 0; i < fill; i++)
+						dst[i * samples_per_frame] = src[i];
+				}
+			}
 
-			if (sf_writef_float (info->sf, (const float *)framebuf, 1) != 1) {
-				char errstr[256];
-				sf_error_str (0, errstr, sizeof (errstr) - 1);
-				fprintf (stderr,
-					 "cannot write sndfile (%s)\n",
-					 errstr);
-				info->status = EIO; /* write failed */
-				goto done;
+			if (info->encoder) {
+				if (fill == DISK_BLOCK_FRAMES) {
+					info->encoder->Submit (fill);
+					fill = 0;
+				}
+				if (!info->encoder->Ok ()) {
+					info->status = EIO; /* write failed */
+					goto done;
+				}
+			} else {
+				sf_count_t written;
+
+				if (pcmbuf) {
+					size_t bytes = pcm.ToPcm (framebuf, fill * samples_per_frame, pcmbuf);
+					written = sf_write_raw (info->sf, pcmbuf, bytes) /
+						(samples_per_frame * pcm.BytesPerSample ());
+				} else {
+					written = sf_writef_float (info->sf, framebuf, fill);
+				}
+				if (written != fill) {
+					char errstr[256];
+					sf_error_str (0, errstr, sizeof (errstr) - 1);
+					fprintf (stderr,
+						 "cannot write sndfile (%s)\n",
+						 errstr);
+					info->status = EIO; /* write failed */
+					goto done;
+				}
+				fill = 0;
 			}
-				
-			if (++total_captured >= info->duration) {
+
+			telemetry.Written (n, monotonic_us () - write_start);
+
+			if (info->duration && total_captured >= info->duration) {
 				printf ("disk thread finished\n");
 				goto done;
 			}
 		}
 
+		if (stop_requested)
+			goto done;
+
 		/* wait until process() signals more data */
 		pthread_cond_wait (&data_ready, &disk_thread_lock);
 	}
 
  done:
+	/* flush the last, short FLAC block */
+	if (info->encoder && fill > 0)
+		info->encoder->Submit (fill);
 	pthread_mutex_unlock (&disk_thread_lock);
-	free (framebuf);
+	if (!info->encoder)
+		free (framebuf);
+	free (planebuf);
+	free (pcmbuf);
+	free (rawbuf);
 	return 0;
 }
 	
 int
 process (jack_nframes_t nframes, void *arg)
 {
-	int chn;
-	size_t i;
+	unsigned int chn;
 	jack_thread_info_t *info = (jack_thread_info_t *) arg;
 
 	/* Do nothing until we're ready to begin. */
@@ -125,14 +271,35 @@ process (jack_nframes_t nframes, void *arg)
 		in[chn] = (jack_default_audio_sample_t *)jack_port_get_buffer
 			(ports[chn], nframes);
 
-	/* Sndfile requires interleaved data.  It is simpler here to
-	 * just queue interleaved samples to a single ringbuffer. */
-	for (i = 0; i < nframes; i++) {
+	/* Keep the channels aligned: either every ringbuffer takes the
+	 * whole cycle or none of them do. */
+	size_t bytes = nframes * sample_size;
+	int short_channel = -1;
+
+	telemetry.Cycle (nframes);
+
+	for (chn = 0; chn < nports; chn++) {
+		if (jack_ringbuffer_write_space (rbs[chn]) < bytes) {
+			channel_overruns[chn]++;
+			if (short_channel < 0)
+				short_channel = chn;
+		}
+	}
+
+	if (short_channel >= 0) {
+		overruns++;
+		telemetry.Overrun (jack_frame_time (info->client), short_channel);
+	} else {
+		size_t fill_max = 0;
 		for (chn = 0; chn < nports; chn++) {
-			if (jack_ringbuffer_write (rb, (const char *)(in[chn]+i), sample_size)
-			    < sample_size)
-				overruns++;
+			jack_ringbuffer_write (rbs[chn], (const char *) in[chn], bytes);
+			size_t filled = jack_ringbuffer_read_space (rbs[chn]);
+			if (filled > rb_peak_fill[chn])
+				rb_peak_fill[chn] = filled;
+			if (filled > fill_max)
+				fill_max = filled;
 		}
+		telemetry.Fill (fill_max);
 	}
 
 	/* Tell the disk thread there is work to do.  If it is already
@@ -156,14 +323,40 @@ jack_shutdown (void *arg)
 	abort();
 }
 
+void
+signal_handler (int sig)
+{
+	/* the disk thread notices on its next wakeup from process() */
+	stop_requested = 1;
+}
+
 void
 setup_disk_thread (jack_thread_info_t *info)
 {
 	SF_INFO sf_info;
 	int short_mask;
 	
-	sf_info.samplerate = jack_get_sample_rate (info->client);
+	jack_nframes_t capture_rate = jack_get_sample_rate (info->client);
+
+	sf_info.samplerate = capture_rate;
 	sf_info.channels = info->channels;
+
+	if (info->out_rate == capture_rate) {
+		info->out_rate = 0;
+	} else if (info->out_rate) {
+		Decimator probe;
+
+		if (!probe.Init (capture_rate, info->out_rate, DISK_BLOCK_FRAMES)) {
+			fprintf (stderr, "cannot resample %" PRIu32 " Hz to %u Hz, "
+				 "-r must be below the JACK rate\n",
+				 capture_rate, info->out_rate);
+			jack_client_close (info->client);
+			exit (1);
+		}
+		sf_info.samplerate = info->out_rate;
+		printf ("writing at %u Hz (x%u/%u, %zu taps per phase)\n",
+			info->out_rate, probe.Up (), probe.Down (), probe.Taps ());
+	}
 	
 	switch (info->bitdepth) {
 		case 8: short_mask = SF_FORMAT_PCM_U8;
@@ -179,7 +372,21 @@ setup_disk_thread (jack_thread_info_t *info)
 	}		 
 	sf_info.format = SF_FORMAT_WAV|short_mask;
 
-	if ((info->sf = sf_open (info->path, SFM_WRITE, &sf_info)) == NULL) {
+	if (info->flac) {
+		int bps = info->bitdepth ? info->bitdepth : 16;
+
+		if (bps != 16 && bps != 24) {
+			fprintf (stderr, "FLAC capture supports -b 16 or -b 24 only\n");
+			jack_client_close (info->client);
+			exit (1);
+		}
+		info->encoder = new FlacPipeline;
+		if (!info->encoder->Open (info->path, info->channels, sf_info.samplerate,
+					  bps, DISK_BLOCK_FRAMES, info->jobs, info->dither)) {
+			jack_client_close (info->client);
+			exit (1);
+		}
+	} else if ((info->sf = sf_open (info->path, SFM_WRITE, &sf_info)) == NULL) {
 		char errstr[256];
 		sf_error_str (0, errstr, sizeof (errstr) - 1);
 		fprintf (stderr, "cannot open sndfile \"%s\" for output (%s)\n", info->path, errstr);
@@ -187,23 +394,112 @@ setup_disk_thread (jack_thread_info_t *info)
 		exit (1);
 	}
 
-	if (info->duration == 0) {
-		info->duration = JACK_MAX_FRAMES;
-	} else {
-		info->duration *= sf_info.samplerate;
-	}
+	/* 64 bit, so neither a long -d nor an open ended capture wraps */
+	info->duration *= capture_rate;
 
 	info->can_capture = 0;
 
 	pthread_create (&info->thread_id, NULL, disk_thread, info);
 }
 
+static void
+print_overrun_events ()
+{
+	CaptureTelemetry::OverrunEvent ev;
+
+	while (telemetry.NextOverrun (ev))
+		fprintf (stderr, "overrun at frame %" PRIu32 " (input%u ringbuffer full)\n",
+			 ev.frame_time, ev.first_channel + 1);
+}
+
+static void
+print_stats (jack_thread_info_t *info, double seconds, uint64_t frames)
+{
+	jack_nframes_t rate = jack_get_sample_rate (info->client);
+	size_t ring_bytes = sample_size * info->rb_size;
+
+	fprintf (stderr,
+		 "%.0fs: %.2f MB/s, %.0f%% of realtime, ring peak %zu%%, "
+		 "write p50 %.1fms p99 %.1fms p99.9 %.1fms max %.1fms, %" PRIu64 " overruns\n",
+		 seconds,
+		 frames * info->channels * sample_size / seconds / 1e6,
+		 100.0 * frames / (seconds * rate),
+		 telemetry.FillHighWater () * 100 / ring_bytes,
+		 telemetry.LatencyPercentileUs (0.5) / 1000.0,
+		 telemetry.LatencyPercentileUs (0.99) / 1000.0,
+		 telemetry.LatencyPercentileUs (0.999) / 1000.0,
+		 telemetry.MaxLatencyUs () / 1000.0,
+		 telemetry.Overruns ());
+
+	if (info->auto_tune) {
+		jack_nframes_t rec = telemetry.RecommendedRingFrames (rate, DISK_BLOCK_FRAMES);
+		fprintf (stderr, "  recommended -B %" PRIu32 "%s\n", rec,
+			 rec > info->rb_size ? " (larger than current)" : "");
+	}
+}
+
+/* Reports overruns as they happen and, with -s, throughput and
+ * latency every interval.  Reads only the lock-free telemetry. */
+void *
+monitor_thread (void *arg)
+{
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	uint64_t start = monotonic_us ();
+	uint64_t last_report = start;
+	uint64_t last_frames = 0;
+
+	while (monitor_running) {
+		usleep (100000);
+		print_overrun_events ();
+
+		uint64_t now = monotonic_us ();
+		if (info->stats_interval > 0 &&
+		    now - last_report >= (uint64_t) info->stats_interval * 1000000) {
+			uint64_t frames = telemetry.FramesOut ();
+			print_stats (info, (now - last_report) / 1e6, frames - last_frames);
+			last_report = now;
+			last_frames = frames;
+		}
+	}
+	print_overrun_events ();
+
+	if (info->stats_interval > 0 || info->auto_tune) {
+		double seconds = (monotonic_us () - start) / 1e6;
+		fprintf (stderr, "capture summary:\n");
+		print_stats (info, seconds > 0 ? seconds : 1, telemetry.FramesOut ());
+	}
+	return 0;
+}
+
 void
 run_disk_thread (jack_thread_info_t *info)
 {
+	pthread_t monitor;
+
+	monitor_running = true;
+	pthread_create (&monitor, NULL, monitor_thread, info);
+
 	info->can_capture = 1;
 	pthread_join (info->thread_id, NULL);
-	sf_close (info->sf);
+
+	monitor_running = false;
+	pthread_join (monitor, NULL);
+	if (info->encoder) {
+		if (!info->encoder->Close ())
+			info->status = EIO;
+		delete info->encoder;
+		info->encoder = NULL;
+	} else {
+		sf_close (info->sf);
+	}
+	for (unsigned int chn = 0; chn < nports; chn++) {
+		if (channel_overruns[chn] > 0 ||
+		    rb_peak_fill[chn] * 2 > rbs[chn]->size) {
+			fprintf (stderr, "input%u: peak ringbuffer fill %zu%%, %ld overruns\n",
+				 chn + 1, rb_peak_fill[chn] * 100 / rbs[chn]->size,
+				 channel_overruns[chn]);
+		}
+	}
 	if (overruns > 0) {
 		fprintf (stderr,
 			 "jackrec failed with %ld overruns.\n", overruns);
@@ -224,7 +520,11 @@ setup_ports (int sources, char *source_names[], jack_thread_info_t *info)
 	ports = (jack_port_t **) malloc (sizeof (jack_port_t *) * nports);
 	in_size =  nports * sizeof (jack_default_audio_sample_t *);
 	in = (jack_default_audio_sample_t **) malloc (in_size);
-	rb = jack_ringbuffer_create (nports * sample_size * info->rb_size);
+	rbs = (jack_ringbuffer_t **) malloc (nports * sizeof (jack_ringbuffer_t *));
+	rb_peak_fill = (size_t *) calloc (nports, sizeof (size_t));
+	channel_overruns = (long *) calloc (nports, sizeof (long));
+	for (i = 0; i < nports; i++)
+		rbs[i] = jack_ringbuffer_create (sample_size * info->rb_size);
 
 	/* When JACK is running realtime, jack_activate() will have
 	 * called mlockall() to lock our pages into memory.  But, we
@@ -232,7 +532,8 @@ setup_ports (int sources, char *source_names[], jack_thread_info_t *info)
 	 * process() starts using them.  Otherwise, a page fault could
 	 * create a delay that would force JACK to shut us down. */
 	memset(in, 0, in_size);
-	memset(rb->buf, 0, rb->size);
+	for (i = 0; i < nports; i++)
+		memset(rbs[i]->buf, 0, rbs[i]->size);
 
 	for (i = 0; i < nports; i++) {
 		char name[64];
@@ -267,18 +568,27 @@ main (int argc, char *argv[])
 	int longopt_index = 0;
 	extern int optind, opterr;
 	int show_usage = 0;
-	const char *optstring = "d:f:b:B:h";
+	const char *optstring = "d:f:b:r:B:DFj:s:Ah";
 	struct option long_options[] = {
 		{ "help", 0, 0, 'h' },
 		{ "duration", 1, 0, 'd' },
 		{ "file", 1, 0, 'f' },
 		{ "bitdepth", 1, 0, 'b' },
+		{ "rate", 1, 0, 'r' },
 		{ "bufsize", 1, 0, 'B' },
+		{ "no-dither", 0, 0, 'D' },
+		{ "flac", 0, 0, 'F' },
+		{ "jobs", 1, 0, 'j' },
+		{ "stats", 1, 0, 's' },
+		{ "auto-tune", 0, 0, 'A' },
 		{ 0, 0, 0, 0 }
 	};
 
 	memset (&thread_info, 0, sizeof (thread_info));
 	thread_info.rb_size = DEFAULT_RB_SIZE;
+	thread_info.dither = 1;
+	thread_info.jobs = std::thread::hardware_concurrency () > 1 ?
+		std::thread::hardware_concurrency () - 1 : 1;
 	opterr = 0;
 
 	while ((c = getopt_long (argc, argv, optstring, long_options, &longopt_index)) != -1) {
@@ -291,7 +601,7 @@ main (int argc, char *argv[])
 			show_usage++;
 			break;
 		case 'd':
-			thread_info.duration = atoi (optarg);
+			thread_info.duration = strtoull (optarg, NULL, 10);
 			break;
 		case 'f':
 			thread_info.path = optarg;
@@ -299,9 +609,27 @@ main (int argc, char *argv[])
 		case 'b':
 			thread_info.bitdepth = atoi (optarg);
 			break;
+		case 'r':
+			thread_info.out_rate = atoi (optarg) > 0 ? atoi (optarg) : 0;
+			break;
 		case 'B':
 			thread_info.rb_size = atoi (optarg);
 			break;
+		case 'D':
+			thread_info.dither = 0;
+			break;
+		case 'F':
+			thread_info.flac = 1;
+			break;
+		case 'j':
+			thread_info.jobs = atoi (optarg) > 0 ? atoi (optarg) : 1;
+			break;
+		case 's':
+			thread_info.stats_interval = atoi (optarg);
+			break;
+		case 'A':
+			thread_info.auto_tune = 1;
+			break;
 		default:
 			fprintf (stderr, "error\n");
 			show_usage++;
@@ -310,7 +638,7 @@ main (int argc, char *argv[])
 	}
 
 	if (show_usage || thread_info.path == NULL || optind == argc) {
-		fprintf (stderr, "usage: jackrec -f filename [ -d second ] [ -b bitdepth ] [ -B bufsize ] port1 [ port2 ... ]\n");
+		fprintf (stderr, "usage: jackrec -f filename [ -d second ] [ -b bitdepth ] [ -r rate ] [ -D ] [ -B bufsize ] [ -F [ -j jobs ] ] [ -s seconds ] [ -A ] port1 [ port2 ... ]\n");
 		exit (1);
 	}
 
@@ -325,6 +653,9 @@ main (int argc, char *argv[])
 
 	setup_disk_thread (&thread_info);
 
+	signal (SIGINT, signal_handler);
+	signal (SIGTERM, signal_handler);
+
 	jack_set_process_callback (client, process, &thread_info);
 	jack_on_shutdown (client, jack_shutdown, &thread_info);
 
@@ -338,7 +669,8 @@ main (int argc, char *argv[])
 
 	jack_client_close (client);
 
-	jack_ringbuffer_free (rb);
+	for (unsigned int i = 0; i < nports; i++)
+		jack_ringbuffer_free (rbs[i]);
 
 	exit (0);
 }
\ No newline at end of file
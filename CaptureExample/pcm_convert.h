@@ -0,0 +1,152 @@
+#pragma once
+#ifndef PCM_CONVERT_H
+#define PCM_CONVERT_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/** Block float -> integer PCM conversion for the capture writer.
+
+Clips, adds TPDF dither (sum of two uniform 16 bit values from a per-lane
+xorshift32 generator, +-1 LSB triangular), rounds and packs to
+little-endian 16 or 24 bit. The inner loop works on four samples at a
+time using GCC vector extensions, which map onto NEON on the Pi and SSE
+on x86. One instance per thread; the dither state is not shared.
+*/
+class PcmConverter
+{
+  public:
+    typedef float f32x4 __attribute__((vector_size(16)));
+    typedef int32_t i32x4 __attribute__((vector_size(16)));
+    typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+    /** bits is 16 or 24 */
+    void Init(unsigned bits, bool dither, uint32_t seed = 0x9E3779B9u)
+    {
+        bits_ = bits;
+        dither_ = dither;
+        scale_ = float(1 << (bits - 1));
+        for(int l = 0; l < 4; l++)
+        {
+            // distinct non-zero seeds per lane
+            seed = seed * 1664525u + 1013904223u;
+            state_[l] = seed ? seed : 1;
+        }
+    }
+
+    unsigned Bits() const { return bits_; }
+    size_t BytesPerSample() const { return bits_ / 8; }
+
+    /** converts n samples to n integers in [-2^(bits-1), 2^(bits-1)-1] */
+    void ToInt(const float* in, size_t n, int32_t* out)
+    {
+        // work on local copies; the output stores could otherwise alias *this
+        u32x4 state = state_;
+        const float scale = scale_;
+        const bool dither = dither_;
+        size_t i = 0;
+        for(; i + 4 <= n; i += 4)
+        {
+            f32x4 v;
+            memcpy(&v, in + i, sizeof(v));
+            i32x4 q = Quantize4(v, scale, dither, state);
+            memcpy(out + i, &q, sizeof(q));
+        }
+        if(i < n)
+        {
+            f32x4 v = {0.0f, 0.0f, 0.0f, 0.0f};
+            memcpy(&v, in + i, (n - i) * sizeof(float));
+            i32x4 q = Quantize4(v, scale, dither, state);
+            memcpy(out + i, &q, (n - i) * sizeof(int32_t));
+        }
+        state_ = state;
+    }
+
+    /** converts n samples to packed little-endian PCM, returns bytes written */
+    size_t ToPcm(const float* in, size_t n, void* out)
+    {
+        uint8_t* dst = static_cast<uint8_t*>(out);
+        u32x4 state = state_;
+        const float scale = scale_;
+        const bool dither = dither_;
+        size_t i = 0;
+        if(bits_ == 16)
+        {
+            for(; i + 4 <= n; i += 4)
+            {
+                f32x4 v;
+                memcpy(&v, in + i, sizeof(v));
+                i32x4 q = Quantize4(v, scale, dither, state);
+                int16_t s[4] = {int16_t(q[0]), int16_t(q[1]), int16_t(q[2]), int16_t(q[3])};
+                memcpy(dst + i * 2, s, sizeof(s));
+            }
+        }
+        else
+        {
+            for(; i + 4 <= n; i += 4)
+            {
+                f32x4 v;
+                memcpy(&v, in + i, sizeof(v));
+                u32x4 q = (u32x4)Quantize4(v, scale, dither, state);
+                // four 24 bit samples into three 32 bit words
+                uint32_t w[3] = {(q[0] & 0xFFFFFFu) | (q[1] << 24),
+                                 ((q[1] >> 8) & 0xFFFFu) | (q[2] << 16),
+                                 ((q[2] >> 16) & 0xFFu) | (q[3] << 8)};
+                memcpy(dst + i * 3, w, sizeof(w));
+            }
+        }
+        state_ = state;
+        if(i < n)
+        {
+            int32_t tail[4];
+            ToInt(in + i, n - i, tail);
+            for(size_t j = 0; j < n - i; j++)
+                PackScalar(dst + (i + j) * BytesPerSample(), tail[j]);
+        }
+        return n * BytesPerSample();
+    }
+
+  private:
+    static inline i32x4 Quantize4(f32x4 v, float scale, bool dither, u32x4& state)
+    {
+        const f32x4 one = {1.0f, 1.0f, 1.0f, 1.0f};
+        v = v > one ? one : v;
+        v = v < -one ? -one : v;
+        v *= scale;
+        if(dither)
+        {
+            u32x4 s = state;
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            state = s;
+            // two 16 bit uniforms summed -> triangular in [-1, 1) LSB
+            i32x4 tri = (i32x4)(s & 0xFFFFu) + (i32x4)(s >> 16) - 65536;
+            v += __builtin_convertvector(tri, f32x4) * (1.0f / 65536.0f);
+        }
+        const f32x4 half = {0.5f, 0.5f, 0.5f, 0.5f};
+        v += v < 0.0f ? -half : half;
+        i32x4 q = __builtin_convertvector(v, i32x4);
+        const int32_t lim = int32_t(scale);
+        const i32x4 hi = {lim - 1, lim - 1, lim - 1, lim - 1};
+        const i32x4 lo = -hi - 1;
+        q = q > hi ? hi : q;
+        q = q < lo ? lo : q;
+        return q;
+    }
+
+    inline void PackScalar(uint8_t* dst, int32_t s) const
+    {
+        dst[0] = uint8_t(s);
+        dst[1] = uint8_t(s >> 8);
+        if(bits_ == 24)
+            dst[2] = uint8_t(s >> 16);
+    }
+
+    unsigned bits_ = 16;
+    bool dither_ = true;
+    float scale_ = 32768.0f;
+    u32x4 state_ = {1, 2, 3, 4};
+};
+
+#endif
@@ -0,0 +1,300 @@
+#pragma once
+#ifndef DSP_GRAPH_H
+#define DSP_GRAPH_H
+#include <stddef.h>
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "dsp_node.h"
+#include "state_swap.h"
+
+/** Statically scheduled graph of DspNodes inside one JACK client
+
+Build() sorts the nodes so that every node runs after everything
+feeding it, and carves one arena into an output buffer per node port.
+Process() then just walks that order. An input with one source reads the
+source's buffer directly; an input fed by several sources gets its own
+preallocated mix buffer; an unconnected input reads a shared silent
+buffer. Nothing allocates after Build() except Resize().
+
+Resize() and SetSampleRate() run off the process thread (the JACK
+buffer size and sample rate callbacks): the buffers for a longer period
+and the nodes' state for a new rate are built there and swapped in at
+the start of the next cycle, so Process() never allocates. Reclaim()
+later frees what was replaced.
+
+Endpoints use node index -1 for the host's own JACK ports.
+*/
+class DspGraph
+{
+  public:
+    static constexpr int kHost = -1;
+
+    struct Endpoint
+    {
+        int    node;
+        size_t port;
+    };
+
+    void SetHostPorts(size_t inputs, size_t outputs)
+    {
+        host_inputs_ = inputs;
+        host_sources_.assign(outputs, std::vector<Endpoint>());
+    }
+
+    size_t HostInputs() const { return host_inputs_; }
+    size_t HostOutputs() const { return host_sources_.size(); }
+
+    /** index of the new node, -1 if the name is taken */
+    int AddNode(const std::string& name, std::unique_ptr<DspNode> dsp)
+    {
+        if(Find(name) >= 0)
+            return -1;
+        Slot s;
+        s.name = name;
+        s.sources.assign(dsp->Inputs(), std::vector<Endpoint>());
+        s.dsp = std::move(dsp);
+        nodes_.push_back(std::move(s));
+        return int(nodes_.size()) - 1;
+    }
+
+    int Find(const std::string& name) const
+    {
+        for(size_t i = 0; i < nodes_.size(); i++)
+            if(nodes_[i].name == name)
+                return int(i);
+        return -1;
+    }
+
+    DspNode* Node(int index) { return nodes_[index].dsp.get(); }
+    const std::string& Name(int index) const { return nodes_[index].name; }
+    size_t Nodes() const { return nodes_.size(); }
+
+    /** src is a node output or host input, dst a node input or host
+        output; several sources into one input are summed */
+    bool Connect(Endpoint src, Endpoint dst, std::string& err)
+    {
+        size_t src_ports = src.node == kHost ? host_inputs_ : nodes_[src.node].dsp->Outputs();
+        size_t dst_ports = dst.node == kHost ? host_sources_.size() : nodes_[dst.node].sources.size();
+        if(src.port >= src_ports || dst.port >= dst_ports)
+        {
+            err = "port out of range";
+            return false;
+        }
+        if(src.node != kHost && src.node == dst.node)
+        {
+            err = "node connected to itself";
+            return false;
+        }
+        if(dst.node == kHost)
+            host_sources_[dst.port].push_back(src);
+        else
+            nodes_[dst.node].sources[dst.port].push_back(src);
+        return true;
+    }
+
+    /** topological order and buffers; fails on a feedback loop */
+    bool Build(size_t max_block, std::string& err)
+    {
+        // Kahn's algorithm, ties broken by declaration order
+        std::vector<size_t> pending(nodes_.size(), 0);
+        for(size_t n = 0; n < nodes_.size(); n++)
+            for(auto& srcs : nodes_[n].sources)
+                for(auto& e : srcs)
+                    if(e.node != kHost)
+                        pending[n]++;
+
+        order_.clear();
+        std::vector<bool> done(nodes_.size(), false);
+        while(order_.size() < nodes_.size())
+        {
+            int ready = -1;
+            for(size_t n = 0; n < nodes_.size() && ready < 0; n++)
+                if(!done[n] && pending[n] == 0)
+                    ready = int(n);
+            if(ready < 0)
+            {
+                err = "feedback loop between nodes:";
+                for(size_t n = 0; n < nodes_.size(); n++)
+                    if(!done[n])
+                        err += " " + nodes_[n].name;
+                return false;
+            }
+            done[ready] = true;
+            order_.push_back(ready);
+            for(size_t n = 0; n < nodes_.size(); n++)
+                for(auto& srcs : nodes_[n].sources)
+                    for(auto& e : srcs)
+                        if(e.node == ready)
+                            pending[n]--;
+        }
+
+        for(auto& s : nodes_)
+            s.in.assign(s.sources.size(), nullptr);
+        max_block_ = max_block;
+        layout_.Reset(MakeLayout(max_block));
+        return true;
+    }
+
+    /** buffers for blocks of up to max_block frames, from the next cycle
+        on; not for the process callback */
+    void Resize(size_t max_block)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_block_ = max_block;
+        layout_.Publish(MakeLayout(max_block));
+    }
+
+    /** every node rebuilds its rate dependent state for sample_rate;
+        not for the process callback */
+    void SetSampleRate(float sample_rate)
+    {
+        for(auto& s : nodes_)
+            s.dsp->SetSampleRate(sample_rate);
+    }
+
+    /** frees buffers and node state replaced by Resize() and
+        SetSampleRate(), once the process thread is done with them */
+    void Reclaim()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            layout_.Reclaim();
+        }
+        for(auto& s : nodes_)
+            s.dsp->Reclaim();
+    }
+
+    size_t MaxBlock() const { return max_block_; }
+    const std::vector<int>& Order() const { return order_; }
+
+    /** runs one cycle; host_out buffers are fully written */
+    void Process(const float* const* host_in,
+                 float* const*       host_out,
+                 size_t              nframes,
+                 const MidiEvent*    midi,
+                 size_t              nmidi)
+    {
+        // buffers for a new period take over here
+        const Layout& l = *layout_.Acquire();
+        if(nframes > l.max_block)
+        {
+            // only if the period grew without Resize(); never overrun
+            for(size_t o = 0; o < host_sources_.size(); o++)
+                memset(host_out[o], 0, nframes * sizeof(float));
+            return;
+        }
+
+        for(int n : order_)
+        {
+            Slot& s = nodes_[n];
+            for(size_t i = 0; i < s.sources.size(); i++)
+                s.in[i] = Gather(l, s.sources[i], l.mix[n][i], nframes, host_in);
+            s.dsp->Process(s.in.data(), l.out[n].data(), nframes, midi, nmidi);
+        }
+
+        for(size_t o = 0; o < host_sources_.size(); o++)
+        {
+            const float* src = Gather(l, host_sources_[o], host_out[o], nframes, host_in);
+            if(src != host_out[o])
+                memcpy(host_out[o], src, nframes * sizeof(float));
+        }
+    }
+
+  private:
+    struct Slot
+    {
+        std::string                       name;
+        std::unique_ptr<DspNode>          dsp;
+        std::vector<std::vector<Endpoint>> sources; // per input
+        std::vector<const float*>         in;      // resolved each cycle
+    };
+
+    // every buffer for one maximum block size, carved from one arena
+    struct Layout
+    {
+        size_t                           max_block;
+        std::vector<float>               arena;
+        float*                           zero; // shared silence
+        std::vector<std::vector<float*>> out;  // per node output
+        std::vector<std::vector<float*>> mix;  // per node input, fan-in > 1 only
+    };
+
+    std::unique_ptr<Layout> MakeLayout(size_t max_block) const
+    {
+        size_t buffers = 1; // shared silence
+        for(auto& s : nodes_)
+        {
+            buffers += s.dsp->Outputs();
+            for(auto& srcs : s.sources)
+                buffers += srcs.size() > 1 ? 1 : 0;
+        }
+        std::unique_ptr<Layout> l(new Layout);
+        l->max_block = max_block;
+        l->arena.assign(buffers * max_block, 0.0f);
+
+        float* next = l->arena.data();
+        l->zero = next;
+        next += max_block;
+        l->out.resize(nodes_.size());
+        l->mix.resize(nodes_.size());
+        for(size_t n = 0; n < nodes_.size(); n++)
+        {
+            const Slot& s = nodes_[n];
+            l->out[n].assign(s.dsp->Outputs(), nullptr);
+            for(auto& o : l->out[n])
+            {
+                o = next;
+                next += max_block;
+            }
+            l->mix[n].assign(s.sources.size(), nullptr);
+            for(size_t i = 0; i < s.sources.size(); i++)
+            {
+                if(s.sources[i].size() > 1)
+                {
+                    l->mix[n][i] = next;
+                    next += max_block;
+                }
+            }
+        }
+        return l;
+    }
+
+    inline const float* Resolve(const Layout& l, const Endpoint& e, const float* const* host_in) const
+    {
+        return e.node == kHost ? host_in[e.port] : l.out[e.node][e.port];
+    }
+
+    /** buffer holding the sum of srcs, using scratch only when summing */
+    inline const float* Gather(const Layout&                l,
+                               const std::vector<Endpoint>& srcs,
+                               float*                       scratch,
+                               size_t                       nframes,
+                               const float* const*          host_in) const
+    {
+        if(srcs.empty())
+            return l.zero;
+        if(srcs.size() == 1)
+            return Resolve(l, srcs[0], host_in);
+        memcpy(scratch, Resolve(l, srcs[0], host_in), nframes * sizeof(float));
+        for(size_t s = 1; s < srcs.size(); s++)
+        {
+            const float* src = Resolve(l, srcs[s], host_in);
+            for(size_t i = 0; i < nframes; i++)
+                scratch[i] += src[i];
+        }
+        return scratch;
+    }
+
+    std::vector<Slot>                  nodes_;
+    std::vector<std::vector<Endpoint>> host_sources_; // per host output
+    size_t                             host_inputs_ = 0;
+    std::vector<int>                   order_;
+    StateSwap<Layout>                  layout_;
+    std::mutex                         mutex_;  // Resize vs Reclaim
+    size_t                             max_block_ = 0; // last built
+};
+
+#endif
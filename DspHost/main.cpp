@@ -0,0 +1,304 @@
+/** DspHost: several DSP apps as nodes of one JACK client
+
+usage: dspHost [-n client_name] config_file
+
+The config file is read line by line, '#' starts a comment:
+
+    inputs 2                           host audio inputs in_1..in_N
+    outputs 2                          host audio outputs out_1..out_N
+    node <name> <type> [key=value...]  type: synth440 | passthru | multidelay
+    connect <from> <to>                from: in:N or <node>:N (output N)
+                                       to:   out:N or <node>:N (input N)
+    jack <port> in:N                   connect an outside port to a host input
+    jack out:N <port>                  and a host output to an outside port
+    midi <port>                        connect an outside MIDI port to midi_in
+
+Ports are numbered from 1. Every node sees the MIDI arriving on midi_in.
+*/
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "dsp_graph.h"
+#include "jack_midi.h"
+#include "synth_dsp.h"
+#include "passthru_dsp.h"
+#include "multidelay_dsp.h"
+
+jack_client_t* client = nullptr;
+std::vector<jack_port_t*> input_ports;
+std::vector<jack_port_t*> output_ports;
+jack_port_t* midi_in = nullptr;
+
+// per cycle port buffers, sized before activation
+std::vector<const float*> host_in;
+std::vector<float*> host_out;
+static MidiEvent midi_events[kMaxMidiEvents];
+
+static DspGraph graph;
+std::atomic<bool> running{true};
+
+struct JackLink {
+    std::string from, to;   // one side is a host port name
+};
+std::vector<JackLink> jack_links;
+std::vector<std::string> midi_links;
+
+std::unique_ptr<DspNode> make_node(const std::string& type)
+{
+    if (type == "synth440") return std::unique_ptr<DspNode>(new Synth440Dsp);
+    if (type == "passthru") return std::unique_ptr<DspNode>(new PassthruDsp);
+    if (type == "multidelay") return std::unique_ptr<DspNode>(new MultiDelayDsp);
+    return nullptr;
+}
+
+// "name:N" -> endpoint, with "in" / "out" naming the host ports
+bool parse_endpoint(const std::string& s, bool source, DspGraph::Endpoint& ep, std::string& err)
+{
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos || colon + 1 == s.size()) {
+        err = "expected <node>:<port>, got " + s;
+        return false;
+    }
+    std::string name = s.substr(0, colon);
+    long port = strtol(s.c_str() + colon + 1, nullptr, 10);
+    if (port < 1) {
+        err = "ports are numbered from 1: " + s;
+        return false;
+    }
+    ep.port = size_t(port - 1);
+    if (name == (source ? "in" : "out")) {
+        ep.node = DspGraph::kHost;
+        return true;
+    }
+    ep.node = graph.Find(name);
+    if (ep.node < 0) {
+        err = "unknown node " + name;
+        return false;
+    }
+    return true;
+}
+
+bool load_config(const char* path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return false;
+    }
+
+    size_t inputs = 0, outputs = 0;
+    bool ports_fixed = false;
+    std::string line;
+    int line_no = 0;
+    while (std::getline(file, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string cmd;
+        if (!(words >> cmd))
+            continue;
+
+        std::string err;
+        if (cmd == "inputs" || cmd == "outputs") {
+            size_t n = 0;
+            if (ports_fixed || !(words >> n)) {
+                err = cmd + " needs a count and must come before any connect";
+            } else {
+                (cmd == "inputs" ? inputs : outputs) = n;
+                graph.SetHostPorts(inputs, outputs);
+            }
+        } else if (cmd == "node") {
+            std::string name, type, kv;
+            std::unique_ptr<DspNode> node;
+            if (!(words >> name >> type)) {
+                err = "node needs a name and a type";
+            } else if (name == "in" || name == "out") {
+                err = "in and out are reserved for the host ports";
+            } else if (!(node = make_node(type))) {
+                err = "unknown node type " + type;
+            } else {
+                while (err.empty() && words >> kv) {
+                    size_t eq = kv.find('=');
+                    if (eq == std::string::npos || !node->Configure(kv.substr(0, eq), kv.substr(eq + 1)))
+                        err = "bad setting " + kv + " for " + type;
+                }
+                if (err.empty() && graph.AddNode(name, std::move(node)) < 0)
+                    err = "duplicate node name " + name;
+            }
+        } else if (cmd == "connect") {
+            std::string from, to;
+            DspGraph::Endpoint src, dst;
+            ports_fixed = true;
+            if (!(words >> from >> to))
+                err = "connect needs a source and a destination";
+            else if (parse_endpoint(from, true, src, err) && parse_endpoint(to, false, dst, err))
+                graph.Connect(src, dst, err);
+        } else if (cmd == "jack") {
+            JackLink link;
+            if (!(words >> link.from >> link.to))
+                err = "jack needs two ports";
+            else
+                jack_links.push_back(link);
+        } else if (cmd == "midi") {
+            std::string port;
+            if (!(words >> port))
+                err = "midi needs a port";
+            else
+                midi_links.push_back(port);
+        } else {
+            err = "unknown directive " + cmd;
+        }
+
+        if (!err.empty()) {
+            std::cerr << path << ":" << line_no << ": " << err << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// host port name for "in:N" / "out:N", otherwise the name unchanged
+std::string resolve_port(const std::string& s)
+{
+    const char* name = jack_get_client_name(client);
+    if (s.compare(0, 3, "in:") == 0) return std::string(name) + ":in_" + s.substr(3);
+    if (s.compare(0, 4, "out:") == 0) return std::string(name) + ":out_" + s.substr(4);
+    return s;
+}
+
+// === JACK AUDIO CALLBACK ===
+int process(jack_nframes_t nframes, void*)
+{
+    for (size_t i = 0; i < input_ports.size(); i++)
+        host_in[i] = (const float*)jack_port_get_buffer(input_ports[i], nframes);
+    for (size_t o = 0; o < output_ports.size(); o++)
+        host_out[o] = (float*)jack_port_get_buffer(output_ports[o], nframes);
+
+    size_t nmidi = CollectMidi(jack_port_get_buffer(midi_in, nframes), midi_events, kMaxMidiEvents);
+    graph.Process(host_in.data(), host_out.data(), nframes, midi_events, nmidi);
+    return 0;
+}
+
+// notification thread: the graph builds larger buffers here and the
+// process callback swaps them in at the top of its next cycle
+int on_buffer_size(jack_nframes_t nframes, void*)
+{
+    if (nframes > graph.MaxBlock())
+        graph.Resize(nframes);
+    return 0;
+}
+
+// notification thread, likewise: every node rebuilds for the new rate
+int on_sample_rate(jack_nframes_t rate, void*)
+{
+    graph.SetSampleRate(float(rate));
+    return 0;
+}
+
+void jack_shutdown(void*)
+{
+    std::cerr << "JACK shut down unexpectedly!" << std::endl;
+    exit(1);
+}
+
+void signal_handler(int) {
+    running = false;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* client_name = "jack_dsp_host";
+    int c;
+    while ((c = getopt(argc, argv, "n:h")) != -1) {
+        switch (c) {
+            case 'n': client_name = optarg; break;
+            default:
+                std::cerr << "usage: dspHost [-n client_name] config_file" << std::endl;
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "usage: dspHost [-n client_name] config_file" << std::endl;
+        return 1;
+    }
+
+    if (!load_config(argv[optind]))
+        return 1;
+
+    std::signal(SIGINT, signal_handler);
+
+    jack_status_t status;
+    client = jack_client_open(client_name, JackNullOption, &status);
+    if (!client) {
+        std::cerr << "Failed to open JACK client" << std::endl;
+        return 1;
+    }
+
+    std::string err;
+    if (!graph.Build(jack_get_buffer_size(client), err)) {
+        std::cerr << err << std::endl;
+        jack_client_close(client);
+        return 1;
+    }
+    for (size_t n = 0; n < graph.Nodes(); n++)
+        graph.Node(int(n))->Init(jack_get_sample_rate(client));
+
+    for (size_t i = 0; i < graph.HostInputs(); i++) {
+        std::string name = "in_" + std::to_string(i + 1);
+        input_ports.push_back(jack_port_register(client, name.c_str(), JACK_DEFAULT_AUDIO_TYPE,
+                                                 JackPortIsInput, 0));
+    }
+    for (size_t o = 0; o < graph.HostOutputs(); o++) {
+        std::string name = "out_" + std::to_string(o + 1);
+        output_ports.push_back(jack_port_register(client, name.c_str(), JACK_DEFAULT_AUDIO_TYPE,
+                                                  JackPortIsOutput, 0));
+    }
+    midi_in = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+    host_in.assign(input_ports.size(), nullptr);
+    host_out.assign(output_ports.size(), nullptr);
+
+    jack_set_process_callback(client, process, nullptr);
+    jack_set_buffer_size_callback(client, on_buffer_size, nullptr);
+    jack_set_sample_rate_callback(client, on_sample_rate, nullptr);
+    jack_on_shutdown(client, jack_shutdown, nullptr);
+
+    if (jack_activate(client)) {
+        std::cerr << "Cannot activate JACK client" << std::endl;
+        return 1;
+    }
+
+    for (auto& link : jack_links) {
+        std::string from = resolve_port(link.from), to = resolve_port(link.to);
+        if (jack_connect(client, from.c_str(), to.c_str()) != 0)
+            std::cerr << "Could not connect " << from << " -> " << to << std::endl;
+    }
+    for (auto& port : midi_links) {
+        if (jack_connect(client, port.c_str(), jack_port_name(midi_in)) != 0)
+            std::cerr << "Could not connect " << port << " -> midi_in" << std::endl;
+    }
+
+    std::cout << "DSP host running " << graph.Nodes() << " node(s) in order:";
+    for (int n : graph.Order())
+        std::cout << " " << graph.Name(n);
+    std::cout << std::endl << "Press Ctrl+C to quit." << std::endl;
+
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        graph.Reclaim();
+    }
+
+    jack_client_close(client);
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Serial vs fork-join delay bank cost per JACK period, to find where the
+// worker pool starts to pay off (MultiDelayDsp's parallel_min).
+//
+// usage: multiDelay_bench [-j workers] [-s seconds per point]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "multidelay_dsp.h"
+
+// mean microseconds per period over roughly `seconds` of audio
+static double time_period(MultiDelayDsp& dsp, size_t period, double seconds)
+{
+    std::vector<float> inL(period), inR(period), outL(period), outR(period);
+    uint32_t noise = 22222;
+    for (size_t i = 0; i < period; i++) {
+        // never silent, so the idle bypass stays out of the way
+        noise ^= noise << 13; noise ^= noise >> 17; noise ^= noise << 5;
+        inL[i] = (int32_t(noise) * (1.0f / 2147483648.0f)) * 0.25f;
+        inR[i] = -inL[i];
+    }
+    const float* in[2] = {inL.data(), inR.data()};
+    float* out[2] = {outL.data(), outR.data()};
+
+    size_t cycles = std::max<size_t>(50, size_t(seconds * 48000.0 / period));
+    for (size_t c = 0; c < 20; c++) // warm caches and wake the workers
+        dsp.Process(in, out, period, nullptr, 0);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t c = 0; c < cycles; c++)
+        dsp.Process(in, out, period, nullptr, 0);
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(t1 - t0).count() / cycles;
+}
+
+static std::unique_ptr<MultiDelayDsp> make_bank(int lines, size_t workers)
+{
+    std::unique_ptr<MultiDelayDsp> dsp(new MultiDelayDsp);
+    dsp->Configure("lines", std::to_string(lines));
+    dsp->Configure("jobs", std::to_string(workers));
+    dsp->Configure("parallel_min", "0");
+    dsp->Configure("feedback", "0.5");
+    dsp->Configure("rtprio", "70");
+    dsp->Init(48000.0f);
+    return dsp;
+}
+
+int main(int argc, char* argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 1 ? size_t(cpus - 1) : 1;
+    double seconds = 0.5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:s:h")) != -1) {
+        switch (opt) {
+            case 'j': workers = strtoul(optarg, nullptr, 10); break;
+            case 's': seconds = strtod(optarg, nullptr); break;
+            default:
+                fprintf(stderr, "usage: multiDelay_bench [-j workers] [-s seconds per point]\n");
+                return 1;
+        }
+    }
+
+    const size_t periods[] = {32, 64, 128, 256, 512, 1024};
+    const int line_counts[] = {1, 2, 4, 8, 16, 32, 64};
+
+    workers = make_bank(1, workers)->Workers(); // capped at one per spare core
+    if (workers == 0) {
+        printf("no spare core for a worker, nothing to compare\n");
+        return 0;
+    }
+    printf("%zu worker(s) + caller, us per period (serial / parallel)\n\n", workers);
+    printf("%8s", "lines");
+    for (size_t p : periods)
+        printf(" %19zu", p);
+    printf("\n");
+
+    int crossover[sizeof(periods) / sizeof(periods[0])];
+    std::fill(crossover, crossover + sizeof(periods) / sizeof(periods[0]), -1);
+
+    for (int lines : line_counts) {
+        auto serial = make_bank(lines, 0);
+        auto parallel = make_bank(lines, workers);
+        if (lines == line_counts[0] && parallel->RealtimeWorkers() < workers)
+            fprintf(stderr, "(workers are not SCHED_FIFO here, expect noisier numbers)\n");
+
+        printf("%8d", lines);
+        for (size_t p = 0; p < sizeof(periods) / sizeof(periods[0]); p++) {
+            double s = time_period(*serial, periods[p], seconds);
+            double q = time_period(*parallel, periods[p], seconds);
+            printf("  %8.1f / %8.1f", s, q);
+            // a single line never forks; ask for a clear win, not noise
+            if (lines > 1 && q < 0.9 * s && crossover[p] < 0)
+                crossover[p] = lines;
+        }
+        printf("\n");
+    }
+
+    printf("\ncrossover (fewest lines where parallel wins):\n");
+    for (size_t p = 0; p < sizeof(periods) / sizeof(periods[0]); p++) {
+        if (crossover[p] < 0)
+            printf("  period %4zu: serial always faster\n", periods[p]);
+        else
+            printf("  period %4zu: %2d lines, parallel_min ~ %zu\n", periods[p], crossover[p],
+                   size_t(crossover[p]) * std::min(periods[p], MultiDelayDsp::kChunk));
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+// MultiDelay as a JACK internal client, loaded into jackd with
+//   jack_load multidelay multidelay -i "feedback=0.3 fifo=/tmp/multidelay.ctl"
+// (multidelay.so has to be in jackd's internal client directory)
+#include "internal_client.h"
+#include "multidelay_dsp.h"
+
+extern "C" int jack_initialize(jack_client_t* client, const char* load_init)
+{
+    InternalClient* host = new InternalClient(client, new MultiDelayDsp,
+                                              {"input_L", "input_R"}, {"output_L", "output_R"});
+    if (host->Start(load_init) != 0) {
+        delete host;
+        return 1;
+    }
+    return 0;
+}
+
+extern "C" void jack_finish(void* arg)
+{
+    delete static_cast<InternalClient*>(arg);
+}
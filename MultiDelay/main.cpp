@@ -5,25 +5,16 @@
 #include <chrono>
 #include <csignal>
 #include <atomic>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <math.h>
+#include <sndfile.h>
 
-#include "../external/DaisySP/Source/daisysp.h"
-using namespace daisysp;
-
-constexpr int NUM_DELAYS = 4;          // Number of stereo delay lines
-constexpr size_t MAX_DELAY_MS = 1000.0f; // Max delay time in milliseconds
-constexpr size_t MIN_DELAY_MS = 50.0f;
-
-
-// constexpr float FEEDBACK = 0.4f;       // Shared feedback amount
-
-
-
-// A pair of delays for stereo
-struct StereoDelay {
-    DelayLine<float, MAX_DELAY_MS * 48 + 1> left;
-    DelayLine<float, MAX_DELAY_MS * 48 + 1> right;
-    float delayTimeMs;
-};
+#include "cc_log.h"
+#include "jack_midi.h"
+#include "multidelay_dsp.h"
+#include "snapshot.h"
 
 struct MidiCC {
     uint8_t cc;
@@ -60,85 +51,52 @@ jack_port_t *midi_in;
 jack_client_t *client;
 
 std::atomic<bool> running{true};
-std::atomic<float> FEEDBACK;
-float sampleRate;
 
+// CCs are applied in the callback; the queue only feeds the console log
 RingBuf<MidiCC, 256> midiQueue;
 
-
-std::vector<StereoDelay> delays;
-std::vector<float> delayTimes;
-Svf filters[2];
-
-// Simple helper to randomize float in range
-float randomFloat(float min, float max) {
-    static std::mt19937 rng{std::random_device{}()};
-    std::uniform_real_distribution<float> dist(min, max);
-    return dist(rng);
-}
+static MultiDelayDsp dsp;
+static Snapshotter snapshots;
+static MidiEvent midiEvents[kMaxMidiEvents];
+static CcRecorder ccRecorder;
+static CcPlayer ccPlayer;
+static bool replaying = false;
 
 // JACK audio callback
 int audioCallback(jack_nframes_t nframes, void *arg) {
-    auto *inL = (float *)jack_port_get_buffer(input_l, nframes);
-    auto *inR = (float *)jack_port_get_buffer(input_r, nframes);
-    auto *outL = (float *)jack_port_get_buffer(output_l, nframes);
-    auto *outR = (float *)jack_port_get_buffer(output_r, nframes);
-
-    void* midiBuf = jack_port_get_buffer(midi_in, nframes);
-    jack_nframes_t eventCount = jack_midi_get_event_count(midiBuf);
-    jack_midi_event_t event;
-
-    for (jack_nframes_t i = 0; i < eventCount; ++i) {
-        if (jack_midi_event_get(&event, midiBuf, i) == 0) {
-            const uint8_t* data = event.buffer;
-
-            if ((data[0] & 0xF0) == 0xB0) { // CC message on any channel
-                MidiCC ccMsg{ data[1], data[2] };
-                midiQueue.push(ccMsg);     // very fast lock-free enqueue
-            }
+    const float *in[2] = {
+        (float *)jack_port_get_buffer(input_l, nframes),
+        (float *)jack_port_get_buffer(input_r, nframes),
+    };
+    float *out[2] = {
+        (float *)jack_port_get_buffer(output_l, nframes),
+        (float *)jack_port_get_buffer(output_r, nframes),
+    };
+
+    size_t nmidi = CollectMidi(jack_port_get_buffer(midi_in, nframes), midiEvents, kMaxMidiEvents);
+    if (replaying)
+        nmidi = ccPlayer.Next(nframes, midiEvents, kMaxMidiEvents); // the log stands in for the controller
+    ccRecorder.Record(midiEvents, nmidi, nframes);
+
+    for (size_t i = 0; i < nmidi; ++i) {
+        const uint8_t* data = midiEvents[i].data;
+
+        if (midiEvents[i].size >= 3 && (data[0] & 0xF0) == 0xB0) { // CC message on any channel
+            MidiCC ccMsg{ data[1], data[2] };
+            midiQueue.push(ccMsg);     // very fast lock-free enqueue
         }
     }
 
-    for (jack_nframes_t i = 0; i < nframes; ++i) {
-
-        static float delayTimeFiltered[NUM_DELAYS]{};
-
-        for(size_t d=0; d<NUM_DELAYS; d++)
-        {
-            //fitler then set delay time 
-            float delaySamples = delayTimes[d] * (sampleRate / 1000.0f);
-            fonepole(delayTimeFiltered[d],delaySamples,0.001f);
-            delays[d].left.SetDelay(delayTimeFiltered[d]);
-            delays[d].right.SetDelay(delayTimeFiltered[d]);
-        }
-
-        float dryL = inL[i];
-        float dryR = inR[i];
-        float sumL = 0.0f;
-        float sumR = 0.0f;
-
-        for (auto &d : delays) {
-            float delayedL = d.left.Read();
-            float delayedR = d.right.Read();
+    dsp.Process(in, out, nframes, midiEvents, nmidi);
 
-            sumL += delayedL * 0.1f;
-            sumR += delayedR * 0.1f;
-
-            // Write current input + feedback
-            d.left.Write(dryL + delayedL * FEEDBACK);
-            d.right.Write(dryR + delayedR * FEEDBACK);
-        }
-
-        // filters[0].Process(sumL);
-        // filters[1].Process(sumR);
-
-        // float filtered_L{filters[0].Low()};
-        // float filtered_R{filters[1].Low()};
-
-        outL[i] = dryL + sumL;
-        outR[i] = dryR + sumR;
-    }
+    return 0;
+}
 
+// notification thread: a bank of lines for the new rate is built here and
+// the audio callback swaps it in at the top of its next cycle
+int sampleRateCallback(jack_nframes_t rate, void *arg) {
+    dsp.SetSampleRate(float(rate));
+    snapshots.SetSampleRate(float(rate));
     return 0;
 }
 
@@ -152,10 +110,178 @@ void signal_handler(int) {
     running = false;
 }
 
+// worst case modulation: all four delay times and the feedback sweeping
+// at once, each CC moving every 64 frames on its own triangle
+static std::vector<CcEvent> make_sweep(double seconds, float sample_rate)
+{
+    std::vector<CcEvent> events;
+    const uint8_t ccs[5] = {1, 71, 72, 73, 74};
+    const double periods[5] = {7.0, 1.3, 1.7, 2.3, 3.1}; // seconds per triangle
+    uint64_t end = uint64_t(seconds * sample_rate);
+    for (uint64_t frame = 0; frame < end; frame += 64) {
+        for (int c = 0; c < 5; c++) {
+            double phase = fmod(frame / (periods[c] * sample_rate), 1.0);
+            double tri = phase < 0.5 ? 2.0 * phase : 2.0 - 2.0 * phase;
+            // feedback stays below unity so the bank does not run away
+            uint8_t value = uint8_t((c == 0 ? 0.2 + 0.6 * tri : tri) * 127.0 + 0.5);
+            events.push_back(CcEvent{frame, 0xB0, ccs[c], value});
+        }
+    }
+    return events;
+}
+
+// renders the CC log through the DSP without JACK, one period at a time,
+// and reports the time per period, so builds can be compared on the
+// same automation
+static int render_offline(const std::string& out_path, const std::string& in_path,
+                          size_t period, float sample_rate, uint64_t tail_frames)
+{
+    SNDFILE* in_file = nullptr;
+    SF_INFO in_info = {};
+    if (!in_path.empty()) {
+        in_file = sf_open(in_path.c_str(), SFM_READ, &in_info);
+        if (!in_file) {
+            std::cerr << "Cannot open " << in_path << ": " << sf_strerror(nullptr) << std::endl;
+            return 1;
+        }
+        sample_rate = float(in_info.samplerate);
+    }
+    uint64_t frames = in_file ? uint64_t(in_info.frames) : ccPlayer.Length() + tail_frames;
+
+    SF_INFO out_info = {};
+    out_info.samplerate = int(sample_rate);
+    out_info.channels = 2;
+    out_info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+    SNDFILE* out_file = sf_open(out_path.c_str(), SFM_WRITE, &out_info);
+    if (!out_file) {
+        std::cerr << "Cannot write " << out_path << ": " << sf_strerror(nullptr) << std::endl;
+        if (in_file)
+            sf_close(in_file);
+        return 1;
+    }
+
+    dsp.Init(sample_rate);
+
+    std::vector<float> inL(period), inR(period), outL(period), outR(period);
+    std::vector<float> file_in(period * (in_file ? in_info.channels : 1)), file_out(period * 2);
+    const float* in[2] = {inL.data(), inR.data()};
+    float* out[2] = {outL.data(), outR.data()};
+    uint32_t noise = 22222;
+
+    double total_us = 0.0, worst_us = 0.0;
+    size_t cycles = 0, ccs = 0;
+    for (uint64_t done = 0; done < frames; done += period) {
+        size_t n = size_t(std::min<uint64_t>(period, frames - done));
+        if (in_file) {
+            sf_count_t got = sf_readf_float(in_file, file_in.data(), n);
+            for (size_t i = 0; i < n; i++) {
+                bool have = sf_count_t(i) < got;
+                inL[i] = have ? file_in[i * in_info.channels] : 0.0f;
+                inR[i] = have ? file_in[i * in_info.channels + (in_info.channels > 1)] : 0.0f;
+            }
+        } else {
+            // never silent, so the idle bypass stays out of the way
+            for (size_t i = 0; i < n; i++) {
+                noise ^= noise << 13; noise ^= noise >> 17; noise ^= noise << 5;
+                inL[i] = (int32_t(noise) * (1.0f / 2147483648.0f)) * 0.25f;
+                inR[i] = -inL[i];
+            }
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        size_t nmidi = ccPlayer.Next(n, midiEvents, kMaxMidiEvents);
+        dsp.Process(in, out, n, midiEvents, nmidi);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        total_us += us;
+        worst_us = std::max(worst_us, us);
+        cycles++;
+        ccs += nmidi;
+
+        for (size_t i = 0; i < n; i++) {
+            file_out[2 * i] = outL[i];
+            file_out[2 * i + 1] = outR[i];
+        }
+        sf_writef_float(out_file, file_out.data(), n);
+    }
+
+    if (in_file)
+        sf_close(in_file);
+    sf_close(out_file);
+
+    double budget_us = 1e6 * period / sample_rate;
+    std::cout << "Rendered " << frames << " frames with " << ccs << " CCs to " << out_path << "\n"
+              << "period " << period << ": mean " << total_us / std::max<size_t>(cycles, 1) << " us, worst " << worst_us
+              << " us of a " << budget_us << " us budget" << std::endl;
+    return 0;
+}
 
+int main(int argc, char *argv[]) {
+
+    std::string snapshot_path = "/dev/shm/jack_multi_delay.snap";
+    std::string record_path, replay_path, render_path, render_input;
+    size_t render_period = 256;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:j:S:r:p:o:i:f:h")) != -1) {
+        switch (opt) {
+            case 'S': snapshot_path = optarg; break;
+            case 'r': record_path = optarg; break;
+            case 'p': replay_path = optarg; break;
+            case 'o': render_path = optarg; break;
+            case 'i': render_input = optarg; break;
+            case 'f': render_period = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+            case 'n':
+                if (!dsp.Configure("lines", optarg)) {
+                    std::cerr << "lines must be 1.." << MultiDelayDsp::MAX_LINES << std::endl;
+                    return 1;
+                }
+                break;
+            case 'j':
+                if (!dsp.Configure("jobs", optarg)) {
+                    std::cerr << "bad worker count " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            default:
+                std::cerr << "usage: multiDelay [-n lines] [-j worker threads] [-S snapshot file]\n"
+                          << "                  [-r record.cc] [-p replay.cc|sweep [-o out.wav [-i in.wav] [-f period]]]\n"
+                          << "  -n  stereo delay lines (default " << MultiDelayDsp::NUM_DELAYS
+                          << ", max " << MultiDelayDsp::MAX_LINES << ")\n"
+                          << "  -j  RT worker threads sharing the lines each cycle (default 0)\n"
+                          << "  -S  delay state snapshots for warm restarts, \"none\" to disable\n"
+                          << "      (default /dev/shm/jack_multi_delay.snap)\n"
+                          << "  -r  record the incoming CCs to a file\n"
+                          << "  -p  replay a recorded CC file instead of the MIDI input, or \"sweep\"\n"
+                          << "      for all four delay times and the feedback moving at once\n"
+                          << "  -o  render the replay offline to a WAV file (no JACK) and time it\n"
+                          << "  -i  input WAV for -o (default noise); -f period for -o (default 256)\n";
+                return 1;
+        }
+    }
 
+    float replay_rate = 48000.0f;
+    if (replay_path == "sweep") {
+        ccPlayer.Init(make_sweep(30.0, replay_rate));
+        replaying = true;
+    } else if (!replay_path.empty()) {
+        std::vector<CcEvent> events;
+        std::string err;
+        if (!LoadCcLog(replay_path, &events, &replay_rate, &err)) {
+            std::cerr << err << std::endl;
+            return 1;
+        }
+        ccPlayer.Init(std::move(events));
+        replaying = true;
+    }
 
-int main() {
+    if (!render_path.empty()) {
+        if (!replaying) {
+            std::cerr << "-o renders a replay, give it one with -p" << std::endl;
+            return 1;
+        }
+        // two seconds past the last CC for the tails
+        return render_offline(render_path, render_input, render_period, replay_rate,
+                              uint64_t(2.0f * replay_rate));
+    }
 
     std::atomic<bool> midiRunning{true};
     std::thread midiThread([&]() {
@@ -165,36 +291,6 @@ int main() {
             // Handle CC from any MIDI controller
             std::cout << "CC " << int(msg.cc)
                       << " = " << int(msg.value) << std::endl;
-
-            if (msg.cc == 1)
-            {
-                
-                FEEDBACK = (1.2f) * (msg.value / 127.0f);
-                
-                // float TimeFactor = 0.1f + (1.0f - 0.1f) * (msg.value / 127.0f);
-                // for(size_t d=0; d<NUM_DELAYS; d++)
-                // {
-                //     //set delay time 
-                //     float delaySamples = delays[d].delayTimeMs * (sampleRate / 1000.0f) * TimeFactor;
-                //     delays[d].left.SetDelay(delaySamples);
-                //     delays[d].right.SetDelay(delaySamples);
-                // }
-            }
-
-            if (msg.cc == 71 || msg.cc == 72  || msg.cc == 73 || msg.cc == 74)
-            {
-                delayTimes[msg.cc - 71] = 100.0f + (1900.0f) * (msg.value / 127.0f);
-
-                // float TimeFactor = 0.1f + (1.0f - 0.1f) * (msg.value / 127.0f);
-                // for(size_t d=0; d<NUM_DELAYS; d++)
-                // {
-                //     //set delay time 
-                //     float delaySamples = delays[d].delayTimeMs * (sampleRate / 1000.0f) * TimeFactor;
-                //     delays[d].left.SetDelay(delaySamples);
-                //     delays[d].right.SetDelay(delaySamples);
-                // }
-            }
-            
         }
 
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -213,32 +309,38 @@ int main() {
         return 1;
     }
 
-    // Get sample rate
-    sampleRate = jack_get_sample_rate(client);
-
-    // Create and init stereo delays
-    delays.resize(NUM_DELAYS);
-    delayTimes.resize(NUM_DELAYS);
-    // for (auto &d : delays) {
-    for(size_t d=0; d<NUM_DELAYS; d++)
-    {
-        delays[d].left.Init();
-        delays[d].right.Init();
-
-        delayTimes[d] = 100;
-        delays[d].delayTimeMs = delayTimes[d];
-        float delaySamples = delays[d].delayTimeMs * (sampleRate / 1000.0f);
-        delays[d].left.SetDelay(delaySamples);
-        delays[d].right.SetDelay(delaySamples);
+    // workers run at the same priority as the JACK process thread
+    int rtprio = jack_client_real_time_priority(client);
+    if (rtprio > 0)
+        dsp.Configure("rtprio", std::to_string(rtprio));
+
+    // Create and init stereo delays at the server rate
+    dsp.Init(jack_get_sample_rate(client));
+    if (dsp.Workers() > 0 && dsp.RealtimeWorkers() < dsp.Workers())
+        std::cerr << "Could not give all workers SCHED_FIFO, running them at normal priority" << std::endl;
+
+    // carry on from the last snapshot instead of silence; a different
+    // line count or sample rate starts clean
+    if (snapshot_path != "none") {
+        bool restored = false;
+        std::string err;
+        if (!snapshots.Open(snapshot_path, "multidelay", &dsp, jack_get_sample_rate(client), &restored, &err))
+            std::cerr << "Snapshots disabled: " << err << std::endl;
+        else if (restored)
+            std::cout << "Restored delay state from " << snapshot_path << " ("
+                      << snapshots.RestoredAge() << " s old)" << std::endl;
     }
 
-    //init filters
-
-    filters[0].Init(sampleRate);
-    filters[1].Init(sampleRate);
-
-    filters[0].SetFreq(800.0f);
-    filters[1].SetFreq(800.0f);
+    if (!record_path.empty()) {
+        std::string err;
+        if (!ccRecorder.Open(record_path, jack_get_sample_rate(client), &err)) {
+            std::cerr << "Cannot record CCs: " << err << std::endl;
+            return 1;
+        }
+    }
+    if (replaying && replay_rate != jack_get_sample_rate(client))
+        std::cerr << "CC log was recorded at " << replay_rate << " Hz, replaying it at "
+                  << jack_get_sample_rate(client) << " Hz" << std::endl;
 
     // Register JACK ports
     input_l = jack_port_register(client, "input_L", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
@@ -250,6 +352,7 @@ int main() {
 
     // Set process callback and activate
     jack_set_process_callback(client, audioCallback, 0);
+    jack_set_sample_rate_callback(client, sampleRateCallback, 0);
 
     if (jack_activate(client)) {
         std::cerr << "Cannot activate JACK client." << std::endl;
@@ -266,18 +369,30 @@ int main() {
 
     jack_connect(client, "system:midi_capture_3", jack_port_name(midi_in));
 
-    std::cout << "Multi-delay JACK client running with " << NUM_DELAYS << " stereo delay lines.\n";
+    snapshots.Start(5.0);
+
+    std::cout << "Multi-delay JACK client running with " << dsp.Lines() << " stereo delay lines on "
+              << dsp.Workers() + 1 << " thread(s).\n";
 
     // Keep running
     while (running)
     {
         std::this_thread::sleep_for(std::chrono::seconds(1));
+        dsp.Reclaim(); // banks replaced by a rate change
     }
-        
+
     // Cleanup
     // ---------- SHUTDOWN SEQUENCE ----------
     midiRunning = false;  // tell MIDI thread to exit
     midiThread.join();    // wait for it to finish (important!)
+    snapshots.Close(true); // last save while the callback still runs
     jack_client_close(client);
+    if (!record_path.empty()) {
+        ccRecorder.Close();
+        std::cout << "Recorded " << ccRecorder.Recorded() << " CCs to " << record_path;
+        if (ccRecorder.Dropped() > 0)
+            std::cout << " (" << ccRecorder.Dropped() << " dropped, queue full)";
+        std::cout << std::endl;
+    }
     return 0;
 }
\ No newline at end of file
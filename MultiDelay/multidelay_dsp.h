@@ -0,0 +1,409 @@
+#pragma once
+#ifndef MULTIDELAY_DSP_H
+#define MULTIDELAY_DSP_H
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "activity.h"
+#include "dsp_node.h"
+#include "rt_pool.h"
+#include "snapshot.h"
+#include "state_swap.h"
+
+#include "../external/DaisySP/Source/daisysp.h"
+
+/** MultiDelay as a node: a bank of stereo delays in parallel with shared
+feedback, mixed with the dry input.
+
+Each line only depends on the dry input, so the block is cut into chunks
+and every line renders a whole chunk into its own wet buffer, either in
+turn or spread over an RtPool; the wet buffers are then summed in line
+order, so serial and parallel output are identical. Going parallel only
+pays once a chunk holds enough work (lines x frames), which is what
+parallel_min sets; multiDelay_bench measures the crossover.
+
+MIDI CC1 sets feedback (0..1.2), CC71-74 the first four delay times
+(100..2000 ms), each on the frame it is stamped with, so a CC log
+replays on the same frames at any period size. Parameters: feedback,
+time1..timeN (ms). Settings, before Init(): lines (1..MAX_LINES), jobs
+(worker threads), rtprio, parallel_min. SaveState() covers every line's
+buffers and smoothed delay time, for warm restarts through a
+Snapshotter.
+
+The lines hold MAX_DELAY_MS at up to MAX_SAMPLE_RATE. SetSampleRate()
+builds a fresh, silent bank for the new rate off the process thread and
+swaps it in at a cycle boundary (StateSwap); the tails of the old rate
+are dropped.
+*/
+class MultiDelayDsp : public DspNode
+{
+  public:
+    static constexpr int NUM_DELAYS = 4;          // Default number of stereo delay lines
+    static constexpr int MAX_LINES = 64;
+    static constexpr size_t MAX_DELAY_MS = 1000; // Max delay time in milliseconds
+    static constexpr size_t MIN_DELAY_MS = 50;
+    static constexpr size_t MAX_SAMPLE_RATE = 96000;
+    static constexpr size_t DELAY_LINE_SIZE = MAX_DELAY_MS * (MAX_SAMPLE_RATE / 1000) + 1;
+    static constexpr size_t kChunk = 256;
+
+    // A pair of delays for stereo
+    struct StereoDelay {
+        daisysp::DelayLine<float, DELAY_LINE_SIZE> left;
+        daisysp::DelayLine<float, DELAY_LINE_SIZE> right;
+        float delayTimeMs;
+    };
+
+    MultiDelayDsp() { std::fill(delayTimes, delayTimes + MAX_LINES, 100.0f); }
+
+    bool Configure(const std::string& key, const std::string& value) override
+    {
+        long n = strtol(value.c_str(), nullptr, 10);
+        if (key == "lines") {
+            if (n < 1 || n > MAX_LINES)
+                return false;
+            numLines = int(n);
+            return true;
+        }
+        if (key == "jobs") {
+            if (n < 0 || n > 64)
+                return false;
+            jobs = size_t(n);
+            return true;
+        }
+        if (key == "rtprio") {
+            rtPriority = int(n);
+            return true;
+        }
+        if (key == "parallel_min") {
+            parallelMin = size_t(std::max(n, 0L));
+            return true;
+        }
+
+        int index = ParamIndex(key);
+        if (index < 0)
+            return false;
+        SetParam(index, strtof(value.c_str(), nullptr));
+        return true;
+    }
+
+    int ParamIndex(const std::string& key) const override
+    {
+        if (key == "feedback")
+            return kParamFeedback;
+        if (key.size() > 4 && key.compare(0, 4, "time") == 0) {
+            long d = strtol(key.c_str() + 4, nullptr, 10);
+            if (d >= 1 && d <= MAX_LINES)
+                return kParamTime1 + int(d - 1);
+        }
+        return -1;
+    }
+
+    void SetParam(int index, float value) override
+    {
+        if (index == kParamFeedback)
+            feedback_ = std::min(std::max(value, 0.0f), 1.2f);
+        else if (index >= kParamTime1 && index < kParamTime1 + MAX_LINES)
+            delayTimes[index - kParamTime1] = std::min(std::max(value, float(MIN_DELAY_MS)), 2000.0f);
+    }
+
+    void Init(float sample_rate) override
+    {
+        builtRate = sample_rate;
+        bank.Reset(MakeBank(sample_rate));
+        cur = bank.Current();
+
+        activity.Init();
+        for (int d = 0; d < numLines; d++)
+            activity.SetSpan(d, DELAY_LINE_SIZE);
+
+        realtimeWorkers = jobs > 0 ? pool.Start(jobs, rtPriority) : 0;
+    }
+
+    size_t Inputs() const override { return 2; }
+    size_t Outputs() const override { return 2; }
+
+    size_t StateBytes() const override { return size_t(numLines) * sizeof(SavedLine); }
+
+    bool SaveState(void* dst) override
+    {
+        // the smoothed times as of one cycle boundary; the buffers are
+        // copied while the lines keep running, which only touches the
+        // newest samples, ahead of the saved write positions
+
+        // bankMutex keeps SetSampleRate()/Reclaim() from freeing the
+        // captured bank until the copy is done
+        std::lock_guard<std::mutex> lock(bankMutex);
+        if (!capture.Request(500))
+            return false;
+        if (capturedBank->sampleRate != builtRate)
+            return false; // a new rate is not in use yet
+        SavedLine* saved = static_cast<SavedLine*>(dst);
+        for (int d = 0; d < numLines; d++) {
+            saved[d].delay = capturedBank->lines[d].delay;
+            saved[d].filtered = capturedFiltered[d];
+        }
+        return true;
+    }
+
+    void LoadState(const void* src) override
+    {
+        const SavedLine* saved = static_cast<const SavedLine*>(src);
+        Bank* b = bank.Current();
+        for (int d = 0; d < numLines; d++) {
+            b->lines[d].delay = saved[d].delay;
+            b->lines[d].filtered = saved[d].filtered;
+        }
+    }
+
+    bool SetSampleRate(float sample_rate) override
+    {
+        std::lock_guard<std::mutex> lock(bankMutex);
+        if (sample_rate != builtRate) {
+            bank.Publish(MakeBank(sample_rate));
+            builtRate = sample_rate;
+        }
+        return true;
+    }
+
+    void Reclaim() override
+    {
+        std::lock_guard<std::mutex> lock(bankMutex);
+        bank.Reclaim();
+    }
+
+    int Lines() const { return numLines; }
+    size_t Workers() const { return pool.Workers(); }
+    size_t RealtimeWorkers() const { return realtimeWorkers; }
+
+    /** CC mapping, safe to call from the process callback */
+    void HandleCC(uint8_t cc, uint8_t value)
+    {
+        if (cc == 1)
+            feedback_ = (1.2f) * (value / 127.0f);
+
+        if (cc >= 71 && cc < 71 + NUM_DELAYS)
+            delayTimes[cc - 71] = 100.0f + (1900.0f) * (value / 127.0f);
+    }
+
+    void Process(const float* const* in,
+                 float* const*       out,
+                 size_t              nframes,
+                 const MidiEvent*    midi,
+                 size_t              nmidi) override
+    {
+        const float* inL = in[0];
+        const float* inR = in[1];
+        float* outL = out[0];
+        float* outR = out[1];
+
+        // a bank built for a new sample rate takes over here
+        cur = bank.Acquire();
+        std::vector<Line>& lines = cur->lines;
+
+        capture.Poll([this, &lines]() {
+            capturedBank = cur;
+            for (int d = 0; d < numLines; d++)
+                capturedFiltered[d] = lines[d].filtered;
+        });
+
+        // CCs take effect on their own frame: chunks end where one lands
+        size_t ev = 0;
+        auto applyUntil = [&](size_t frame) {
+            for (; ev < nmidi && midi[ev].time <= frame; ev++) {
+                if (midi[ev].size >= 3 && (midi[ev].data[0] & 0xF0) == 0xB0) // CC message on any channel
+                    HandleCC(midi[ev].data[1], midi[ev].data[2]);
+            }
+        };
+        applyUntil(0);
+
+        size_t start = 0;
+
+        // a quiet tail can only grow back with feedback at or above unity
+        if (feedback_ < 1.0f && activity.Idle()) {
+            start = std::min(activity.FirstAbove(inL, nframes), activity.FirstAbove(inR, nframes));
+            memset(outL, 0, start * sizeof(float));
+            memset(outR, 0, start * sizeof(float));
+
+            // the lines hold only silence, so delay changes cannot be heard: jump to the targets
+            applyUntil(start);
+            for (int d = 0; d < numLines; d++) {
+                lines[d].filtered = TargetSamples(*cur, d);
+                lines[d].delay.left.SetDelay(lines[d].filtered);
+                lines[d].delay.right.SetDelay(lines[d].filtered);
+            }
+
+            if (start == nframes) {
+                applyUntil(~size_t(0));
+                return;
+            }
+        }
+
+        for (int d = 0; d < numLines; d++)
+            lines[d].peak = 0.0f;
+
+        for (size_t pos = start; pos < nframes;) {
+            applyUntil(pos);
+            size_t n = std::min(kChunk, nframes - pos);
+            if (ev < nmidi && midi[ev].time < pos + n)
+                n = midi[ev].time - pos;
+            job = {inL + pos, inR + pos, n, feedback_};
+
+            if (size_t(numLines) * n >= parallelMin)
+                pool.Run(numLines, RunLine, this);
+            else
+                for (int d = 0; d < numLines; d++)
+                    ProcessLine(d);
+
+            // wet sum in line order, whichever thread rendered each line
+            float sumL[kChunk] = {};
+            float sumR[kChunk] = {};
+            for (int d = 0; d < numLines; d++) {
+                const float* wetL = lines[d].wetL;
+                const float* wetR = lines[d].wetR;
+                for (size_t i = 0; i < n; i++) {
+                    sumL[i] += wetL[i] * 0.1f;
+                    sumR[i] += wetR[i] * 0.1f;
+                }
+            }
+            for (size_t i = 0; i < n; i++) {
+                outL[pos + i] = job.inL[i] + sumL[i];
+                outR[pos + i] = job.inR[i] + sumR[i];
+            }
+            pos += n;
+        }
+        // stamped past the block
+        applyUntil(~size_t(0));
+
+        for (int d = 0; d < numLines; d++)
+            activity.Wrote(d, lines[d].peak, nframes - start);
+    }
+
+  private:
+    enum { kParamFeedback, kParamTime1 };
+
+    // one line's state and its wet output for the current chunk, on its
+    // own cache lines so workers never share one
+    struct alignas(64) Line {
+        StereoDelay delay;
+        float filtered;
+        float peak;
+        alignas(64) float wetL[kChunk];
+        float wetR[kChunk];
+    };
+
+    // everything sized or tuned for one sample rate
+    struct Bank {
+        float sampleRate;
+        float maxDelay; // samples
+        std::vector<Line> lines;
+    };
+
+    // DaisySP's DelayLine is plain data, so a line saves by assignment
+    struct SavedLine {
+        StereoDelay delay;
+        float filtered;
+    };
+
+    struct Job {
+        const float* inL;
+        const float* inR;
+        size_t n;
+        float feedback;
+    };
+
+    /** silent lines for sample_rate, already at the current delay times */
+    std::unique_ptr<Bank> MakeBank(float sample_rate)
+    {
+        std::unique_ptr<Bank> b(new Bank);
+        b->sampleRate = sample_rate;
+        b->maxDelay = std::min(MAX_DELAY_MS * (sample_rate / 1000.0f), float(DELAY_LINE_SIZE - 2));
+        b->lines.resize(numLines);
+        for (int d = 0; d < numLines; d++)
+        {
+            Line& line = b->lines[d];
+            line.delay.left.Init();
+            line.delay.right.Init();
+
+            line.delay.delayTimeMs = delayTimes[d];
+            line.filtered = TargetSamples(*b, d);
+            line.peak = 0.0f;
+            line.delay.left.SetDelay(line.filtered);
+            line.delay.right.SetDelay(line.filtered);
+        }
+        return b;
+    }
+
+    float TargetSamples(const Bank& b, int d) const
+    {
+        return std::min(delayTimes[d] * (b.sampleRate / 1000.0f), b.maxDelay);
+    }
+
+    static void RunLine(void* ctx, size_t d)
+    {
+        static_cast<MultiDelayDsp*>(ctx)->ProcessLine(int(d));
+    }
+
+    void ProcessLine(int d)
+    {
+        Line& line = cur->lines[d];
+        const Job j = job;
+        //fitler then set delay time, per sample
+        const float delaySamples = TargetSamples(*cur, d);
+        float filtered = line.filtered;
+        float peak = line.peak;
+
+        for (size_t i = 0; i < j.n; i++) {
+            daisysp::fonepole(filtered, delaySamples, 0.001f);
+            line.delay.left.SetDelay(filtered);
+            line.delay.right.SetDelay(filtered);
+
+            float delayedL = line.delay.left.Read();
+            float delayedR = line.delay.right.Read();
+            line.wetL[i] = delayedL;
+            line.wetR[i] = delayedR;
+
+            // Write current input + feedback
+            float writeL = j.inL[i] + delayedL * j.feedback;
+            float writeR = j.inR[i] + delayedR * j.feedback;
+            line.delay.left.Write(writeL);
+            line.delay.right.Write(writeR);
+
+            peak = std::max(peak, std::max(fabsf(writeL), fabsf(writeR)));
+        }
+
+        line.filtered = filtered;
+        line.peak = peak;
+    }
+
+    float feedback_ = 0.0f;
+    float delayTimes[MAX_LINES];
+    int numLines = NUM_DELAYS;
+    Job job = {};
+
+    // the lines, swapped whole when the sample rate changes; cur is the
+    // process thread's bank for this cycle, read by the workers too
+    StateSwap<Bank> bank;
+    Bank* cur = nullptr;
+    std::mutex bankMutex; // SetSampleRate / Reclaim vs SaveState
+    float builtRate = 0.0f;
+
+    RtPool pool;
+    size_t jobs = 0;
+    int rtPriority = 70;
+    size_t parallelMin = 1024;
+    size_t realtimeWorkers = 0;
+
+    // one tracked line per stereo delay
+    ActivityTracker<MAX_LINES> activity;
+
+    StateCapture capture;
+    Bank* capturedBank = nullptr;
+    float capturedFiltered[MAX_LINES];
+};
+
+#endif
@@ -0,0 +1,488 @@
+/*
+    Streaming multichannel playback client, the reverse of CaptureExample.
+
+    A read-ahead thread decodes the playlist with libsndfile, deinterleaves
+    it and fills one lock-free ringbuffer per output port.  process() only
+    copies each ring into its port buffer, so there is no file I/O on the
+    JACK thread.  Files are played back to back without gaps, the playlist
+    can loop, and seeks are handled by the reader after process() has
+    flushed the rings.
+
+    While playing, stdin accepts:
+        s <seconds>   seek within the current file
+        n             skip to the next file
+        q             quit
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sndfile.h>
+#include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include <atomic>
+#include <vector>
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+
+typedef struct _thread_info {
+    pthread_t thread_id;
+    jack_client_t *client;
+    char **files;
+    int nfiles;
+    unsigned int channels;
+    jack_nframes_t rb_size;
+    int loop;
+} jack_thread_info_t;
+
+/* JACK data */
+unsigned int nports;
+jack_port_t **ports;
+jack_default_audio_sample_t **out;
+const size_t sample_size = sizeof(jack_default_audio_sample_t);
+
+/* Synchronization between process thread and reader thread. */
+#define DEFAULT_RB_SIZE 65536		/* ringbuffer size in frames */
+#define READ_BLOCK_FRAMES 4096		/* frames per sf_readf_float call */
+jack_ringbuffer_t **rbs;
+pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  space_ready = PTHREAD_COND_INITIALIZER;
+std::atomic<long> underruns{0};
+std::atomic<bool> can_play{false};
+std::atomic<bool> end_of_playlist{false};
+std::atomic<bool> quit{false};
+
+/* Seek handshake: the control side posts a request, the reader bumps
+ * flush_req and waits until process() has emptied the rings and
+ * answered with flush_ack, then seeks and refills. */
+std::atomic<long long> seek_frame{-1};
+std::atomic<bool> skip_file{false};
+std::atomic<unsigned> flush_req{0};
+std::atomic<unsigned> flush_ack{0};
+
+/* Frames process() has played since the start.  The reader keeps the
+ * same count for what it has queued and notes where each file begins,
+ * so after a flush it knows which file was audible: with gapless
+ * playback the one it has open may already be a later entry. */
+std::atomic<unsigned long long> played_frames{0};
+
+struct file_start {
+	unsigned long long frame;
+	int index;
+};
+
+static void
+wake_reader ()
+{
+	/* Same trick as the capture client: if the reader is busy it
+	 * will look at the rings again before it sleeps. */
+	if (pthread_mutex_trylock (&reader_lock) == 0) {
+		pthread_cond_signal (&space_ready);
+		pthread_mutex_unlock (&reader_lock);
+	}
+}
+
+static SNDFILE *
+open_file (jack_thread_info_t *info, int index, SF_INFO *sf_info)
+{
+	const char *path = info->files[index];
+	int fd = open (path, O_RDONLY);
+	SNDFILE *sf;
+
+	if (fd < 0) {
+		fprintf (stderr, "cannot open \"%s\" (%s)\n", path, strerror (errno));
+		return NULL;
+	}
+	/* let the kernel read ahead aggressively as well */
+	posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	memset (sf_info, 0, sizeof (*sf_info));
+	if ((sf = sf_open_fd (fd, SFM_READ, sf_info, 1)) == NULL) {
+		fprintf (stderr, "cannot open sndfile \"%s\" (%s)\n", path, sf_strerror (NULL));
+		return NULL;
+	}
+	if ((jack_nframes_t) sf_info->samplerate != jack_get_sample_rate (info->client))
+		fprintf (stderr, "warning: \"%s\" is %d Hz, JACK is running at %" PRIu32 " Hz\n",
+			 path, sf_info->samplerate, jack_get_sample_rate (info->client));
+	printf ("playing %s (%d channels)\n", path, sf_info->channels);
+	return sf;
+}
+
+static void
+flush_rings ()
+{
+	unsigned req = flush_req.load () + 1;
+
+	/* play silence, without counting underruns, until refilled */
+	can_play = false;
+	flush_req = req;
+	while (flush_ack.load () != req && !quit)
+		usleep (1000);
+}
+
+void *
+reader_thread (void *arg)
+{
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	int index = 0;
+	int opened = 0;
+	SF_INFO sf_info;
+	SNDFILE *sf = NULL;
+	float *framebuf = NULL;
+	unsigned int chn;
+	unsigned long long queued = 0;
+	std::vector<file_start> starts;
+	long long pending_seek = -1;
+
+	pthread_mutex_lock (&reader_lock);
+
+	while (!quit) {
+
+		if (sf == NULL) {
+			if (index >= info->nfiles) {
+				if (!info->loop || opened == 0)
+					break;
+				index = 0;
+				opened = 0;
+			}
+			if ((sf = open_file (info, index, &sf_info)) == NULL) {
+				index++;
+				continue;
+			}
+			opened++;
+			free (framebuf);
+			framebuf = (float *) malloc (READ_BLOCK_FRAMES * sf_info.channels * sample_size);
+			starts.push_back ({queued, index});
+			if (pending_seek >= 0) {
+				sf_seek (sf, pending_seek, SEEK_SET);
+				pending_seek = -1;
+			}
+		}
+
+		long long seek = seek_frame.exchange (-1);
+		bool skip = skip_file.exchange (false);
+		if (seek >= 0 || skip) {
+			flush_rings ();
+
+			/* the last file that started at or before the flush
+			 * point is the one that was audible */
+			unsigned long long played = played_frames.load ();
+			size_t s = 0;
+			while (s + 1 < starts.size () && starts[s + 1].frame <= played)
+				s++;
+			int audible = starts[s].index;
+			starts.clear ();
+			queued = played;
+
+			if (skip) {
+				sf_close (sf);
+				sf = NULL;
+				index = audible + 1;
+				continue;
+			}
+			if (audible != index) {
+				/* reopen it and seek there instead */
+				sf_close (sf);
+				sf = NULL;
+				index = audible;
+				pending_seek = seek;
+				continue;
+			}
+			starts.push_back ({queued, index});
+			sf_seek (sf, seek, SEEK_SET);
+		}
+
+		/* fill in whole blocks while every ring has room for one */
+		jack_nframes_t space = JACK_MAX_FRAMES;
+		for (chn = 0; chn < nports; chn++) {
+			jack_nframes_t s = jack_ringbuffer_write_space (rbs[chn]) / sample_size;
+			if (s < space)
+				space = s;
+		}
+
+		if (space < READ_BLOCK_FRAMES) {
+			can_play = true;
+			pthread_cond_wait (&space_ready, &reader_lock);
+			continue;
+		}
+
+		sf_count_t got = sf_readf_float (sf, framebuf, READ_BLOCK_FRAMES);
+
+		if (got > 0) {
+			for (chn = 0; chn < nports; chn++) {
+				jack_ringbuffer_data_t vec[2];
+				jack_ringbuffer_get_write_vector (rbs[chn], vec);
+
+				/* deinterleave straight into the ring, which
+				 * may wrap once */
+				const float *src = framebuf + chn;
+				sf_count_t first = vec[0].len / sample_size;
+				if (first > got)
+					first = got;
+				for (int part = 0; part < 2; part++) {
+					float *dst = (float *) vec[part].buf;
+					sf_count_t n = part == 0 ? first : got - first;
+					if (chn >= (unsigned) sf_info.channels) {
+						memset (dst, 0, n * sample_size);
+						continue;
+					}
+					for (sf_count_t i = 0; i < n; i++) {
+						*dst++ = *src;
+						src += sf_info.channels;
+					}
+				}
+				jack_ringbuffer_write_advance (rbs[chn], got * sample_size);
+			}
+			queued += got;
+		}
+
+		if (got < READ_BLOCK_FRAMES) {
+			/* end of file: move straight on so the next file
+			 * (or the loop) continues in the same ring position */
+			sf_close (sf);
+			sf = NULL;
+			index++;
+		}
+	}
+
+	if (sf)
+		sf_close (sf);
+	free (framebuf);
+	can_play = true;
+	end_of_playlist = true;
+	pthread_mutex_unlock (&reader_lock);
+	return 0;
+}
+
+int
+process (jack_nframes_t nframes, void *arg)
+{
+	unsigned int chn;
+	size_t bytes = nframes * sample_size;
+
+	for (chn = 0; chn < nports; chn++)
+		out[chn] = (jack_default_audio_sample_t *) jack_port_get_buffer (ports[chn], nframes);
+
+	/* the reader wants the rings emptied before it seeks */
+	unsigned req = flush_req.load (std::memory_order_acquire);
+	if (flush_ack.load (std::memory_order_relaxed) != req) {
+		for (chn = 0; chn < nports; chn++)
+			jack_ringbuffer_read_advance (rbs[chn], jack_ringbuffer_read_space (rbs[chn]));
+		flush_ack.store (req, std::memory_order_release);
+	}
+
+	if (!can_play) {
+		for (chn = 0; chn < nports; chn++)
+			memset (out[chn], 0, bytes);
+		return 0;
+	}
+
+	/* every ring gets the same number of frames so channels stay aligned */
+	size_t avail = bytes;
+	for (chn = 0; chn < nports; chn++) {
+		size_t space = jack_ringbuffer_read_space (rbs[chn]);
+		if (space < avail)
+			avail = space;
+	}
+	avail -= avail % sample_size;
+
+	for (chn = 0; chn < nports; chn++) {
+		jack_ringbuffer_read (rbs[chn], (char *) out[chn], avail);
+		if (avail < bytes)
+			memset ((char *) out[chn] + avail, 0, bytes - avail);
+	}
+	played_frames.fetch_add (avail / sample_size, std::memory_order_relaxed);
+
+	if (avail < bytes && !end_of_playlist)
+		underruns++;
+
+	wake_reader ();
+	return 0;
+}
+
+void
+jack_shutdown (void *arg)
+{
+	fprintf (stderr, "JACK shutdown\n");
+	abort();
+}
+
+void
+signal_handler (int sig)
+{
+	quit = true;
+}
+
+void
+setup_ports (jack_thread_info_t *info)
+{
+	unsigned int i;
+
+	nports = info->channels;
+	ports = (jack_port_t **) malloc (sizeof (jack_port_t *) * nports);
+	out = (jack_default_audio_sample_t **) calloc (nports, sizeof (jack_default_audio_sample_t *));
+	rbs = (jack_ringbuffer_t **) malloc (sizeof (jack_ringbuffer_t *) * nports);
+
+	for (i = 0; i < nports; i++) {
+		char name[64];
+
+		rbs[i] = jack_ringbuffer_create (sample_size * info->rb_size);
+		/* touch the pages now rather than in process() */
+		memset (rbs[i]->buf, 0, rbs[i]->size);
+
+		sprintf (name, "output%d", i+1);
+
+		if ((ports[i] = jack_port_register (info->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0)) == 0) {
+			fprintf (stderr, "cannot register output port \"%s\"!\n", name);
+			jack_client_close (info->client);
+			exit (1);
+		}
+	}
+}
+
+/* Reads seek/skip/quit commands until the playlist ends. */
+void
+control_loop (jack_thread_info_t *info)
+{
+	char line[128];
+	jack_nframes_t rate = jack_get_sample_rate (info->client);
+
+	fcntl (STDIN_FILENO, F_SETFL, fcntl (STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+
+	while (!quit) {
+		if (end_of_playlist) {
+			/* let process() drain what is left */
+			size_t left = 0;
+			for (unsigned int chn = 0; chn < nports; chn++)
+				left += jack_ringbuffer_read_space (rbs[chn]);
+			if (left == 0)
+				break;
+		}
+
+		if (fgets (line, sizeof (line), stdin) == NULL) {
+			clearerr (stdin);
+			usleep (50000);
+			continue;
+		}
+
+		if (line[0] == 's') {
+			double secs = atof (line + 1);
+			seek_frame = (long long) (secs * rate);
+		} else if (line[0] == 'n') {
+			skip_file = true;
+		} else if (line[0] == 'q') {
+			quit = true;
+		}
+		wake_reader ();
+	}
+	quit = true;
+	wake_reader ();
+}
+
+int
+main (int argc, char *argv[])
+{
+	jack_client_t *client;
+	jack_thread_info_t thread_info;
+	int c;
+	int longopt_index = 0;
+	extern int optind, opterr;
+	int show_usage = 0;
+	const char *optstring = "c:B:lh";
+	struct option long_options[] = {
+		{ "help", 0, 0, 'h' },
+		{ "channels", 1, 0, 'c' },
+		{ "bufsize", 1, 0, 'B' },
+		{ "loop", 0, 0, 'l' },
+		{ 0, 0, 0, 0 }
+	};
+
+	memset (&thread_info, 0, sizeof (thread_info));
+	thread_info.rb_size = DEFAULT_RB_SIZE;
+	opterr = 0;
+
+	while ((c = getopt_long (argc, argv, optstring, long_options, &longopt_index)) != -1) {
+		switch (c) {
+		case 'h':
+			show_usage++;
+			break;
+		case 'c':
+			thread_info.channels = atoi (optarg);
+			break;
+		case 'B':
+			thread_info.rb_size = atoi (optarg);
+			break;
+		case 'l':
+			thread_info.loop = 1;
+			break;
+		default:
+			fprintf (stderr, "error\n");
+			show_usage++;
+			break;
+		}
+	}
+
+	if (show_usage || optind == argc) {
+		fprintf (stderr, "usage: jackplay [ -c channels ] [ -B bufsize ] [ -l ] file1 [ file2 ... ]\n");
+		exit (1);
+	}
+
+	thread_info.files = &argv[optind];
+	thread_info.nfiles = argc - optind;
+
+	/* default to the channel count of the first file */
+	if (thread_info.channels == 0) {
+		SF_INFO sf_info;
+		SNDFILE *sf;
+
+		memset (&sf_info, 0, sizeof (sf_info));
+		if ((sf = sf_open (thread_info.files[0], SFM_READ, &sf_info)) == NULL) {
+			fprintf (stderr, "cannot open sndfile \"%s\" (%s)\n",
+				 thread_info.files[0], sf_strerror (NULL));
+			exit (1);
+		}
+		thread_info.channels = sf_info.channels;
+		sf_close (sf);
+	}
+
+	if ((client = jack_client_open ("jackplay", JackNullOption, NULL)) == 0) {
+		fprintf (stderr, "jack server not running?\n");
+		exit (1);
+	}
+
+	thread_info.client = client;
+
+	setup_ports (&thread_info);
+
+	signal (SIGINT, signal_handler);
+	signal (SIGTERM, signal_handler);
+
+	jack_set_process_callback (client, process, &thread_info);
+	jack_on_shutdown (client, jack_shutdown, &thread_info);
+
+	/* preroll: the reader fills the rings before process() starts
+	 * pulling from them */
+	pthread_create (&thread_info.thread_id, NULL, reader_thread, &thread_info);
+
+	if (jack_activate (client)) {
+		fprintf (stderr, "cannot activate client");
+	}
+
+	control_loop (&thread_info);
+
+	pthread_join (thread_info.thread_id, NULL);
+	jack_client_close (client);
+
+	if (underruns > 0)
+		fprintf (stderr, "jackplay had %ld underruns, try a bigger buffer than -B %"
+			 PRIu32 ".\n", underruns.load (), thread_info.rb_size);
+
+	for (unsigned int i = 0; i < nports; i++)
+		jack_ringbuffer_free (rbs[i]);
+
+	exit (0);
+}
@@ -0,0 +1,82 @@
+#pragma once
+#ifndef COMMON_ACTIVITY_H
+#define COMMON_ACTIVITY_H
+#include <stddef.h>
+#include <math.h>
+
+/** Idle detection for delay based effects
+
+A delay line can only produce output while something above the
+threshold is still inside the part of its buffer the read heads can
+reach (its span). The tracker keeps, per line, the number of frames
+since the last block whose writes peaked above the threshold. Once
+every line has been quiet for its whole span, the effect's output is
+below the threshold for as long as its input is, so the callback may
+zero its outputs and skip the lines. It must not do this while
+feedback can grow a quiet tail back up (gain >= 1).
+
+When signal returns, FirstAbove() gives the first loud sample of the
+block; processing restarts there, which is sample accurate because
+running the lines over the skipped silence would have changed nothing
+audible.
+*/
+template <size_t max_lines>
+class ActivityTracker
+{
+  public:
+    static constexpr float kDefaultThreshold = 1.0e-4f; // -80 dBFS
+
+    void Init(float threshold = kDefaultThreshold)
+    {
+        threshold_ = threshold;
+        for(size_t l = 0; l < max_lines; l++)
+        {
+            span_[l] = 0;
+            quiet_[l] = 0;
+        }
+    }
+
+    /** frames of history the line's read heads can reach */
+    void SetSpan(size_t line, size_t frames)
+    {
+        span_[line] = frames;
+        if(quiet_[line] > frames)
+            quiet_[line] = frames;
+    }
+
+    /** peak of everything written to the line over the last frames */
+    inline void Wrote(size_t line, float peak, size_t frames)
+    {
+        if(peak >= threshold_)
+            quiet_[line] = 0;
+        else
+            quiet_[line] = quiet_[line] + frames < span_[line] ? quiet_[line] + frames : span_[line];
+    }
+
+    /** every line has been quiet for its full span */
+    inline bool Idle() const
+    {
+        for(size_t l = 0; l < max_lines; l++)
+            if(quiet_[l] < span_[l])
+                return false;
+        return true;
+    }
+
+    /** index of the first sample at or above the threshold, n if none */
+    inline size_t FirstAbove(const float* in, size_t n) const
+    {
+        for(size_t i = 0; i < n; i++)
+            if(fabsf(in[i]) >= threshold_)
+                return i;
+        return n;
+    }
+
+    float Threshold() const { return threshold_; }
+
+  private:
+    float threshold_ = kDefaultThreshold;
+    size_t span_[max_lines] = {};
+    size_t quiet_[max_lines] = {};
+};
+
+#endif
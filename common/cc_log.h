@@ -0,0 +1,315 @@
+#pragma once
+#ifndef COMMON_CC_LOG_H
+#define COMMON_CC_LOG_H
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dsp_node.h"
+
+/** Compact recording and sample accurate replay of MIDI control changes
+
+A CC log is the 8 byte magic "JACCLOG1", the sample rate as a little
+endian uint32, then one record per control change: the frames since the
+previous one as an unsigned LEB128 varint, the status byte (which keeps
+the channel), the controller and the value. A knob turned every period
+costs 4-5 bytes per change.
+
+Frames count from the first recorded cycle and advance by nframes per
+process cycle, so a replay lands every change on the frame it was
+received on, whatever the period size.
+*/
+struct CcEvent
+{
+    uint64_t frame;
+    uint8_t  status;
+    uint8_t  cc;
+    uint8_t  value;
+};
+
+namespace cclog
+{
+static constexpr char kMagic[8] = {'J', 'A', 'C', 'C', 'L', 'O', 'G', '1'};
+
+inline bool WriteHeader(FILE* f, float sample_rate)
+{
+    uint32_t rate = uint32_t(sample_rate);
+    uint8_t  header[12];
+    memcpy(header, kMagic, 8);
+    for(int b = 0; b < 4; b++)
+        header[8 + b] = uint8_t(rate >> (8 * b));
+    return fwrite(header, 1, sizeof(header), f) == sizeof(header);
+}
+
+/** appends one record to p, returns its length (at most 13 bytes) */
+inline size_t Encode(uint8_t* p, uint64_t delta, const CcEvent& e)
+{
+    size_t n = 0;
+    do
+    {
+        uint8_t byte = delta & 0x7f;
+        delta >>= 7;
+        p[n++] = byte | (delta ? 0x80 : 0);
+    } while(delta);
+    p[n++] = e.status;
+    p[n++] = e.cc;
+    p[n++] = e.value;
+    return n;
+}
+} // namespace cclog
+
+/** reads a whole CC log; false with err set if it is not one */
+inline bool LoadCcLog(const std::string&     path,
+                      std::vector<CcEvent>* events,
+                      float*                sample_rate,
+                      std::string*          err)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f)
+    {
+        *err = path + ": " + strerror(errno);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t              buf[4096];
+    size_t               got;
+    while((got = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + got);
+    fclose(f);
+
+    if(data.size() < 12 || memcmp(data.data(), cclog::kMagic, 8) != 0)
+    {
+        *err = path + ": not a CC log";
+        return false;
+    }
+    uint32_t rate = 0;
+    for(int b = 0; b < 4; b++)
+        rate |= uint32_t(data[8 + b]) << (8 * b);
+    *sample_rate = float(rate);
+
+    events->clear();
+    uint64_t frame = 0;
+    size_t   p = 12;
+    while(p < data.size())
+    {
+        uint64_t delta = 0;
+        int      shift = 0;
+        uint8_t  byte;
+        do
+        {
+            if(p >= data.size() || shift > 63)
+            {
+                *err = path + ": truncated";
+                return false;
+            }
+            byte = data[p++];
+            delta |= uint64_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+        if(p + 3 > data.size())
+        {
+            // a recorder killed mid-write; keep what came before
+            break;
+        }
+        frame += delta;
+        events->push_back(CcEvent{frame, data[p], data[p + 1], data[p + 2]});
+        p += 3;
+    }
+    return true;
+}
+
+/** writes events (sorted by frame) as a CC log */
+inline bool SaveCcLog(const std::string&          path,
+                      const std::vector<CcEvent>& events,
+                      float                       sample_rate,
+                      std::string*                err)
+{
+    FILE* f = fopen(path.c_str(), "wb");
+    if(!f)
+    {
+        *err = path + ": " + strerror(errno);
+        return false;
+    }
+    bool     ok = cclog::WriteHeader(f, sample_rate);
+    uint64_t frame = 0;
+    uint8_t  record[16];
+    for(size_t i = 0; ok && i < events.size(); i++)
+    {
+        size_t n = cclog::Encode(record, events[i].frame - frame, events[i]);
+        frame = events[i].frame;
+        ok = fwrite(record, 1, n, f) == n;
+    }
+    if(fclose(f) != 0)
+        ok = false;
+    if(!ok)
+        *err = path + ": " + strerror(errno);
+    return ok;
+}
+
+/** Records the control changes the process callback sees
+
+Record() runs in the process callback: it stamps each CC with its
+absolute frame and pushes it into a lock-free single producer / single
+consumer queue, dropping it (Dropped()) if the queue is full. A writer
+thread drains the queue every few milliseconds and does the encoding
+and file I/O.
+*/
+class CcRecorder
+{
+  public:
+    ~CcRecorder() { Close(); }
+
+    bool Open(const std::string& path, float sample_rate, std::string* err)
+    {
+        Close();
+        file_ = fopen(path.c_str(), "wb");
+        if(!file_ || !cclog::WriteHeader(file_, sample_rate))
+        {
+            *err = path + ": " + strerror(errno);
+            Close();
+            return false;
+        }
+        frame_ = 0;
+        last_ = 0;
+        running_ = true;
+        writer_ = std::thread([this]() {
+            while(running_.load(std::memory_order_acquire))
+            {
+                Drain();
+                usleep(10000);
+            }
+            Drain();
+        });
+        return true;
+    }
+
+    /** process thread, once per cycle with the cycle's events */
+    inline void Record(const MidiEvent* midi, size_t nmidi, size_t nframes)
+    {
+        if(!file_)
+            return;
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        for(size_t i = 0; i < nmidi; i++)
+        {
+            const uint8_t* data = midi[i].data;
+            if(midi[i].size < 3 || (data[0] & 0xF0) != 0xB0)
+                continue;
+            if(head - tail >= kQueue)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            queue_[head & (kQueue - 1)] = CcEvent{frame_ + midi[i].time, data[0], data[1], data[2]};
+            head++;
+        }
+        head_.store(head, std::memory_order_release);
+        frame_ += nframes;
+    }
+
+    size_t Recorded() const { return recorded_.load(std::memory_order_relaxed); }
+    size_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    /** stops the writer after it has written everything queued */
+    void Close()
+    {
+        if(writer_.joinable())
+        {
+            running_.store(false, std::memory_order_release);
+            writer_.join();
+        }
+        if(file_)
+            fclose(file_);
+        file_ = nullptr;
+    }
+
+  private:
+    static constexpr size_t kQueue = 4096;
+
+    void Drain()
+    {
+        size_t  tail = tail_.load(std::memory_order_relaxed);
+        size_t  head = head_.load(std::memory_order_acquire);
+        uint8_t record[16];
+        for(; tail != head; tail++)
+        {
+            const CcEvent& e = queue_[tail & (kQueue - 1)];
+            size_t         n = cclog::Encode(record, e.frame - last_, e);
+            last_ = e.frame;
+            fwrite(record, 1, n, file_);
+            recorded_.fetch_add(1, std::memory_order_relaxed);
+        }
+        tail_.store(tail, std::memory_order_release);
+        fflush(file_);
+    }
+
+    CcEvent             queue_[kQueue];
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+    std::atomic<size_t> dropped_{0};
+    uint64_t            frame_ = 0; // process thread
+    uint64_t            last_ = 0;  // writer thread
+    std::atomic<size_t> recorded_{0};
+
+    FILE*             file_ = nullptr;
+    std::thread       writer_;
+    std::atomic<bool> running_{false};
+};
+
+/** Plays a loaded CC log back into the process callback
+
+Next() hands out the events that fall inside the next nframes as
+MidiEvents stamped with their offset in the block, the same way they
+would have arrived from a MIDI port. It only reads the loaded vector, so
+it is safe in the process callback, and it gives the same events on the
+same frames on every run.
+*/
+class CcPlayer
+{
+  public:
+    void Init(std::vector<CcEvent> events)
+    {
+        events_ = std::move(events);
+        next_ = 0;
+        frame_ = 0;
+    }
+
+    /** process thread: up to max events of the next nframes into out */
+    inline size_t Next(size_t nframes, MidiEvent* out, size_t max)
+    {
+        size_t   n = 0;
+        uint64_t end = frame_ + nframes;
+        for(; next_ < events_.size() && events_[next_].frame < end; next_++)
+        {
+            if(n == max)
+                continue;
+            const CcEvent& e = events_[next_];
+            out[n].time = uint32_t(e.frame < frame_ ? 0 : e.frame - frame_);
+            out[n].size = 3;
+            out[n].data[0] = e.status;
+            out[n].data[1] = e.cc;
+            out[n].data[2] = e.value;
+            out[n].data[3] = 0;
+            n++;
+        }
+        frame_ = end;
+        return n;
+    }
+
+    bool     Done() const { return next_ == events_.size(); }
+    uint64_t Frame() const { return frame_; }
+    /** frame of the last event, 0 if there is none */
+    uint64_t Length() const { return events_.empty() ? 0 : events_.back().frame; }
+
+  private:
+    std::vector<CcEvent> events_;
+    size_t               next_ = 0;
+    uint64_t             frame_ = 0;
+};
+
+#endif
@@ -0,0 +1,419 @@
+#pragma once
+#ifndef COMMON_CONVOLVER_H
+#define COMMON_CONVOLVER_H
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "fft.h"
+
+/** Uniformly partitioned overlap-add convolution of a stereo pair
+
+The IR is cut into segments of `block` samples, and each one is
+transformed into a 2 * block spectrum at Init(). Both input channels go
+through one complex FFT as left + i * right. With a mono IR the product
+with a segment spectrum keeps them apart by itself. With a stereo IR each
+segment stores A = (HL + HR) / 2 and D = (HL - HR) / 2, and the output
+spectrum A.Z(f) + D.conj(Z(-f)) is again left * HL + i * right * HR.
+
+Step() takes any count up to the end of the current block and returns
+the output for exactly those samples, so it adds no latency: a partial
+block costs a full FFT pair, a whole block costs one. Input and output
+may be the same buffers.
+*/
+class UniformConvolver
+{
+  public:
+    typedef Fft::cfloat cfloat;
+
+    /** uses ir[c][offset .. offset + length) for c < channels (1 or 2);
+        block must be a power of two */
+    bool Init(const float* const* ir, size_t channels, size_t offset, size_t length, size_t block)
+    {
+        const size_t m = 2 * block;
+        if(!fft_.Init(m))
+            return false;
+        block_ = block;
+        segments_ = std::max<size_t>(1, (length + block - 1) / block);
+        stereo_ = channels > 1;
+
+        sum_.assign(segments_ * m, cfloat());
+        diff_.assign(stereo_ ? segments_ * m : 0, cfloat());
+        std::vector<cfloat> hl(m), hr(m);
+        // folds the 1 / m of the unscaled inverse transform into the IR
+        const float scale = 1.0f / float(m);
+        for(size_t s = 0; s < segments_; s++)
+        {
+            std::fill(hl.begin(), hl.end(), cfloat());
+            std::fill(hr.begin(), hr.end(), cfloat());
+            for(size_t i = 0; i < block && s * block + i < length; i++)
+            {
+                hl[i] = cfloat(ir[0][offset + s * block + i], 0.0f);
+                hr[i] = cfloat(ir[stereo_ ? 1 : 0][offset + s * block + i], 0.0f);
+            }
+            fft_.Forward(hl.data());
+            if(stereo_)
+                fft_.Forward(hr.data());
+            for(size_t k = 0; k < m; k++)
+            {
+                if(stereo_)
+                {
+                    sum_[s * m + k]  = (hl[k] + hr[k]) * (0.5f * scale);
+                    diff_[s * m + k] = (hl[k] - hr[k]) * (0.5f * scale);
+                }
+                else
+                    sum_[s * m + k] = hl[k] * scale;
+            }
+        }
+
+        input_.assign(segments_ * m, cfloat());
+        acc_.assign(m, cfloat());
+        buf_.assign(m, cfloat());
+        inL_.assign(block, 0.0f);
+        inR_.assign(block, 0.0f);
+        overlapL_.assign(block, 0.0f);
+        overlapR_.assign(block, 0.0f);
+        current_ = 0;
+        pos_ = 0;
+        return true;
+    }
+
+    size_t Block() const { return block_; }
+    size_t Position() const { return pos_; }
+
+    /** count must not run past the end of the current block */
+    void Step(const float* inL, const float* inR, float* outL, float* outR, size_t count)
+    {
+        const size_t m = 2 * block_;
+        const bool fresh = pos_ == 0;
+        memcpy(inL_.data() + pos_, inL, count * sizeof(float));
+        memcpy(inR_.data() + pos_, inR, count * sizeof(float));
+
+        cfloat* z = &input_[current_ * m];
+        for(size_t i = 0; i < block_; i++)
+            z[i] = cfloat(inL_[i], inR_[i]);
+        std::fill(z + block_, z + m, cfloat());
+        fft_.Forward(z);
+
+        if(fresh)
+        {
+            // the older segments do not change until the next block
+            std::fill(acc_.begin(), acc_.end(), cfloat());
+            for(size_t s = 1; s < segments_; s++)
+                Accumulate(acc_.data(), s, (current_ + s) % segments_);
+        }
+        std::copy(acc_.begin(), acc_.end(), buf_.begin());
+        Accumulate(buf_.data(), 0, current_);
+        fft_.Inverse(buf_.data());
+
+        for(size_t i = 0; i < count; i++)
+        {
+            outL[i] = buf_[pos_ + i].real() + overlapL_[pos_ + i];
+            outR[i] = buf_[pos_ + i].imag() + overlapR_[pos_ + i];
+        }
+
+        pos_ += count;
+        if(pos_ == block_)
+        {
+            for(size_t i = 0; i < block_; i++)
+            {
+                overlapL_[i] = buf_[block_ + i].real();
+                overlapR_[i] = buf_[block_ + i].imag();
+            }
+            std::fill(inL_.begin(), inL_.end(), 0.0f);
+            std::fill(inR_.begin(), inR_.end(), 0.0f);
+            pos_ = 0;
+            current_ = (current_ + segments_ - 1) % segments_;
+        }
+    }
+
+    /** stands in blocks of silence for input that was never delivered;
+        only valid on a block boundary */
+    void Skip(size_t blocks)
+    {
+        const size_t m = 2 * block_;
+        for(size_t b = 0; b < std::min(blocks, segments_); b++)
+        {
+            std::fill(&input_[current_ * m], &input_[current_ * m] + m, cfloat());
+            current_ = (current_ + segments_ - 1) % segments_;
+        }
+        std::fill(overlapL_.begin(), overlapL_.end(), 0.0f);
+        std::fill(overlapR_.begin(), overlapR_.end(), 0.0f);
+    }
+
+  private:
+    // dst += H(seg) . X(slot), written out so it stays a plain multiply-add
+    void Accumulate(cfloat* dst, size_t seg, size_t slot) const
+    {
+        const size_t m = 2 * block_;
+        const cfloat* h = &sum_[seg * m];
+        const cfloat* x = &input_[slot * m];
+        for(size_t k = 0; k < m; k++)
+        {
+            float re = h[k].real() * x[k].real() - h[k].imag() * x[k].imag();
+            float im = h[k].real() * x[k].imag() + h[k].imag() * x[k].real();
+            dst[k] += cfloat(re, im);
+        }
+        if(!stereo_)
+            return;
+        const cfloat* d = &diff_[seg * m];
+        for(size_t k = 0; k < m; k++)
+        {
+            // conj(X(-f))
+            const cfloat& xr = x[(m - k) & (m - 1)];
+            float re = d[k].real() * xr.real() + d[k].imag() * xr.imag();
+            float im = d[k].imag() * xr.real() - d[k].real() * xr.imag();
+            dst[k] += cfloat(re, im);
+        }
+    }
+
+    Fft                 fft_;
+    size_t              block_ = 0;
+    size_t              segments_ = 0;
+    bool                stereo_ = false;
+    std::vector<cfloat> sum_, diff_;
+    std::vector<cfloat> input_; // ring of input spectra, newest at current_
+    std::vector<cfloat> acc_, buf_;
+    std::vector<float>  inL_, inR_, overlapL_, overlapR_;
+    size_t              current_ = 0;
+    size_t              pos_ = 0;
+};
+
+/** Two stage partitioned convolution for long impulse responses
+
+The head, IR[0, 2 * tail_block), runs in the calling thread as a
+UniformConvolver with head_block partitions, so there is no added
+latency. The rest of the IR runs as a UniformConvolver with tail_block
+partitions on a worker thread. Each tail_block of input is handed over as
+soon as it is complete, and its output is first needed one tail_block
+later, so that is the worker's deadline. The blocks are double buffered.
+A worker that misses its deadline costs one block of tail, counted by
+Misses(), rather than stalling the caller.
+
+Init() allocates and transforms everything; Process() never allocates,
+locks or blocks, and only posts a semaphore once per tail_block.
+*/
+class Convolver
+{
+  public:
+    ~Convolver() { Stop(); }
+
+    /** ir[c] for c < channels (1 or 2), length samples each. Both block
+        sizes are powers of two with head_block <= tail_block. The worker
+        runs SCHED_FIFO at rt_priority when permitted; without threaded
+        the tail is computed inline (offline rendering). */
+    bool Init(const float* const* ir,
+              size_t              channels,
+              size_t              length,
+              size_t              head_block,
+              size_t              tail_block,
+              int                 rt_priority,
+              bool                threaded = true)
+    {
+        Stop();
+        if(length == 0 || head_block > tail_block || (tail_block & (tail_block - 1)) != 0)
+            return false;
+        const size_t head_length = std::min(length, 2 * tail_block);
+        if(!head_.Init(ir, channels, 0, head_length, head_block))
+            return false;
+
+        tailBlock_ = tail_block;
+        length_ = length;
+        hasTail_ = length > head_length;
+        pos_ = 0;
+        blocks_ = 0;
+        expect_ = 0;
+        fill_ = 0;
+        fillValid_ = true;
+        readValid_ = false;
+        misses_.store(0);
+        if(!hasTail_)
+            return true;
+
+        tail_.Init(ir, channels, head_length, length - head_length, tail_block);
+        for(int s = 0; s < 2; s++)
+        {
+            slots_[s].inL.assign(tail_block, 0.0f);
+            slots_[s].inR.assign(tail_block, 0.0f);
+            slots_[s].outL.assign(tail_block, 0.0f);
+            slots_[s].outR.assign(tail_block, 0.0f);
+            slots_[s].state.store(kIdle);
+        }
+
+        threaded_ = threaded && StartWorker(rt_priority);
+        return true;
+    }
+
+    void Stop()
+    {
+        if(!threaded_)
+            return;
+        running_.store(false);
+        sem_post(&sem_);
+        pthread_join(thread_, nullptr);
+        sem_destroy(&sem_);
+        threaded_ = false;
+    }
+
+    /** samples after which the output has died away */
+    size_t Length() const { return length_ + (hasTail_ ? tailBlock_ : 0); }
+    bool Threaded() const { return threaded_; }
+    size_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+
+    /** wet output only; in and out may be the same buffers */
+    void Process(const float* inL, const float* inR, float* outL, float* outR, size_t nframes)
+    {
+        const size_t head_block = head_.Block();
+        size_t done = 0;
+        while(done < nframes)
+        {
+            size_t count = std::min(nframes - done, head_block - pos_ % head_block);
+            if(hasTail_ && fillValid_)
+            {
+                memcpy(slots_[fill_].inL.data() + pos_, inL + done, count * sizeof(float));
+                memcpy(slots_[fill_].inR.data() + pos_, inR + done, count * sizeof(float));
+            }
+            head_.Step(inL + done, inR + done, outL + done, outR + done, count);
+            if(readValid_)
+            {
+                // the slot being refilled still holds the previous block's output
+                const Slot& read = slots_[fill_];
+                for(size_t i = 0; i < count; i++)
+                {
+                    outL[done + i] += read.outL[pos_ + i];
+                    outR[done + i] += read.outR[pos_ + i];
+                }
+            }
+
+            pos_ += count;
+            done += count;
+            if(pos_ == tailBlock_)
+            {
+                pos_ = 0;
+                if(hasTail_)
+                    Handoff();
+            }
+        }
+    }
+
+  private:
+    enum { kIdle, kQueued, kDone };
+
+    struct Slot
+    {
+        std::vector<float> inL, inR, outL, outR;
+        size_t             index = 0;
+        std::atomic<int>   state{kIdle};
+    };
+
+    /** a tail block is complete: queue it, and pick up the one before */
+    void Handoff()
+    {
+        Slot& filled = slots_[fill_];
+        Slot& other = slots_[1 - fill_];
+        if(fillValid_)
+        {
+            filled.index = blocks_;
+            filled.state.store(kQueued, std::memory_order_release);
+            if(threaded_)
+                sem_post(&sem_);
+            else
+                Compute(filled);
+        }
+        blocks_++;
+
+        // the other slot holds the previous block's output, due from now on
+        int state = other.state.load(std::memory_order_acquire);
+        readValid_ = state == kDone && other.index + 2 == blocks_;
+        if(state == kDone)
+            other.state.store(kIdle, std::memory_order_relaxed);
+        else if(state == kQueued)
+            misses_.fetch_add(1, std::memory_order_relaxed);
+
+        // it also takes the next block, unless the worker still has it
+        fillValid_ = state != kQueued;
+        fill_ = 1 - fill_;
+    }
+
+    void Compute(Slot& slot)
+    {
+        if(slot.index > expect_)
+            tail_.Skip(slot.index - expect_);
+        tail_.Step(slot.inL.data(), slot.inR.data(), slot.outL.data(), slot.outR.data(), tailBlock_);
+        expect_ = slot.index + 1;
+        slot.state.store(kDone, std::memory_order_release);
+    }
+
+    bool StartWorker(int rt_priority)
+    {
+        if(sem_init(&sem_, 0, 0) != 0)
+            return false;
+        running_.store(true);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = std::max(rt_priority, 1);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+        bool started = pthread_create(&thread_, &attr, Worker, this) == 0
+                       || pthread_create(&thread_, nullptr, Worker, this) == 0;
+        pthread_attr_destroy(&attr);
+        if(!started)
+            sem_destroy(&sem_);
+        return started;
+    }
+
+    static void* Worker(void* arg)
+    {
+        Convolver* self = static_cast<Convolver*>(arg);
+        for(;;)
+        {
+            while(sem_wait(&self->sem_) != 0 && errno == EINTR) {}
+            if(!self->running_.load())
+                return nullptr;
+            // oldest queued block first; after a miss both may be waiting
+            for(;;)
+            {
+                Slot* next = nullptr;
+                for(Slot& s : self->slots_)
+                    if(s.state.load(std::memory_order_acquire) == kQueued
+                       && (!next || s.index < next->index))
+                        next = &s;
+                if(!next)
+                    break;
+                self->Compute(*next);
+            }
+        }
+    }
+
+    UniformConvolver head_, tail_;
+    size_t           tailBlock_ = 0;
+    size_t           length_ = 0;
+    bool             hasTail_ = false;
+
+    // caller's side
+    size_t pos_ = 0;    // position in the current tail block
+    size_t blocks_ = 0; // tail blocks completed
+    int    fill_ = 0;   // slot taking input and being read
+    bool   fillValid_ = true;
+    bool   readValid_ = false;
+    std::atomic<size_t> misses_{0};
+
+    // worker's side
+    size_t expect_ = 0; // next block index the tail state expects
+
+    Slot              slots_[2];
+    bool              threaded_ = false;
+    std::atomic<bool> running_{false};
+    sem_t             sem_;
+    pthread_t         thread_;
+};
+
+#endif
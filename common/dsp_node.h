@@ -0,0 +1,77 @@
+#pragma once
+#ifndef COMMON_DSP_NODE_H
+#define COMMON_DSP_NODE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/** short MIDI message stamped with its frame offset in the block */
+struct MidiEvent
+{
+    uint32_t time;
+    uint32_t size;
+    uint8_t  data[4];
+};
+
+/** One app's DSP, independent of how it is hosted
+
+The standalone apps wrap a single node in their own JACK client; DspHost
+runs several in one client. Configure() and Init() run before audio
+starts and may allocate; Process() runs in the process callback and must
+not. Every input and output pointer is valid for nframes samples; an
+unconnected input reads silence.
+*/
+class DspNode
+{
+  public:
+    virtual ~DspNode() {}
+
+    /** key=value setting, before Init(); false if the key is unknown or
+        the value is out of range */
+    virtual bool Configure(const std::string& key, const std::string& value) { return false; }
+
+    /** index of a numeric parameter that may change while running, -1
+        if there is none by that name */
+    virtual int ParamIndex(const std::string& key) const { return -1; }
+
+    /** sets a parameter from ParamIndex(); safe in the process callback
+        and before Init() */
+    virtual void SetParam(int index, float value) {}
+
+    virtual void Init(float sample_rate) = 0;
+
+    virtual size_t Inputs() const  = 0;
+    virtual size_t Outputs() const = 0;
+
+    virtual void Process(const float* const* in,
+                         float* const*       out,
+                         size_t              nframes,
+                         const MidiEvent*    midi,
+                         size_t              nmidi)
+        = 0;
+
+    /** size of the state SaveState() writes, 0 if the node keeps none
+        worth restoring; fixed once Init() has run */
+    virtual size_t StateBytes() const { return 0; }
+
+    /** copies delay buffers and head positions to dst from a background
+        thread while Process() keeps running; false if the process
+        thread did not answer in time */
+    virtual bool SaveState(void* dst) { return false; }
+
+    /** restores what SaveState() wrote, after Init() and before the
+        first Process() */
+    virtual void LoadState(const void* src) {}
+
+    /** rebuilds everything that depends on the sample rate, after Init()
+        and off the process thread while Process() keeps running; the new
+        state takes over at the start of a later cycle. false if the
+        node has nothing rate dependent */
+    virtual bool SetSampleRate(float sample_rate) { return false; }
+
+    /** frees state that SetSampleRate() has replaced, once the process
+        thread has let go of it; off the process thread */
+    virtual void Reclaim() {}
+};
+
+#endif
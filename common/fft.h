@@ -0,0 +1,84 @@
+#pragma once
+#ifndef COMMON_FFT_H
+#define COMMON_FFT_H
+#include <stddef.h>
+#include <math.h>
+#include <complex>
+#include <vector>
+
+/** Radix-2 complex FFT
+
+Iterative, in place, power of two sizes only. Twiddles and the bit
+reversal permutation are computed by Init(), which allocates; Forward()
+and Inverse() do not, so a planned Fft can be used from a process
+callback. Inverse() is unscaled: Inverse(Forward(x)) == n * x.
+*/
+class Fft
+{
+  public:
+    typedef std::complex<float> cfloat;
+
+    /** n must be a power of two, returns false otherwise */
+    bool Init(size_t n)
+    {
+        if(n < 2 || (n & (n - 1)) != 0)
+            return false;
+        n_ = n;
+        twiddle_.resize(n / 2);
+        for(size_t k = 0; k < n / 2; k++)
+        {
+            double w = -2.0 * M_PI * double(k) / double(n);
+            twiddle_[k] = cfloat(float(cos(w)), float(sin(w)));
+        }
+        bitrev_.resize(n);
+        size_t bits = 0;
+        while((size_t(1) << bits) < n)
+            bits++;
+        for(size_t i = 0; i < n; i++)
+        {
+            size_t r = 0;
+            for(size_t b = 0; b < bits; b++)
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            bitrev_[i] = r;
+        }
+        return true;
+    }
+
+    size_t Size() const { return n_; }
+
+    void Forward(cfloat* data) const { Transform(data, false); }
+    void Inverse(cfloat* data) const { Transform(data, true); }
+
+  private:
+    void Transform(cfloat* data, bool inverse) const
+    {
+        const size_t n = n_;
+        for(size_t i = 0; i < n; i++)
+            if(i < bitrev_[i])
+                std::swap(data[i], data[bitrev_[i]]);
+
+        for(size_t half = 1; half < n; half <<= 1)
+        {
+            const size_t stride = n / (half * 2);
+            for(size_t start = 0; start < n; start += half * 2)
+            {
+                for(size_t k = 0; k < half; k++)
+                {
+                    cfloat w = twiddle_[k * stride];
+                    if(inverse)
+                        w = std::conj(w);
+                    cfloat a = data[start + k];
+                    cfloat b = data[start + k + half] * w;
+                    data[start + k] = a + b;
+                    data[start + k + half] = a - b;
+                }
+            }
+        }
+    }
+
+    size_t n_ = 0;
+    std::vector<cfloat> twiddle_;
+    std::vector<size_t> bitrev_;
+};
+
+#endif
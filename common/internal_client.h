@@ -0,0 +1,234 @@
+#pragma once
+#ifndef COMMON_INTERNAL_CLIENT_H
+#define COMMON_INTERNAL_CLIENT_H
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <jack/jack.h>
+#include "dsp_node.h"
+#include "jack_midi.h"
+#include "param_channel.h"
+#include "snapshot.h"
+
+/** Glue that runs a DspNode as a JACK internal client (jack_load), so its
+process callback runs inside jackd with no IPC hop per cycle.
+
+load_init is a space separated list of key=value settings passed to
+DspNode::Configure(), plus snapshot=<path> for warm-start snapshots
+(see Snapshotter) and fifo=<path> to open a control FIFO. Lines
+written to the FIFO ("key value" or "key=value") are resolved with
+ParamIndex() on a control thread and handed to the process callback
+through a lock-free ParamChannel, e.g.
+
+    jack_load multidelay multidelay -i "feedback=0.3 fifo=/tmp/multidelay.ctl"
+    echo "time2 450" > /tmp/multidelay.ctl
+
+The process callback argument is the InternalClient itself, which is
+what jackd hands back to jack_finish().
+*/
+class InternalClient
+{
+  public:
+    InternalClient(jack_client_t*           client,
+                   DspNode*                 dsp,
+                   std::vector<std::string> input_names,
+                   std::vector<std::string> output_names)
+    : client_(client),
+      dsp_(dsp),
+      input_names_(std::move(input_names)),
+      output_names_(std::move(output_names))
+    {
+    }
+
+    ~InternalClient()
+    {
+        // last save while the process callback still answers the
+        // capture, as the standalone apps do; then stop the callback
+        // before the node goes away
+        snapshots_.Close(true);
+        jack_deactivate(client_);
+        running_ = false;
+        if(control_.joinable())
+            control_.join();
+        if(fifo_fd_ >= 0)
+            close(fifo_fd_);
+    }
+
+    /** 0 on success, as jack_initialize() returns */
+    int Start(const char* load_init)
+    {
+        std::istringstream words(load_init ? load_init : "");
+        std::string kv;
+        while(words >> kv)
+        {
+            size_t eq = kv.find('=');
+            std::string key = kv.substr(0, eq);
+            std::string value = eq == std::string::npos ? std::string() : kv.substr(eq + 1);
+            if(key == "fifo")
+                fifo_path_ = value;
+            else if(key == "snapshot")
+                snapshot_path_ = value;
+            else if(!dsp_->Configure(key, value))
+            {
+                fprintf(stderr, "%s: bad setting %s\n", jack_get_client_name(client_), kv.c_str());
+                return 1;
+            }
+        }
+
+        dsp_->Init(jack_get_sample_rate(client_));
+
+        if(!snapshot_path_.empty())
+        {
+            bool restored = false;
+            std::string err;
+            if(!snapshots_.Open(snapshot_path_, jack_get_client_name(client_), dsp_.get(),
+                                jack_get_sample_rate(client_), &restored, &err))
+                fprintf(stderr, "%s: snapshots disabled: %s\n", jack_get_client_name(client_), err.c_str());
+            else if(restored)
+                fprintf(stderr, "%s: restored state from %s\n", jack_get_client_name(client_),
+                        snapshot_path_.c_str());
+        }
+
+        for(auto& name : input_names_)
+            input_ports_.push_back(jack_port_register(client_, name.c_str(), JACK_DEFAULT_AUDIO_TYPE,
+                                                      JackPortIsInput, 0));
+        for(auto& name : output_names_)
+            output_ports_.push_back(jack_port_register(client_, name.c_str(), JACK_DEFAULT_AUDIO_TYPE,
+                                                       JackPortIsOutput, 0));
+        midi_in_ = jack_port_register(client_, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+        for(auto* port : input_ports_)
+            if(!port)
+                return 1;
+        for(auto* port : output_ports_)
+            if(!port)
+                return 1;
+        if(!midi_in_)
+            return 1;
+        in_.assign(input_ports_.size(), nullptr);
+        out_.assign(output_ports_.size(), nullptr);
+
+        if(!fifo_path_.empty())
+        {
+            if(mkfifo(fifo_path_.c_str(), 0660) != 0 && errno != EEXIST)
+            {
+                fprintf(stderr, "%s: cannot create %s: %s\n", jack_get_client_name(client_),
+                        fifo_path_.c_str(), strerror(errno));
+                return 1;
+            }
+            // read-write so the FIFO never reports EOF between writers
+            fifo_fd_ = open(fifo_path_.c_str(), O_RDWR | O_NONBLOCK);
+            if(fifo_fd_ < 0)
+                return 1;
+            running_ = true;
+            control_ = std::thread(&InternalClient::ControlLoop, this);
+        }
+
+        jack_set_process_callback(client_, Process, this);
+        jack_set_sample_rate_callback(client_, SampleRate, this);
+        if(jack_activate(client_) != 0)
+            return 1;
+        snapshots_.Start(5.0);
+        return 0;
+    }
+
+  private:
+    static int Process(jack_nframes_t nframes, void* arg)
+    {
+        InternalClient* self = static_cast<InternalClient*>(arg);
+        DspNode* dsp = self->dsp_.get();
+
+        self->params_.Drain([dsp](int index, float value) { dsp->SetParam(index, value); });
+
+        for(size_t i = 0; i < self->input_ports_.size(); i++)
+            self->in_[i] = (const float*)jack_port_get_buffer(self->input_ports_[i], nframes);
+        for(size_t o = 0; o < self->output_ports_.size(); o++)
+            self->out_[o] = (float*)jack_port_get_buffer(self->output_ports_[o], nframes);
+        size_t nmidi = CollectMidi(jack_port_get_buffer(self->midi_in_, nframes), self->midi_,
+                                   kMaxMidiEvents);
+
+        dsp->Process(self->in_.data(), self->out_.data(), nframes, self->midi_, nmidi);
+        return 0;
+    }
+
+    // notification thread: the node builds its state for the new rate and
+    // the process callback swaps it in. There is no main loop here, so
+    // what an earlier change replaced is freed now, the last on unload.
+    static int SampleRate(jack_nframes_t rate, void* arg)
+    {
+        InternalClient* self = static_cast<InternalClient*>(arg);
+        self->dsp_->Reclaim();
+        self->dsp_->SetSampleRate(float(rate));
+        self->snapshots_.SetSampleRate(float(rate));
+        return 0;
+    }
+
+    void ControlLoop()
+    {
+        std::string pending;
+        char buf[256];
+        while(running_)
+        {
+            pollfd pfd = {fifo_fd_, POLLIN, 0};
+            if(poll(&pfd, 1, 200) <= 0)
+                continue;
+            ssize_t n = read(fifo_fd_, buf, sizeof(buf));
+            if(n <= 0)
+                continue;
+            pending.append(buf, size_t(n));
+
+            size_t nl;
+            while((nl = pending.find('\n')) != std::string::npos)
+            {
+                std::string line = pending.substr(0, nl);
+                pending.erase(0, nl + 1);
+                for(char& c : line)
+                    if(c == '=')
+                        c = ' ';
+                std::istringstream words(line);
+                std::string key;
+                float value;
+                if(!(words >> key >> value))
+                    continue;
+                int index = dsp_->ParamIndex(key);
+                if(index < 0)
+                    fprintf(stderr, "%s: unknown parameter %s\n", jack_get_client_name(client_),
+                            key.c_str());
+                else if(!params_.Push(index, value))
+                    fprintf(stderr, "%s: parameter queue full\n", jack_get_client_name(client_));
+            }
+        }
+    }
+
+    jack_client_t*             client_;
+    std::unique_ptr<DspNode>   dsp_;
+    std::vector<std::string>   input_names_;
+    std::vector<std::string>   output_names_;
+    std::vector<jack_port_t*>  input_ports_;
+    std::vector<jack_port_t*>  output_ports_;
+    jack_port_t*               midi_in_ = nullptr;
+    std::vector<const float*>  in_;
+    std::vector<float*>        out_;
+    MidiEvent                  midi_[kMaxMidiEvents];
+
+    Snapshotter                snapshots_;
+    std::string                snapshot_path_;
+
+    ParamChannel<256>          params_;
+    std::string                fifo_path_;
+    int                        fifo_fd_ = -1;
+    std::atomic<bool>          running_{false};
+    std::thread                control_;
+};
+
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef COMMON_JACK_MIDI_H
+#define COMMON_JACK_MIDI_H
+#include <string.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include "dsp_node.h"
+
+constexpr size_t kMaxMidiEvents = 512;
+
+/** copies the short messages of a JACK MIDI port buffer into events, in
+    time order; sysex and anything past max are dropped */
+inline size_t CollectMidi(void* port_buffer, MidiEvent* events, size_t max)
+{
+    size_t n = 0;
+    jack_nframes_t count = jack_midi_get_event_count(port_buffer);
+    jack_midi_event_t event;
+    for(jack_nframes_t i = 0; i < count && n < max; ++i)
+    {
+        if(jack_midi_event_get(&event, port_buffer, i) != 0)
+            continue;
+        if(event.size == 0 || event.size > sizeof(events[n].data))
+            continue;
+        events[n].time = event.time;
+        events[n].size = uint32_t(event.size);
+        memcpy(events[n].data, event.buffer, event.size);
+        n++;
+    }
+    return n;
+}
+
+#endif
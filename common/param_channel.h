@@ -0,0 +1,50 @@
+#pragma once
+#ifndef COMMON_PARAM_CHANNEL_H
+#define COMMON_PARAM_CHANNEL_H
+#include <stddef.h>
+#include <atomic>
+
+/** Lock-free single producer / single consumer queue of parameter
+changes, from a control thread into the process callback. A full queue
+drops the change and reports it; the control side may retry. */
+template <size_t N>
+class ParamChannel
+{
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+    struct Change
+    {
+        int   index;
+        float value;
+    };
+
+    /** control thread */
+    bool Push(int index, float value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if(head - tail_.load(std::memory_order_acquire) >= N)
+            return false;
+        changes_[head & (N - 1)] = {index, value};
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** process callback: hands every pending change to apply(index, value) */
+    template <typename F>
+    inline void Drain(F&& apply)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        for(; tail != head; tail++)
+            apply(changes_[tail & (N - 1)].index, changes_[tail & (N - 1)].value);
+        tail_.store(tail, std::memory_order_release);
+    }
+
+  private:
+    Change              changes_[N];
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+#endif
@@ -0,0 +1,657 @@
+/* RT safety checker (JACKAPPS_RT_CHECK builds)
+ *
+ * Linked into every target ahead of libc, this library interposes the
+ * calls that have no business in a JACK process callback: the allocator,
+ * mutexes and condition variables, sleeps, stdio and file I/O, mmap and
+ * thread creation. jack_set_process_callback() is wrapped so the process
+ * thread is marked real time for the length of each callback; other
+ * threads opt in through rt_check_enter() / rt_check_leave()
+ * (RT_CHECK_SCOPE() in rt_check.h).
+ *
+ * A call from a marked thread is counted per function and per call site
+ * (its backtrace), and the sites are listed at exit, most frequent
+ * first. Recording itself neither allocates nor blocks apart from a
+ * spinlock between RT threads, but backtrace() is slow: expect xruns
+ * while violations are happening. RT_CHECK_ABORT=1 in the environment
+ * aborts on the first one instead, for a core dump or a debugger.
+ *
+ * sem_post() is left alone: it is the wakeup the RT code here relies on
+ * (the convolver's tail worker) and it never blocks.
+ *
+ * Internal clients are not covered: jackd's own symbols win over a
+ * module's, so loading one into jackd does not interpose anything.
+ */
+#undef _FORTIFY_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <jack/jack.h>
+
+enum
+{
+    F_MALLOC,
+    F_CALLOC,
+    F_REALLOC,
+    F_FREE,
+    F_POSIX_MEMALIGN,
+    F_ALIGNED_ALLOC,
+    F_MUTEX_LOCK,
+    F_MUTEX_TRYLOCK,
+    F_MUTEX_UNLOCK,
+    F_COND_SIGNAL,
+    F_COND_BROADCAST,
+    F_COND_WAIT,
+    F_COND_TIMEDWAIT,
+    F_SEM_WAIT,
+    F_USLEEP,
+    F_NANOSLEEP,
+    F_SLEEP,
+    F_WRITE,
+    F_READ,
+    F_OPEN,
+    F_CLOSE,
+    F_FWRITE,
+    F_FPUTS,
+    F_PUTS,
+    F_FFLUSH,
+    F_PRINTF,
+    F_FPRINTF,
+    F_MMAP,
+    F_MUNMAP,
+    F_PTHREAD_CREATE,
+    F_COUNT
+};
+
+static const char* const fn_names[F_COUNT] = {
+    "malloc",         "calloc",           "realloc",        "free",
+    "posix_memalign", "aligned_alloc",    "pthread_mutex_lock",
+    "pthread_mutex_trylock", "pthread_mutex_unlock", "pthread_cond_signal",
+    "pthread_cond_broadcast", "pthread_cond_wait", "pthread_cond_timedwait",
+    "sem_wait",       "usleep",           "nanosleep",      "sleep",
+    "write",          "read",             "open",           "close",
+    "fwrite",         "fputs",            "puts",           "fflush",
+    "printf",         "fprintf",          "mmap",           "munmap",
+    "pthread_create",
+};
+
+/* the real functions, resolved once */
+static void* (*real_malloc)(size_t);
+static void* (*real_calloc)(size_t, size_t);
+static void* (*real_realloc)(void*, size_t);
+static void (*real_free)(void*);
+static int (*real_posix_memalign)(void**, size_t, size_t);
+static void* (*real_aligned_alloc)(size_t, size_t);
+static int (*real_mutex_lock)(pthread_mutex_t*);
+static int (*real_mutex_trylock)(pthread_mutex_t*);
+static int (*real_mutex_unlock)(pthread_mutex_t*);
+static int (*real_cond_signal)(pthread_cond_t*);
+static int (*real_cond_broadcast)(pthread_cond_t*);
+static int (*real_cond_wait)(pthread_cond_t*, pthread_mutex_t*);
+static int (*real_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+static int (*real_sem_wait)(sem_t*);
+static int (*real_usleep)(useconds_t);
+static int (*real_nanosleep)(const struct timespec*, struct timespec*);
+static unsigned (*real_sleep)(unsigned);
+static ssize_t (*real_write)(int, const void*, size_t);
+static ssize_t (*real_read)(int, void*, size_t);
+static int (*real_open)(const char*, int, ...);
+static int (*real_close)(int);
+static size_t (*real_fwrite)(const void*, size_t, size_t, FILE*);
+static int (*real_fputs)(const char*, FILE*);
+static int (*real_puts)(const char*);
+static int (*real_fflush)(FILE*);
+static int (*real_vfprintf)(FILE*, const char*, va_list);
+static void* (*real_mmap)(void*, size_t, int, int, int, off_t);
+static int (*real_munmap)(void*, size_t);
+static int (*real_pthread_create)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+static int (*real_set_process_callback)(jack_client_t*, JackProcessCallback, void*);
+
+/* depth of real-time scopes on this thread, and whether the checker
+ * itself is running on it (its own calls are not violations) */
+static __thread int rt_depth __attribute__((tls_model("initial-exec")));
+static __thread int in_hook __attribute__((tls_model("initial-exec")));
+
+/* dlsym() may allocate before the allocator is resolved */
+static char bootstrap[8192];
+static size_t bootstrap_used;
+static int resolving;
+static int resolved;
+
+enum
+{
+    kDepth = 16, /* frames kept per call site */
+    kSkip = 2,   /* record() and the hook itself */
+    kSites = 512,
+};
+
+typedef struct
+{
+    uint64_t hash;
+    int fn;
+    int depth;
+    unsigned long count;
+    void* frames[kDepth];
+} Site;
+
+static Site sites[kSites];
+static unsigned long fn_counts[F_COUNT];
+static unsigned long lost_sites;
+static unsigned long cycles;
+static int site_lock;
+static int abort_on_first;
+
+#define RESOLVE(var, name) var = (__typeof__(var))dlsym(RTLD_NEXT, name)
+
+static void resolve(void)
+{
+    if(resolved || resolving)
+        return;
+    resolving = 1;
+    RESOLVE(real_malloc, "malloc");
+    RESOLVE(real_calloc, "calloc");
+    RESOLVE(real_realloc, "realloc");
+    RESOLVE(real_free, "free");
+    RESOLVE(real_posix_memalign, "posix_memalign");
+    RESOLVE(real_aligned_alloc, "aligned_alloc");
+    RESOLVE(real_mutex_lock, "pthread_mutex_lock");
+    RESOLVE(real_mutex_trylock, "pthread_mutex_trylock");
+    RESOLVE(real_mutex_unlock, "pthread_mutex_unlock");
+    RESOLVE(real_cond_signal, "pthread_cond_signal");
+    RESOLVE(real_cond_broadcast, "pthread_cond_broadcast");
+    RESOLVE(real_cond_wait, "pthread_cond_wait");
+    RESOLVE(real_cond_timedwait, "pthread_cond_timedwait");
+    RESOLVE(real_sem_wait, "sem_wait");
+    RESOLVE(real_usleep, "usleep");
+    RESOLVE(real_nanosleep, "nanosleep");
+    RESOLVE(real_sleep, "sleep");
+    RESOLVE(real_write, "write");
+    RESOLVE(real_read, "read");
+    RESOLVE(real_open, "open");
+    RESOLVE(real_close, "close");
+    RESOLVE(real_fwrite, "fwrite");
+    RESOLVE(real_fputs, "fputs");
+    RESOLVE(real_puts, "puts");
+    RESOLVE(real_fflush, "fflush");
+    RESOLVE(real_vfprintf, "vfprintf");
+    RESOLVE(real_mmap, "mmap");
+    RESOLVE(real_munmap, "munmap");
+    RESOLVE(real_pthread_create, "pthread_create");
+    RESOLVE(real_set_process_callback, "jack_set_process_callback");
+    resolving = 0;
+    resolved = 1;
+}
+
+static void* bootstrap_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if(bootstrap_used + size > sizeof(bootstrap))
+        return NULL;
+    void* p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int from_bootstrap(const void* p)
+{
+    return (const char*)p >= bootstrap && (const char*)p < bootstrap + sizeof(bootstrap);
+}
+
+static void spin_lock(void)
+{
+    while(__atomic_exchange_n(&site_lock, 1, __ATOMIC_ACQUIRE))
+        while(__atomic_load_n(&site_lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static void spin_unlock(void)
+{
+    __atomic_store_n(&site_lock, 0, __ATOMIC_RELEASE);
+}
+
+static __attribute__((noinline)) void record(int fn)
+{
+    in_hook = 1;
+    void* frames[kDepth + kSkip];
+    int depth = backtrace(frames, kDepth + kSkip) - kSkip;
+    if(depth < 0)
+        depth = 0;
+
+    uint64_t hash = 1469598103934665603ull ^ (uint64_t)fn;
+    for(int i = 0; i < depth; i++)
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[kSkip + i]) * 1099511628211ull;
+
+    __atomic_fetch_add(&fn_counts[fn], 1, __ATOMIC_RELAXED);
+
+    spin_lock();
+    size_t s = hash % kSites;
+    int found = 0;
+    for(int probe = 0; probe < kSites; probe++, s = (s + 1) % kSites)
+    {
+        if(sites[s].count == 0)
+        {
+            sites[s].hash = hash;
+            sites[s].fn = fn;
+            sites[s].depth = depth;
+            memcpy(sites[s].frames, frames + kSkip, sizeof(void*) * (size_t)depth);
+        }
+        if(sites[s].hash == hash && sites[s].fn == fn)
+        {
+            sites[s].count++;
+            found = 1;
+            break;
+        }
+    }
+    if(!found)
+        lost_sites++;
+    spin_unlock();
+
+    if(abort_on_first)
+    {
+        static const char msg[] = "rt_check: RT-unsafe call from a real-time thread: ";
+        real_write(2, msg, sizeof(msg) - 1);
+        real_write(2, fn_names[fn], strlen(fn_names[fn]));
+        real_write(2, "\n", 1);
+        backtrace_symbols_fd(frames + kSkip, depth, 2);
+        abort();
+    }
+    in_hook = 0;
+}
+
+#define CHECK(fn)                           \
+    do                                      \
+    {                                       \
+        if(rt_depth > 0 && !in_hook)        \
+            record(fn);                     \
+    } while(0)
+
+void rt_check_enter(void)
+{
+    rt_depth++;
+}
+
+void rt_check_leave(void)
+{
+    rt_depth--;
+}
+
+/* ---- process callback wrapping ---- */
+
+typedef struct
+{
+    JackProcessCallback callback;
+    void* arg;
+} Wrapped;
+
+static Wrapped wrapped[64];
+static int nwrapped;
+
+static int process_trampoline(jack_nframes_t nframes, void* arg)
+{
+    Wrapped* w = (Wrapped*)arg;
+    __atomic_fetch_add(&cycles, 1, __ATOMIC_RELAXED);
+    rt_depth++;
+    int ret = w->callback(nframes, w->arg);
+    rt_depth--;
+    return ret;
+}
+
+int jack_set_process_callback(jack_client_t* client, JackProcessCallback callback, void* arg)
+{
+    resolve();
+    int slot = __atomic_fetch_add(&nwrapped, 1, __ATOMIC_RELAXED);
+    if(slot >= (int)(sizeof(wrapped) / sizeof(wrapped[0])) || !callback)
+        return real_set_process_callback(client, callback, arg);
+    wrapped[slot].callback = callback;
+    wrapped[slot].arg = arg;
+    return real_set_process_callback(client, process_trampoline, &wrapped[slot]);
+}
+
+/* ---- allocator ---- */
+
+void* malloc(size_t size)
+{
+    if(!real_malloc)
+    {
+        if(resolving)
+            return bootstrap_alloc(size);
+        resolve();
+    }
+    CHECK(F_MALLOC);
+    return real_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    if(!real_calloc)
+    {
+        /* bootstrap memory is static, so already zeroed */
+        if(resolving)
+            return bootstrap_alloc(n * size);
+        resolve();
+    }
+    CHECK(F_CALLOC);
+    return real_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    if(!real_realloc)
+        resolve();
+    CHECK(F_REALLOC);
+    if(from_bootstrap(p))
+    {
+        void* q = real_malloc(size);
+        size_t have = (size_t)(bootstrap + sizeof(bootstrap) - (char*)p);
+        if(q)
+            memcpy(q, p, size < have ? size : have);
+        return q;
+    }
+    return real_realloc(p, size);
+}
+
+void free(void* p)
+{
+    if(!p || from_bootstrap(p))
+        return;
+    if(!real_free)
+        resolve();
+    CHECK(F_FREE);
+    real_free(p);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size)
+{
+    resolve();
+    CHECK(F_POSIX_MEMALIGN);
+    return real_posix_memalign(p, alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    resolve();
+    CHECK(F_ALIGNED_ALLOC);
+    return real_aligned_alloc(alignment, size);
+}
+
+/* ---- locks ---- */
+
+int pthread_mutex_lock(pthread_mutex_t* m)
+{
+    resolve();
+    CHECK(F_MUTEX_LOCK);
+    return real_mutex_lock(m);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m)
+{
+    resolve();
+    CHECK(F_MUTEX_TRYLOCK);
+    return real_mutex_trylock(m);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* m)
+{
+    resolve();
+    CHECK(F_MUTEX_UNLOCK);
+    return real_mutex_unlock(m);
+}
+
+int pthread_cond_signal(pthread_cond_t* c)
+{
+    resolve();
+    CHECK(F_COND_SIGNAL);
+    return real_cond_signal(c);
+}
+
+int pthread_cond_broadcast(pthread_cond_t* c)
+{
+    resolve();
+    CHECK(F_COND_BROADCAST);
+    return real_cond_broadcast(c);
+}
+
+int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+    resolve();
+    CHECK(F_COND_WAIT);
+    return real_cond_wait(c, m);
+}
+
+int pthread_cond_timedwait(pthread_cond_t* c, pthread_mutex_t* m, const struct timespec* t)
+{
+    resolve();
+    CHECK(F_COND_TIMEDWAIT);
+    return real_cond_timedwait(c, m, t);
+}
+
+int sem_wait(sem_t* s)
+{
+    resolve();
+    CHECK(F_SEM_WAIT);
+    return real_sem_wait(s);
+}
+
+/* ---- sleeps ---- */
+
+int usleep(useconds_t us)
+{
+    resolve();
+    CHECK(F_USLEEP);
+    return real_usleep(us);
+}
+
+int nanosleep(const struct timespec* t, struct timespec* rem)
+{
+    resolve();
+    CHECK(F_NANOSLEEP);
+    return real_nanosleep(t, rem);
+}
+
+unsigned sleep(unsigned s)
+{
+    resolve();
+    CHECK(F_SLEEP);
+    return real_sleep(s);
+}
+
+/* ---- file and console I/O ---- */
+
+ssize_t write(int fd, const void* buf, size_t n)
+{
+    resolve();
+    CHECK(F_WRITE);
+    return real_write(fd, buf, n);
+}
+
+ssize_t read(int fd, void* buf, size_t n)
+{
+    resolve();
+    CHECK(F_READ);
+    return real_read(fd, buf, n);
+}
+
+int open(const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+    if(flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = (mode_t)va_arg(ap, int);
+        va_end(ap);
+    }
+    resolve();
+    CHECK(F_OPEN);
+    return real_open(path, flags, mode);
+}
+
+int close(int fd)
+{
+    resolve();
+    CHECK(F_CLOSE);
+    return real_close(fd);
+}
+
+size_t fwrite(const void* p, size_t size, size_t n, FILE* f)
+{
+    resolve();
+    CHECK(F_FWRITE);
+    return real_fwrite(p, size, n, f);
+}
+
+int fputs(const char* s, FILE* f)
+{
+    resolve();
+    CHECK(F_FPUTS);
+    return real_fputs(s, f);
+}
+
+int puts(const char* s)
+{
+    resolve();
+    CHECK(F_PUTS);
+    return real_puts(s);
+}
+
+int fflush(FILE* f)
+{
+    resolve();
+    CHECK(F_FFLUSH);
+    return real_fflush(f);
+}
+
+int printf(const char* fmt, ...)
+{
+    resolve();
+    CHECK(F_PRINTF);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = real_vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int fprintf(FILE* f, const char* fmt, ...)
+{
+    resolve();
+    CHECK(F_FPRINTF);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = real_vfprintf(f, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* what printf and fprintf become in _FORTIFY_SOURCE builds */
+int __printf_chk(int flag, const char* fmt, ...)
+{
+    (void)flag;
+    resolve();
+    CHECK(F_PRINTF);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = real_vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+int __fprintf_chk(FILE* f, int flag, const char* fmt, ...)
+{
+    (void)flag;
+    resolve();
+    CHECK(F_FPRINTF);
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = real_vfprintf(f, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* ---- memory mapping and threads ---- */
+
+void* mmap(void* addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+    resolve();
+    CHECK(F_MMAP);
+    return real_mmap(addr, len, prot, flags, fd, off);
+}
+
+int munmap(void* addr, size_t len)
+{
+    resolve();
+    CHECK(F_MUNMAP);
+    return real_munmap(addr, len);
+}
+
+int pthread_create(pthread_t* t, const pthread_attr_t* attr, void* (*fn)(void*), void* arg)
+{
+    resolve();
+    CHECK(F_PTHREAD_CREATE);
+    return real_pthread_create(t, attr, fn, arg);
+}
+
+/* ---- setup and report ---- */
+
+static __attribute__((constructor)) void rt_check_init(void)
+{
+    resolve();
+    const char* env = getenv("RT_CHECK_ABORT");
+    abort_on_first = env && env[0] == '1';
+    /* the first backtrace() loads libgcc; do it now, not on the RT thread */
+    void* frames[2];
+    in_hook = 1;
+    backtrace(frames, 2);
+    in_hook = 0;
+}
+
+static __attribute__((destructor)) void rt_check_report(void)
+{
+    in_hook = 1;
+    unsigned long total = 0;
+    for(int f = 0; f < F_COUNT; f++)
+        total += fn_counts[f];
+
+    if(total == 0)
+    {
+        fprintf(stderr, "rt_check: no RT-unsafe calls in %lu process cycles\n", cycles);
+        return;
+    }
+
+    fprintf(stderr, "rt_check: %lu RT-unsafe calls in %lu process cycles\n", total, cycles);
+    for(int f = 0; f < F_COUNT; f++)
+        if(fn_counts[f])
+            fprintf(stderr, "  %-24s %lu\n", fn_names[f], fn_counts[f]);
+    fflush(stderr);
+
+    /* call sites, most frequent first; +0x offsets (static functions)
+     * resolve with addr2line -f -e <binary> <offset> */
+    for(;;)
+    {
+        int best = -1;
+        for(int s = 0; s < kSites; s++)
+            if(sites[s].count && (best < 0 || sites[s].count > sites[best].count))
+                best = s;
+        if(best < 0)
+            break;
+        fprintf(stderr, "\n%lu x %s from:\n", sites[best].count, fn_names[sites[best].fn]);
+        fflush(stderr);
+        backtrace_symbols_fd(sites[best].frames, sites[best].depth, 2);
+        sites[best].count = 0;
+    }
+    if(lost_sites)
+        fprintf(stderr, "\n(%lu calls from sites past the first %d not itemised)\n", lost_sites,
+                (int)kSites);
+}
@@ -0,0 +1,35 @@
+#pragma once
+#ifndef COMMON_RT_CHECK_H
+#define COMMON_RT_CHECK_H
+
+/** Marks code as real time for the RT safety checker
+
+Configuring with -DJACKAPPS_RT_CHECK=ON links every target against
+librt_check (common/rt_check.c). It wraps the callback handed to
+jack_set_process_callback() and, while one runs, records every call to
+malloc and friends, mutexes and condition variables, sleeps, stdio and
+file I/O with its backtrace; a summary is printed at exit.
+
+Threads JACK does not know about but that run a callback's work (the
+RtPool workers) mark themselves with RT_CHECK_SCOPE(). In normal builds
+it expands to nothing.
+*/
+#ifdef JACKAPPS_RT_CHECK
+extern "C" void rt_check_enter(void);
+extern "C" void rt_check_leave(void);
+
+struct RtCheckScope
+{
+    RtCheckScope() { rt_check_enter(); }
+    ~RtCheckScope() { rt_check_leave(); }
+};
+
+#define RT_CHECK_SCOPE() RtCheckScope rt_check_scope_
+#else
+#define RT_CHECK_SCOPE() \
+    do                   \
+    {                    \
+    } while(0)
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+#pragma once
+#ifndef COMMON_RT_POOL_H
+#define COMMON_RT_POOL_H
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "rt_check.h"
+
+/** Fork-join worker pool for use inside one process callback
+
+Run() hands out ntasks task indices to the calling thread and the
+workers, then spins until all of them are finished, so it returns with
+every task done in the same cycle. Workers are SCHED_FIFO threads pinned
+to their own core (falling back to normal threads when RT scheduling is
+not permitted). Between jobs a worker spins for a short while, so
+back-to-back jobs within a cycle cost no syscall, then sleeps on a futex
+until the next Run().
+
+Tasks are claimed with a CAS on one 64 bit ticket holding the job's
+generation, task count and next index, so a worker that wakes late can
+never claim a task of a newer job, and the completion count is the only
+barrier. Run() itself never blocks or allocates; it must only be called
+from one thread at a time.
+*/
+class RtPool
+{
+  public:
+    typedef void (*TaskFn)(void* ctx, size_t task);
+
+    ~RtPool() { Stop(); }
+
+    /** starts workers (0 means serial), at most one per core besides the
+        caller's; returns how many got SCHED_FIFO */
+    size_t Start(size_t workers, int rt_priority, unsigned spin_iterations = 20000)
+    {
+        Stop();
+        spin_ = spin_iterations;
+        running_.store(true);
+        size_t realtime = 0;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if(cpus >= 1 && workers > size_t(cpus - 1))
+            workers = size_t(cpus - 1);
+        for(size_t w = 0; w < workers; w++)
+        {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            sched_param param;
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = rt_priority;
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            pthread_attr_setschedparam(&attr, &param);
+            if(cpus > 1)
+            {
+                // leave the first core to the JACK thread and the rest of the system
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(int(1 + w % size_t(cpus - 1)), &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+            }
+
+            pthread_t thread;
+            if(pthread_create(&thread, &attr, Worker, this) == 0)
+                realtime++;
+            else if(pthread_create(&thread, nullptr, Worker, this) != 0)
+            {
+                pthread_attr_destroy(&attr);
+                break;
+            }
+            pthread_attr_destroy(&attr);
+            threads_.push_back(thread);
+        }
+        return realtime;
+    }
+
+    void Stop()
+    {
+        if(threads_.empty())
+            return;
+        running_.store(false);
+        wake_.fetch_add(1);
+        Wake();
+        for(pthread_t t : threads_)
+            pthread_join(t, nullptr);
+        threads_.clear();
+    }
+
+    size_t Workers() const { return threads_.size(); }
+
+    /** fn(ctx, i) for every i in [0, ntasks); returns when all are done */
+    void Run(size_t ntasks, TaskFn fn, void* ctx)
+    {
+        if(threads_.empty() || ntasks < 2)
+        {
+            for(size_t i = 0; i < ntasks; i++)
+                fn(ctx, i);
+            return;
+        }
+
+        uint32_t gen = (wake_.load(std::memory_order_relaxed) + 1) & kGenMask;
+        fn_ = fn;
+        ctx_ = ctx;
+        done_.store(0, std::memory_order_relaxed);
+        ticket_.store(MakeTicket(gen, ntasks, 0), std::memory_order_release);
+        wake_.store(gen);
+        if(sleepers_.load() > 0)
+            Wake();
+
+        Work(gen);
+        // a worker holding a task may have been preempted; after a while
+        // let it have the core instead of spinning against it
+        unsigned spins = 0;
+        while(done_.load(std::memory_order_acquire) < ntasks)
+        {
+            if(spins++ < spin_)
+                Relax();
+            else
+                sched_yield();
+        }
+    }
+
+  private:
+    static constexpr uint32_t kGenMask = (1u << 24) - 1;
+    static constexpr uint64_t kField = (1u << 20) - 1;
+
+    static uint64_t MakeTicket(uint32_t gen, size_t ntasks, size_t next)
+    {
+        return (uint64_t(gen) << 40) | (uint64_t(ntasks & kField) << 20) | (next & kField);
+    }
+
+    static inline void Relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    void Wake()
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&wake_), FUTEX_WAKE_PRIVATE, INT_MAX,
+                nullptr, nullptr, 0);
+    }
+
+    /** claims and runs tasks of generation gen until none are left */
+    inline void Work(uint32_t gen)
+    {
+        uint64_t t = ticket_.load(std::memory_order_acquire);
+        for(;;)
+        {
+            size_t next = size_t(t & kField);
+            if(uint32_t(t >> 40) != gen || next >= ((t >> 20) & kField))
+                return;
+            if(ticket_.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel))
+            {
+                // the job cannot change until this task is counted done
+                fn_(ctx_, next);
+                done_.fetch_add(1, std::memory_order_release);
+                t = ticket_.load(std::memory_order_acquire);
+            }
+        }
+    }
+
+    static void* Worker(void* arg)
+    {
+        RtPool* self = static_cast<RtPool*>(arg);
+        uint32_t last = self->wake_.load();
+        while(self->running_.load(std::memory_order_relaxed))
+        {
+            unsigned spins = 0;
+            while(self->wake_.load(std::memory_order_acquire) == last && spins++ < self->spin_)
+                Relax();
+            if(self->wake_.load() == last)
+            {
+                self->sleepers_.fetch_add(1);
+                while(self->wake_.load() == last && self->running_.load())
+                    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&self->wake_), FUTEX_WAIT_PRIVATE,
+                            last, nullptr, nullptr, 0);
+                self->sleepers_.fetch_sub(1);
+            }
+            last = self->wake_.load(std::memory_order_acquire);
+            // the callback's work, under the same rules as the callback
+            RT_CHECK_SCOPE();
+            self->Work(last & kGenMask);
+        }
+        return nullptr;
+    }
+
+    std::vector<pthread_t> threads_;
+    unsigned spin_ = 20000;
+    std::atomic<bool> running_{false};
+
+    TaskFn fn_ = nullptr;
+    void* ctx_ = nullptr;
+    alignas(64) std::atomic<uint64_t> ticket_{0};
+    alignas(64) std::atomic<size_t> done_{0};
+    alignas(64) std::atomic<uint32_t> wake_{0};
+    std::atomic<int> sleepers_{0};
+};
+
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef COMMON_SIMD4_H
+#define COMMON_SIMD4_H
+#include <stdint.h>
+
+/** Four lane vectors with GCC vector extensions (NEON on the Pi, SSE on
+x86), shared by the oscillator banks and the grain engine. Comparisons
+give all-ones lanes, so they work as masks and in ?: selects.
+*/
+namespace simd
+{
+typedef float f32x4 __attribute__((vector_size(16)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+inline float HSum(f32x4 v)
+{
+    return (v[0] + v[1]) + (v[2] + v[3]);
+}
+} // namespace simd
+
+#endif
@@ -0,0 +1,291 @@
+#pragma once
+#ifndef COMMON_SNAPSHOT_H
+#define COMMON_SNAPSHOT_H
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "dsp_node.h"
+
+/** Hands one consistent moment of process-thread state to another thread
+
+The other thread calls Request(), which waits until the process thread
+next calls Poll() at the top of a cycle and runs the capture there. The
+capture should copy only small things (head positions, filter states);
+bulk buffers are copied afterwards by the requesting thread.
+*/
+class StateCapture
+{
+  public:
+    /** process thread, once per cycle */
+    template <typename Capture>
+    inline void Poll(Capture&& capture)
+    {
+        if(state_.load(std::memory_order_acquire) != kRequested)
+            return;
+        capture();
+        state_.store(kDone, std::memory_order_release);
+    }
+
+    /** false if no cycle ran within timeout_ms */
+    bool Request(int timeout_ms)
+    {
+        state_.store(kRequested, std::memory_order_release);
+        for(int waited = 0; waited < timeout_ms; waited++)
+        {
+            if(state_.load(std::memory_order_acquire) == kDone)
+            {
+                state_.store(kIdle);
+                return true;
+            }
+            usleep(1000);
+        }
+        // withdraw, unless the process thread got there just now
+        int expected = kRequested;
+        if(state_.compare_exchange_strong(expected, kIdle))
+            return false;
+        state_.store(kIdle);
+        return true;
+    }
+
+  private:
+    enum { kIdle, kRequested, kDone };
+    std::atomic<int> state_{kIdle};
+};
+
+/** Periodic warm-start snapshots of a DspNode's state in an mmap'd file
+
+The file holds a header page and two slots of StateBytes() each. A save
+first marks the older slot invalid, fills it through SaveState(), syncs
+it, and only then stamps it with the next generation. A crash or power
+cut during a save therefore leaves the other slot intact. Open() loads
+the newest complete slot whose size, sample rate and tag match, so a
+restarted client carries on with the delay tails it had.
+
+Saves run on a background thread every interval seconds. A file on
+tmpfs (/dev/shm) survives client crashes and restarts without wearing
+the SD card; a file on disk also survives reboots.
+*/
+class Snapshotter
+{
+  public:
+    ~Snapshotter() { Close(); }
+
+    /** maps path (created or resized as needed) and restores the newest
+        matching snapshot into node, which has had Init(sample_rate);
+        returns false with err set if the file cannot be used */
+    bool Open(const std::string& path,
+              const char*        tag,
+              DspNode*           node,
+              float              sample_rate,
+              bool*              restored,
+              std::string*       err)
+    {
+        Close();
+        *restored = false;
+        node_ = node;
+        payload_ = node->StateBytes();
+        if(payload_ == 0)
+        {
+            *err = "nothing to snapshot";
+            return false;
+        }
+        stride_ = (payload_ + kPage - 1) / kPage * kPage;
+        size_ = kPage + 2 * stride_;
+
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd_ < 0)
+        {
+            *err = path + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        bool fresh = fstat(fd_, &st) != 0 || size_t(st.st_size) != size_;
+        if(fresh && ftruncate(fd_, off_t(size_)) != 0)
+        {
+            *err = path + ": " + strerror(errno);
+            Close();
+            return false;
+        }
+        void* map = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if(map == MAP_FAILED)
+        {
+            *err = path + ": " + strerror(errno);
+            Close();
+            return false;
+        }
+        base_ = static_cast<uint8_t*>(map);
+        header_ = reinterpret_cast<Header*>(base_);
+
+        Header expect;
+        memset(&expect, 0, sizeof(expect));
+        memcpy(expect.magic, kMagic, sizeof(expect.magic));
+        strncpy(expect.tag, tag, sizeof(expect.tag) - 1);
+        expect.payload = payload_;
+        expect.sample_rate = sample_rate;
+
+        bool matches = !fresh && memcmp(header_->magic, expect.magic, sizeof(expect.magic)) == 0
+                       && memcmp(header_->tag, expect.tag, sizeof(expect.tag)) == 0
+                       && header_->payload == payload_ && header_->sample_rate == sample_rate;
+        if(!matches)
+        {
+            // someone else's file, another layout or rate: start over
+            *header_ = expect;
+            msync(base_, kPage, MS_SYNC);
+            return true;
+        }
+
+        int newest = Newest();
+        if(newest >= 0)
+        {
+            node->LoadState(Slot(newest));
+            *restored = true;
+            restored_age_ = time(nullptr) - header_->slots[newest].saved;
+        }
+        return true;
+    }
+
+    /** the node now runs at sample_rate: snapshots of the old rate are
+        dropped, later saves are stamped with the new one */
+    void SetSampleRate(float sample_rate)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(!base_ || header_->sample_rate == sample_rate)
+            return;
+        header_->slots[0].generation = 0;
+        header_->slots[1].generation = 0;
+        header_->sample_rate = sample_rate;
+        msync(base_, kPage, MS_SYNC);
+    }
+
+    /** seconds between the restored snapshot and now */
+    long RestoredAge() const { return long(restored_age_); }
+
+    /** saves every interval seconds until Close() */
+    void Start(double interval_s)
+    {
+        if(!base_ || worker_.joinable())
+            return;
+        running_ = true;
+        worker_ = std::thread([this, interval_s]() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while(running_)
+            {
+                wake_.wait_for(lock, std::chrono::duration<double>(interval_s));
+                if(running_)
+                    Save();
+            }
+        });
+    }
+
+    /** one save now, from the calling thread; false if the node did not
+        deliver its state */
+    bool Save()
+    {
+        if(!base_)
+            return false;
+        int slot = Older();
+        // invalidate first: a torn slot must never look complete
+        header_->slots[slot].generation = 0;
+        msync(base_, kPage, MS_SYNC);
+        if(!node_->SaveState(Slot(slot)))
+            return false;
+        msync(Slot(slot), stride_, MS_SYNC);
+        header_->slots[slot].saved = time(nullptr);
+        header_->slots[slot].generation = ++generation_;
+        msync(base_, kPage, MS_SYNC);
+        return true;
+    }
+
+    /** stops the saver (with a last save if final_save) and unmaps */
+    void Close(bool final_save = false)
+    {
+        if(worker_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                running_ = false;
+            }
+            wake_.notify_all();
+            worker_.join();
+        }
+        if(final_save)
+            Save();
+        if(base_)
+            munmap(base_, size_);
+        if(fd_ >= 0)
+            close(fd_);
+        base_ = nullptr;
+        header_ = nullptr;
+        fd_ = -1;
+    }
+
+  private:
+    static constexpr size_t kPage = 4096;
+    static constexpr char kMagic[8] = {'J', 'A', 'S', 'N', 'A', 'P', '0', '1'};
+
+    struct SlotInfo
+    {
+        uint64_t generation; // 0 while invalid
+        int64_t  saved;      // unix time
+    };
+
+    struct Header
+    {
+        char     magic[8];
+        char     tag[32];
+        uint64_t payload;
+        float    sample_rate;
+        SlotInfo slots[2];
+    };
+
+    uint8_t* Slot(int s) const { return base_ + kPage + size_t(s) * stride_; }
+
+    int Newest()
+    {
+        int newest = -1;
+        for(int s = 0; s < 2; s++)
+        {
+            uint64_t g = header_->slots[s].generation;
+            if(g != 0 && (newest < 0 || g > header_->slots[newest].generation))
+                newest = s;
+            if(g > generation_)
+                generation_ = g;
+        }
+        return newest;
+    }
+
+    int Older()
+    {
+        int newest = Newest();
+        return newest < 0 ? 0 : 1 - newest;
+    }
+
+    DspNode*  node_ = nullptr;
+    size_t    payload_ = 0;
+    size_t    stride_ = 0;
+    size_t    size_ = 0;
+    int       fd_ = -1;
+    uint8_t*  base_ = nullptr;
+    Header*   header_ = nullptr;
+    uint64_t  generation_ = 0;
+    time_t    restored_age_ = 0;
+
+    std::thread             worker_;
+    std::mutex              mutex_;
+    std::condition_variable wake_;
+    bool                    running_ = false;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+#ifndef COMMON_STATE_SWAP_H
+#define COMMON_STATE_SWAP_H
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+
+/** Hands state built on another thread to the process thread
+
+When the sample rate or the period changes, a node builds its new
+delay memory, smoothers and tables on a non-RT thread (typically JACK's
+notification thread, inside the rate or buffer size callback) and
+Publish()es them. The process thread calls Acquire() at the top of each
+cycle: it picks up the new state there, so a cycle never sees half of
+one and half of the other, and it parks the state it replaces in a
+small retire ring instead of freeing it. Reclaim(), again off the RT
+thread, frees whatever has been retired. Nothing here allocates or
+blocks on the process thread.
+
+Publish() and Reclaim() must not run concurrently with each other (one
+builder, or a mutex around both); Acquire() only from the process
+thread.
+*/
+template <typename T>
+class StateSwap
+{
+  public:
+    ~StateSwap()
+    {
+        Reclaim();
+        delete pending_.load();
+        delete current_;
+    }
+
+    /** installs state directly; only while Acquire() cannot run (before
+        the client is activated) */
+    void Reset(std::unique_ptr<T> state)
+    {
+        Reclaim();
+        delete pending_.exchange(nullptr);
+        delete current_;
+        current_ = state.release();
+    }
+
+    /** state for the start of a later cycle; it replaces (and frees)
+        any published state the process thread has not picked up */
+    void Publish(std::unique_ptr<T> state)
+    {
+        Reclaim();
+        delete pending_.exchange(state.release(), std::memory_order_acq_rel);
+    }
+
+    /** frees the states the process thread has swapped out, returns
+        how many */
+    size_t Reclaim()
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t freed = head - tail;
+        for(; tail != head; tail++)
+        {
+            delete retired_[tail % kRetired];
+            retired_[tail % kRetired] = nullptr;
+        }
+        tail_.store(tail, std::memory_order_release);
+        return freed;
+    }
+
+    bool Pending() const { return pending_.load(std::memory_order_acquire) != nullptr; }
+
+    /** process thread, at the top of each cycle: the state to use */
+    inline T* Acquire()
+    {
+        if(pending_.load(std::memory_order_relaxed) != nullptr)
+        {
+            size_t head = head_.load(std::memory_order_relaxed);
+            // with the retire ring full the swap waits for a Reclaim()
+            if(head - tail_.load(std::memory_order_acquire) < kRetired)
+            {
+                T* next = pending_.exchange(nullptr, std::memory_order_acq_rel);
+                if(next)
+                {
+                    retired_[head % kRetired] = current_;
+                    head_.store(head + 1, std::memory_order_release);
+                    current_ = next;
+                }
+            }
+        }
+        return current_;
+    }
+
+    /** the state in use; from other threads only while Acquire() cannot
+        run, or for a pointer the process thread handed over */
+    T* Current() const { return current_; }
+
+  private:
+    static constexpr size_t kRetired = 4;
+
+    T*                  current_ = nullptr; // process thread
+    std::atomic<T*>     pending_{nullptr};
+    T*                  retired_[kRetired] = {};
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+#endif
@@ -0,0 +1,92 @@
+// Cost of the two stage IR convolver against the JACK period budget.
+// The caller's side (head partitions + hand-off) is what the process
+// callback pays; the tail is timed separately, per tail block, as the
+// worker thread's load.
+//
+// usage: convolver_bench [-s seconds of IR] [-t tail block] [-n stereo IR 0/1]
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "convolver.h"
+
+static float noise(uint32_t& x)
+{
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return int32_t(x) * (1.0f / 2147483648.0f);
+}
+
+int main(int argc, char* argv[])
+{
+    double ir_seconds = 3.0;
+    size_t tail = 2048;
+    int stereo = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:n:h")) != -1) {
+        switch (opt) {
+            case 's': ir_seconds = strtod(optarg, nullptr); break;
+            case 't': tail = strtoul(optarg, nullptr, 10); break;
+            case 'n': stereo = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: convolver_bench [-s seconds of IR] [-t tail block] [-n stereo IR 0/1]\n");
+                return 1;
+        }
+    }
+
+    const double sr = 48000.0;
+    size_t length = size_t(ir_seconds * sr);
+    std::vector<float> irL(length), irR(length);
+    uint32_t x = 1234;
+    for (size_t i = 0; i < length; i++) {
+        // decaying noise, like a room
+        float env = expf(-6.9f * float(i) / float(length));
+        irL[i] = noise(x) * env;
+        irR[i] = noise(x) * env;
+    }
+    const float* ir[2] = {irL.data(), irR.data()};
+
+    printf("%.1f s %s IR, tail partition %zu\n", ir_seconds, stereo ? "stereo" : "mono", tail);
+    printf("%8s %12s %12s %10s %14s\n", "period", "mean us", "max us", "% budget", "worker % core");
+
+    const size_t periods[] = {32, 64, 128, 256, 512, 1024};
+    for (size_t period : periods) {
+        if (period > tail)
+            break;
+        std::vector<float> inL(period), inR(period), outL(period), outR(period);
+        for (size_t i = 0; i < period; i++) {
+            inL[i] = noise(x) * 0.25f;
+            inR[i] = noise(x) * 0.25f;
+        }
+
+        // inline tail, so the per-block spikes show where the worker's time goes
+        Convolver conv;
+        conv.Init(ir, stereo ? 2 : 1, length, period, tail, 0, false);
+
+        size_t cycles = std::max<size_t>(64, size_t(2.0 * sr / period));
+        cycles -= cycles % (tail / period);
+        double head = 0.0, worst = 0.0, total = 0.0;
+        for (size_t c = 0; c < cycles; c++) {
+            auto t0 = std::chrono::steady_clock::now();
+            conv.Process(inL.data(), inR.data(), outL.data(), outR.data(), period);
+            double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+            total += us;
+            // cycles that end a tail block also ran the tail inline
+            if ((c + 1) % (tail / period) != 0) {
+                head += us;
+                worst = std::max(worst, us);
+            }
+        }
+        size_t head_cycles = cycles - cycles / (tail / period);
+        double mean = head / double(head_cycles);
+        double budget = 1e6 * period / sr;
+        double worker = (total - head - mean * double(cycles / (tail / period))) / (cycles * budget);
+        printf("%8zu %12.1f %12.1f %9.1f%% %13.1f%%\n", period, mean, worst, 100.0 * mean / budget,
+               100.0 * worker);
+    }
+    return 0;
+}
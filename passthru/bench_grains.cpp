@@ -0,0 +1,104 @@
+// Cost of a full grain cloud against passthru's reverse delay lines, in
+// ns per frame, so the cloud can be priced in "reverse delays".
+//
+// usage: grains_bench [-d grains per second] [-s grain ms] [-f frames per block]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <unistd.h>
+
+#include "delayline_reverse.h"
+#include "grain_engine.h"
+
+static constexpr size_t kRevSize = 48000 * 25;
+typedef daisysp::DelayLineReverse<float, kRevSize> RevLine;
+
+static float noise(uint32_t& x)
+{
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return int32_t(x) * (1.0f / 2147483648.0f);
+}
+
+int main(int argc, char* argv[])
+{
+    float density = 600.0f;
+    float size_ms = 200.0f;
+    size_t block = 128;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:f:h")) != -1) {
+        switch (opt) {
+            case 'd': density = strtof(optarg, nullptr); break;
+            case 's': size_ms = strtof(optarg, nullptr); break;
+            case 'f': block = strtoul(optarg, nullptr, 10); break;
+            default:
+                fprintf(stderr, "usage: grains_bench [-d grains per second] [-s grain ms] [-f frames per block]\n");
+                return 1;
+        }
+    }
+
+    // heap: each line is almost 5 MB
+    std::unique_ptr<RevLine> left(new RevLine), right(new RevLine);
+    left->Init();
+    right->Init();
+    left->SetDelay1(size_t(48000 * 3));
+    right->SetDelay1(size_t(48000 * 3));
+
+    std::vector<float> in(block), outL(block), outR(block);
+    uint32_t x = 99;
+    const size_t frames = 48000 * 10;
+    const size_t blocks = frames / block;
+
+    // one stereo reverse delay: write + crossfaded read per channel
+    auto t0 = std::chrono::steady_clock::now();
+    float sink = 0.0f;
+    for (size_t b = 0; b < blocks; b++) {
+        for (size_t i = 0; i < block; i++)
+            in[i] = noise(x) * 0.25f;
+        for (size_t i = 0; i < block; i++) {
+            sink += left->ReadRev() + right->ReadRev();
+            left->Write(in[i]);
+            right->Write(-in[i]);
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double rev_ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / double(blocks * block);
+
+    std::unique_ptr<GrainEngine<128>> grains(new GrainEngine<128>);
+    grains->Init(48000.0f);
+    grains->SetDensity(density);
+    grains->SetSize(size_ms);
+    grains->SetPitch(0.0f, 7.0f);
+    grains->SetPosition(50.0f, 8000.0f);
+
+    // only the cloud is timed, the lines just keep the buffers moving
+    double grain_ns = 0.0;
+    size_t peak = 0;
+    double active = 0.0;
+    for (size_t b = 0; b < blocks; b++) {
+        for (size_t i = 0; i < block; i++) {
+            left->Write(noise(x) * 0.25f);
+            right->Write(noise(x) * 0.25f);
+            outL[i] = outR[i] = 0.0f;
+        }
+        auto g0 = std::chrono::steady_clock::now();
+        grains->Render(left->Buffer(), right->Buffer(), RevLine::Size(), left->WritePos(),
+                       outL.data(), outR.data(), block);
+        grain_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - g0).count();
+        sink += outL[0];
+        active += double(grains->Active());
+        if (grains->Active() > peak)
+            peak = grains->Active();
+    }
+    grain_ns /= double(blocks * block);
+
+    printf("block %zu, %.0f grains/s of %.0f ms\n", block, density, size_ms);
+    printf("stereo reverse delay: %8.1f ns/frame\n", rev_ns);
+    printf("grain cloud:          %8.1f ns/frame, %.1f grains on average (peak %zu, %zu dropped)\n",
+           grain_ns, active / double(blocks), peak, grains->Dropped());
+    printf("cloud = %.1f reverse delays, %.2f ns per grain-frame%s\n", grain_ns / rev_ns,
+           grain_ns / (active / double(blocks)), sink == 12345.0f ? " " : "");
+    return 0;
+}
@@ -203,6 +203,61 @@ class DelayLineReverse
         return a + (b - a) * frac1_;
     }
 
+    /** the ring buffer, for other readers such as a grain engine
+    */
+    inline const T* Buffer() const { return line_; }
+
+    /** index the next Write() goes to; everything before it is written
+    */
+    inline size_t WritePos() const { return write_ptr_; }
+
+    static constexpr size_t Size() { return max_size; }
+
+    /** head and crossfade state, for snapshots
+    */
+    struct State
+    {
+        size_t write_ptr;
+        size_t read_ptr1;
+        size_t read_ptr2;
+        size_t delay1;
+        size_t head_diff;
+        size_t fadetime;
+        float  frac1;
+        float  fadepos;
+        bool   playinghead;
+        bool   fading;
+    };
+
+    State GetState() const
+    {
+        return State{write_ptr_, read_ptr1_, read_ptr2_, delay1_, headDiff_, fadetime,
+                     frac1_,     fadepos_,   playinghead_, fading_};
+    }
+
+    /** restores the heads, and the buffer too unless buffer is nullptr
+    */
+    void SetState(const State& state, const T* buffer)
+    {
+        write_ptr_   = state.write_ptr % max_size;
+        read_ptr1_   = state.read_ptr1 % max_size;
+        read_ptr2_   = state.read_ptr2 % max_size;
+        delay1_      = state.delay1 > 0 && state.delay1 < max_size ? state.delay1 : max_size - 1;
+        headDiff_    = state.head_diff % delay1_;
+        fadetime     = state.fadetime < delay1_ ? state.fadetime : delay1_ - 1;
+        frac1_       = state.frac1;
+        fadepos_     = state.fadepos;
+        playinghead_ = state.playinghead;
+        fading_      = state.fading;
+        if(buffer)
+        {
+            for(size_t i = 0; i < max_size; i++)
+            {
+                line_[i] = buffer[i];
+            }
+        }
+    }
+
   private:
     float  frac1_;
     size_t write_ptr_;
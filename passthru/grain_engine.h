@@ -0,0 +1,309 @@
+#pragma once
+#ifndef GRAIN_ENGINE_H
+#define GRAIN_ENGINE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "simd4.h"
+
+/** Granular reader over a delay line's ring buffer
+
+DelayLineReverse is in effect two grains crossfaded over one buffer.
+This generalises it to a fixed pool of grains, each with a start index,
+a read offset, a signed rate (negative plays backwards), a window phase
+and a pan. Like VoicePool, all grain state lives in one array per field
+and the active grains are kept packed at the front. Render() walks four
+grains at a time with GCC vector extensions; the window is a
+precomputed Hann table. A grain whose window has run out is culled by
+moving the last active grain into its slot.
+
+The scheduler spawns grains at random intervals around 1 / density,
+sample accurately. Each grain starts a random distance back from the
+write head (position .. position + spread) and is clamped so that it
+never passes the write head or reads past the oldest sample. When the
+pool is full the new grain is dropped (Dropped()). Nothing allocates
+after construction.
+*/
+template <size_t max_grains>
+class GrainEngine
+{
+    static_assert(max_grains % 4 == 0, "grains are processed in groups of 4");
+
+  public:
+    static constexpr size_t kWindowSize = 1024;
+
+    void Init(float sample_rate, uint32_t seed = 0x9e3779b9u)
+    {
+        sample_rate_ = sample_rate;
+        for(size_t i = 0; i < kWindowSize; i++)
+            window_[i] = 0.5f - 0.5f * cosf(2.0f * float(M_PI) * float(i) / float(kWindowSize));
+        // phase 1 and anything past it reads silence
+        window_[kWindowSize] = 0.0f;
+
+        rng_ = seed ? seed : 1;
+        active_ = 0;
+        dropped_ = 0;
+        for(size_t g = 0; g < max_grains; g++)
+            Clear(g);
+        next_ = 0;
+    }
+
+    /** grains per second, 0 stops spawning (running grains finish) */
+    void SetDensity(float per_second) { density_ = per_second > 0.0f ? per_second : 0.0f; }
+    void SetSize(float ms) { size_ms_ = ms < 5.0f ? 5.0f : ms; }
+    /** transposition in semitones, plus a random +-jitter per grain */
+    void SetPitch(float semitones, float jitter = 0.0f)
+    {
+        pitch_ = semitones;
+        jitter_ = jitter;
+    }
+    /** probability of a grain playing backwards */
+    void SetReverse(float probability) { reverse_ = probability; }
+    /** grains start position .. position + spread ms behind the write head */
+    void SetPosition(float ms, float spread_ms)
+    {
+        position_ms_ = ms;
+        spread_ms_ = spread_ms;
+    }
+    /** 0 keeps grains centred, 1 pans them anywhere */
+    void SetStereo(float width) { width_ = width; }
+    /** output gain; like the other settings it applies to new grains,
+        so changes fade in over a grain length */
+    void SetLevel(float level) { level_ = level; }
+
+    size_t Active() const { return active_; }
+    size_t Dropped() const { return dropped_; }
+
+    /** adds grains to out[0..nframes). The buffers are rings of size
+        samples that were written one sample per frame over this block,
+        so write_pos is the write index after the block. */
+    void Render(const float* bufL,
+                const float* bufR,
+                size_t       size,
+                size_t       write_pos,
+                float*       outL,
+                float*       outR,
+                size_t       nframes)
+    {
+        size_t done = 0;
+        while(done < nframes)
+        {
+            if(next_ == 0)
+            {
+                // the write head as it was at this frame
+                Spawn((write_pos + size - (nframes - done) % size) % size, size, nframes - done);
+                next_ = NextInterval();
+                continue;
+            }
+            size_t n = nframes - done;
+            if(n > kChunk)
+                n = kChunk;
+            if(n > next_)
+                n = next_;
+            RenderChunk(bufL, bufR, int32_t(size), outL + done, outR + done, n);
+            next_ -= n;
+            done += n;
+        }
+        Cull();
+    }
+
+  private:
+    static constexpr size_t kChunk = 256;
+    static constexpr size_t kNever = ~size_t(0);
+
+    float Uniform()
+    {
+        rng_ ^= rng_ << 13;
+        rng_ ^= rng_ >> 17;
+        rng_ ^= rng_ << 5;
+        return float(rng_ >> 8) * (1.0f / 16777216.0f);
+    }
+
+    size_t NextInterval()
+    {
+        if(density_ <= 0.0f)
+            return kNever;
+        // +-50% around the mean keeps the cloud from pulsing
+        float interval = sample_rate_ / density_ * (0.5f + Uniform());
+        return interval < 1.0f ? 1 : size_t(interval);
+    }
+
+    void Spawn(size_t write_pos, size_t size, size_t ahead)
+    {
+        if(density_ <= 0.0f)
+            return;
+        if(active_ == max_grains)
+        {
+            dropped_++;
+            return;
+        }
+
+        float length = size_ms_ * 0.001f * sample_rate_ * (0.8f + 0.4f * Uniform());
+        float rate = exp2f((pitch_ + jitter_ * (2.0f * Uniform() - 1.0f)) * (1.0f / 12.0f));
+        if(Uniform() < reverse_)
+            rate = -rate;
+
+        // the distance to the write head changes by (1 - rate) per frame,
+        // so checking both ends of the grain keeps all of it inside the
+        // written part of the ring; ahead frames of this block are still
+        // to be written after the spawn frame
+        float drift = length * (1.0f - rate);
+        float lo = 4.0f + (drift < 0.0f ? -drift : 0.0f);
+        float hi = float(size) - float(ahead) - 4.0f - (drift > 0.0f ? drift : 0.0f);
+        if(hi < lo)
+        {
+            dropped_++;
+            return;
+        }
+        float delay = (position_ms_ + spread_ms_ * Uniform()) * 0.001f * sample_rate_;
+        delay = delay < lo ? lo : (delay > hi ? hi : delay);
+
+        // equal power pan
+        float pan = (1.0f + width_ * (2.0f * Uniform() - 1.0f)) * float(M_PI) * 0.25f;
+        // overlapping grains add up; keep the cloud's level near one grain's
+        float overlap = density_ * length / sample_rate_;
+        float gain = (overlap > 1.0f ? 1.0f / sqrtf(overlap) : 1.0f) * level_;
+
+        size_t g = active_++;
+        start_[g] = int32_t((write_pos + size - size_t(delay)) % size);
+        offset_[g] = 0.0f;
+        rate_[g] = rate;
+        phase_[g] = 0.0f;
+        phase_inc_[g] = 1.0f / length;
+        gain_l_[g] = cosf(pan) * gain;
+        gain_r_[g] = sinf(pan) * gain;
+    }
+
+    /** n frames of every active grain, four at a time */
+    void RenderChunk(const float* bufL, const float* bufR, int32_t size, float* outL, float* outR, size_t n)
+    {
+        using simd::f32x4;
+        using simd::i32x4;
+        f32x4 accL[kChunk];
+        f32x4 accR[kChunk];
+        for(size_t i = 0; i < n; i++)
+        {
+            accL[i] = f32x4{0.0f, 0.0f, 0.0f, 0.0f};
+            accR[i] = f32x4{0.0f, 0.0f, 0.0f, 0.0f};
+        }
+
+        const i32x4 sizev = {size, size, size, size};
+        const f32x4 last = {float(kWindowSize), float(kWindowSize), float(kWindowSize), float(kWindowSize)};
+        size_t groups = (active_ + 3) / 4;
+        for(size_t g = 0; g < groups; g++)
+        {
+            const size_t base = g * 4;
+            i32x4 start;
+            f32x4 offset, rate, phase, phase_inc, gl, gr;
+            memcpy(&start, &start_[base], sizeof(start));
+            memcpy(&offset, &offset_[base], sizeof(offset));
+            memcpy(&rate, &rate_[base], sizeof(rate));
+            memcpy(&phase, &phase_[base], sizeof(phase));
+            memcpy(&phase_inc, &phase_inc_[base], sizeof(phase_inc));
+            memcpy(&gl, &gain_l_[base], sizeof(gl));
+            memcpy(&gr, &gain_r_[base], sizeof(gr));
+
+            for(size_t i = 0; i < n; i++)
+            {
+                // floor, also for the negative offsets of backward grains
+                i32x4 whole = __builtin_convertvector(offset, i32x4);
+                whole += (offset < __builtin_convertvector(whole, f32x4));
+                f32x4 frac = offset - __builtin_convertvector(whole, f32x4);
+
+                i32x4 a = start + whole;
+                a += (a < 0) & sizev;
+                a -= (a >= sizev) & sizev;
+                i32x4 b = a + 1;
+                b -= (b >= sizev) & sizev;
+
+                f32x4 w = phase * last;
+                w = w < last ? w : last;
+                i32x4 wi = __builtin_convertvector(w, i32x4);
+
+                f32x4 win = {window_[wi[0]], window_[wi[1]], window_[wi[2]], window_[wi[3]]};
+                f32x4 al = {bufL[a[0]], bufL[a[1]], bufL[a[2]], bufL[a[3]]};
+                f32x4 bl = {bufL[b[0]], bufL[b[1]], bufL[b[2]], bufL[b[3]]};
+                f32x4 ar = {bufR[a[0]], bufR[a[1]], bufR[a[2]], bufR[a[3]]};
+                f32x4 br = {bufR[b[0]], bufR[b[1]], bufR[b[2]], bufR[b[3]]};
+
+                accL[i] += (al + (bl - al) * frac) * (win * gl);
+                accR[i] += (ar + (br - ar) * frac) * (win * gr);
+                offset += rate;
+                phase += phase_inc;
+            }
+
+            memcpy(&offset_[base], &offset, sizeof(offset));
+            memcpy(&phase_[base], &phase, sizeof(phase));
+        }
+
+        for(size_t i = 0; i < n; i++)
+        {
+            outL[i] += simd::HSum(accL[i]);
+            outR[i] += simd::HSum(accR[i]);
+        }
+    }
+
+    /** drops grains whose window has ended, keeping the active ones packed */
+    void Cull()
+    {
+        for(size_t g = 0; g < active_;)
+        {
+            if(phase_[g] >= 1.0f)
+            {
+                size_t from = --active_;
+                start_[g] = start_[from];
+                offset_[g] = offset_[from];
+                rate_[g] = rate_[from];
+                phase_[g] = phase_[from];
+                phase_inc_[g] = phase_inc_[from];
+                gain_l_[g] = gain_l_[from];
+                gain_r_[g] = gain_r_[from];
+                // lanes past active_ in the last group must stay silent
+                Clear(from);
+            }
+            else
+            {
+                g++;
+            }
+        }
+    }
+
+    void Clear(size_t g)
+    {
+        start_[g] = 0;
+        offset_[g] = 0.0f;
+        rate_[g] = 0.0f;
+        phase_[g] = 1.0f;
+        phase_inc_[g] = 0.0f;
+        gain_l_[g] = 0.0f;
+        gain_r_[g] = 0.0f;
+    }
+
+    alignas(16) int32_t start_[max_grains];
+    alignas(16) float offset_[max_grains];
+    alignas(16) float rate_[max_grains];
+    alignas(16) float phase_[max_grains];
+    alignas(16) float phase_inc_[max_grains];
+    alignas(16) float gain_l_[max_grains];
+    alignas(16) float gain_r_[max_grains];
+    float window_[kWindowSize + 1];
+
+    size_t active_ = 0;
+    size_t dropped_ = 0;
+    size_t next_ = 0; // frames until the next spawn
+    uint32_t rng_ = 1;
+
+    float sample_rate_ = 48000.0f;
+    float density_ = 0.0f;
+    float size_ms_ = 120.0f;
+    float pitch_ = 0.0f;
+    float jitter_ = 0.0f;
+    float reverse_ = 0.5f;
+    float position_ms_ = 200.0f;
+    float spread_ms_ = 2000.0f;
+    float width_ = 0.7f;
+    float level_ = 1.0f;
+};
+
+#endif
@@ -0,0 +1,22 @@
+// passthru as a JACK internal client, loaded into jackd with
+//   jack_load passthru passthru -i "reverse=3000 fifo=/tmp/passthru.ctl"
+// (passthru.so has to be in jackd's internal client directory)
+#include "internal_client.h"
+#include "passthru_dsp.h"
+
+extern "C" int jack_initialize(jack_client_t* client, const char* load_init)
+{
+    // the reverse buffers are far too big for anything but the heap here
+    InternalClient* host = new InternalClient(client, new PassthruDsp,
+                                              {"input_L", "input_R"}, {"output_L", "output_R"});
+    if (host->Start(load_init) != 0) {
+        delete host;
+        return 1;
+    }
+    return 0;
+}
+
+extern "C" void jack_finish(void* arg)
+{
+    delete static_cast<InternalClient*>(arg);
+}
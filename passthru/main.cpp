@@ -4,12 +4,12 @@
 #include <chrono>
 #include <csignal>
 #include <atomic>
-#include "delayline_reverse.h"  //reverse delayline
-
-
-
-#include "../external/DaisySP/Source/daisysp.h"
-using namespace daisysp;
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <sndfile.h>
+#include "passthru_dsp.h"
+#include "snapshot.h"
 
 jack_port_t* input_ports[2];
 jack_port_t* output_ports[2];
@@ -17,108 +17,35 @@ jack_client_t* client = nullptr;
 
 std::atomic<bool> running{true};
 
-
-// Constants
-constexpr size_t kDelaySize = 48000; // 1 second @ 48kHz
-constexpr float maxRevDelay{48000.0f * 10.0f}; //samples (10 seconds)
-
-
-// === GLOBAL STATIC BUFFERS ===
-static float delay_buffer_L[kDelaySize];
-static float delay_buffer_R[kDelaySize];
-
-static DelayLine<float, kDelaySize> delay_L;
-static DelayLine<float, kDelaySize> delay_R;
-
-static DelayLineReverse<float, static_cast<size_t>(maxRevDelay * 2.5f)>  delMemsL_REV; //10 second reverse buffers
-static DelayLineReverse<float, static_cast<size_t>(maxRevDelay * 2.5f)>  delMemsR_REV;
-
-struct DelayRev
-{
-    DelayLineReverse <float, static_cast<size_t>(maxRevDelay*2.5f)>  *del;
-    float currentDelay_;
-    //float delayTarget;
-
-    void SetDelayTime(float delayTime)
-    {
-        if(abs(delayTime - currentDelay_) > (0.005f * currentDelay_) )  
-        //only update if more than 0.5% of last value
-        {
-            currentDelay_ = delayTime;
-            del -> SetDelay1(static_cast<size_t>(currentDelay_));
-            //del -> Reset();
-        }
-    }
-
-    float Read()
-    {
-        //read from head1
-        float read = del -> ReadRev();
-        return read;
-    }
-
-    float FwdFbk()
-    {
-        float read = del -> ReadFwd();
-        return read;
-    }
-
-    void Write(float in)    //sort out feedback in audiocallback
-    {
-        del -> Write(in);
-    }
-
-    void ResetHeadDiff()
-    {
-        del -> ResetHeadDiff();
-    }
-
-    void ClearBuff()
-    {
-        del -> ClearBuffer();
-    }
-};
-
-static DelayRev delaysL_REV,delaysR_REV;
-
-
-
-// Oscillator osc;
+// === GLOBAL STATIC DSP (reverse buffers are far too big for the stack) ===
+static PassthruDsp dsp;
+static Snapshotter snapshots;
 
 // === JACK AUDIO CALLBACK ===
 int process(jack_nframes_t nframes, void*)
 {
-    float* inL  = (float*)jack_port_get_buffer(input_ports[0], nframes);
-    float* inR  = (float*)jack_port_get_buffer(input_ports[1], nframes);
-    float* outL = (float*)jack_port_get_buffer(output_ports[0], nframes);
-    float* outR = (float*)jack_port_get_buffer(output_ports[1], nframes);
-
-    for (jack_nframes_t i = 0; i < nframes; ++i)
-    {
-        float dryL = inL[i];
-        float dryR = inR[i];
-
-        float wetL = delay_L.Read();
-        float wetR = delay_R.Read();
+    const float* in[2] = {
+        (float*)jack_port_get_buffer(input_ports[0], nframes),
+        (float*)jack_port_get_buffer(input_ports[1], nframes),
+    };
+    float* out[2] = {
+        (float*)jack_port_get_buffer(output_ports[0], nframes),
+        (float*)jack_port_get_buffer(output_ports[1], nframes),
+    };
 
-        float delayRevSignalL = delaysL_REV.Read();
-        float delayRevSignalR = delaysR_REV.Read();
-
-        delaysL_REV.Write(dryL);
-        delaysR_REV.Write(dryR);
-
-        delay_L.Write(delayRevSignalL + wetL * 0.5f); // simple feedback
-        delay_R.Write(delayRevSignalR + wetR * 0.5f);
-
-
-        outL[i] = wetL + dryL;
-        outR[i] = wetR + dryR;
-    }
+    dsp.Process(in, out, nframes, nullptr, 0);
 
     return 0;
 }
 
-
+// notification thread: the DSP builds its buffers for the new rate here
+// and the process callback swaps them in at the top of its next cycle
+int on_sample_rate(jack_nframes_t rate, void*)
+{
+    dsp.SetSampleRate(float(rate));
+    snapshots.SetSampleRate(float(rate));
+    return 0;
+}
 
 void jack_shutdown(void*)
 {
@@ -130,26 +57,68 @@ void signal_handler(int) {
     running = false;
 }
 
-int main()
+// first two channels of an IR file into the DSP; false if unreadable
+static bool load_impulse(const char* path, jack_nframes_t sample_rate)
 {
+    SF_INFO info = {};
+    SNDFILE* sf = sf_open(path, SFM_READ, &info);
+    if (!sf) {
+        std::cerr << "Cannot open impulse response " << path << ": " << sf_strerror(nullptr) << std::endl;
+        return false;
+    }
+    std::vector<float> frames(size_t(info.frames) * info.channels);
+    sf_count_t got = sf_readf_float(sf, frames.data(), info.frames);
+    sf_close(sf);
+
+    std::vector<float> left(got), right(info.channels > 1 ? got : 0);
+    for (sf_count_t i = 0; i < got; i++) {
+        left[i] = frames[size_t(i) * info.channels];
+        if (info.channels > 1)
+            right[i] = frames[size_t(i) * info.channels + 1];
+    }
+    if (jack_nframes_t(info.samplerate) != sample_rate)
+        std::cerr << "Warning: " << path << " is " << info.samplerate << " Hz, JACK runs at "
+                  << sample_rate << " Hz; the IR is used unresampled" << std::endl;
+
+    std::cout << "Impulse response: " << path << ", " << got << " frames, "
+              << (info.channels > 1 ? "stereo" : "mono") << std::endl;
+    dsp.SetImpulse(std::move(left), std::move(right));
+    return true;
+}
 
-        // Init delay line with static buffer
-    delay_L.Init();
-    delay_R.Init();
-
-    delay_L.SetDelay(5000.0f);
-    delay_R.SetDelay(4000.f);
-
-    //Init rev delays
-    delMemsL_REV.Init();
-    delMemsR_REV.Init();
-
-    //point struct at SDRAM buffers
-    delaysL_REV.del = &delMemsL_REV; 
-    delaysR_REV.del = &delMemsR_REV; 
-
-    delaysL_REV.SetDelayTime(maxRevDelay/ 3.0f);
-    delaysR_REV.SetDelayTime(maxRevDelay / 3.0f);   //default maxRevDelay / 3.0f
+int main(int argc, char* argv[])
+{
+    const char* ir_path = nullptr;
+    std::string snapshot_path = "/dev/shm/jack_passthrough_stereo.snap";
+    int opt;
+    while ((opt = getopt(argc, argv, "i:m:b:t:g:G:S:h")) != -1) {
+        switch (opt) {
+            case 'i': ir_path = optarg; break;
+            case 'S': snapshot_path = optarg; break;
+            case 'm': dsp.Configure("ir_mix", optarg); break;
+            case 'g': dsp.Configure("grain_mix", optarg); break;
+            case 'G': dsp.Configure("grain_density", optarg); break;
+            case 'b':
+            case 't':
+                if (!dsp.Configure(opt == 'b' ? "ir_block" : "ir_tail", optarg)) {
+                    std::cerr << "partition sizes are powers of two, 16..65536" << std::endl;
+                    return 1;
+                }
+                break;
+            default:
+                std::cerr << "usage: passthrough [-i ir.wav] [-m mix] [-b head block] [-t tail block]\n"
+                          << "                   [-g grain mix] [-G grains per second] [-S snapshot file]\n"
+                          << "  -i  impulse response (cabinet/room) applied to the output\n"
+                          << "  -m  IR wet/dry, 0..1 (default 1)\n"
+                          << "  -b  first partition in frames (default 64, zero latency)\n"
+                          << "  -t  background partition in frames (default 2048)\n"
+                          << "  -g  grain cloud over the reverse buffers, 0..1 (default 0, off)\n"
+                          << "  -G  grain density (default 40 per second)\n"
+                          << "  -S  delay state snapshots for warm restarts, \"none\" to disable\n"
+                          << "      (default /dev/shm/jack_passthrough_stereo.snap)\n";
+                return 1;
+        }
+    }
 
     // osc.Init(48000.0f);
     // osc.SetFreq(10.0f);
@@ -169,7 +138,31 @@ int main()
         return 1;
     }
 
+    // the IR tail worker runs just below the JACK process thread
+    int rtprio = jack_client_real_time_priority(client);
+    if (rtprio > 0)
+        dsp.Configure("rtprio", std::to_string(rtprio));
+
+    if (ir_path && !load_impulse(ir_path, jack_get_sample_rate(client))) {
+        jack_client_close(client);
+        return 1;
+    }
+
+    dsp.Init(jack_get_sample_rate(client));
+
+    // carry on from the last snapshot instead of silence
+    if (snapshot_path != "none") {
+        bool restored = false;
+        std::string err;
+        if (!snapshots.Open(snapshot_path, "passthru", &dsp, jack_get_sample_rate(client), &restored, &err))
+            std::cerr << "Snapshots disabled: " << err << std::endl;
+        else if (restored)
+            std::cout << "Restored delay state from " << snapshot_path << " ("
+                      << snapshots.RestoredAge() << " s old)" << std::endl;
+    }
+
     jack_set_process_callback(client, process, nullptr);
+    jack_set_sample_rate_callback(client, on_sample_rate, nullptr);
     jack_on_shutdown(client, jack_shutdown, nullptr);
 
     // Register input and output ports for L/R
@@ -197,6 +190,8 @@ int main()
         return 1;
     }
 
+    snapshots.Start(5.0);
+
     jack_nframes_t sample_rate = jack_get_sample_rate(client);
     jack_nframes_t buffer_size = jack_get_buffer_size(client);
 
@@ -205,10 +200,18 @@ int main()
     std::cout << "Block size: " << buffer_size << " frames" << std::endl;
     std::cout << "Press Ctrl+C to quit." << std::endl;
 
+    size_t misses = 0;
     while (running) {
         std::this_thread::sleep_for(std::chrono::seconds(1));
+        dsp.Reclaim();
+        if (dsp.ConvolverMisses() != misses) {
+            misses = dsp.ConvolverMisses();
+            std::cerr << "IR tail missed its deadline " << misses << " time(s)" << std::endl;
+        }
     }
 
+    // one last save while the process callback still answers
+    snapshots.Close(true);
     jack_client_close(client);
     return 0;
 }
\ No newline at end of file
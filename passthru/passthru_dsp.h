@@ -0,0 +1,485 @@
+#pragma once
+#ifndef PASSTHRU_DSP_H
+#define PASSTHRU_DSP_H
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "delayline_reverse.h"  //reverse delayline
+#include "activity.h"
+#include "convolver.h"
+#include "dsp_node.h"
+#include "grain_engine.h"
+#include "snapshot.h"
+#include "state_swap.h"
+
+#include "../external/DaisySP/Source/daisysp.h"
+
+/** passthru as a node: stereo reverse delay feeding a forward delay with
+feedback, mixed with the dry input, plus an optional grain cloud read
+from the reverse buffers, then optionally through an impulse response
+(cabinet or room) set with SetImpulse() before Init().
+
+Parameters: delay_l, delay_r, reverse (ms), ir_mix (0..1), grain_mix
+(0 turns the grains off), grain_density (per second), grain_size (ms),
+grain_pitch and grain_jitter (semitones), grain_reverse (probability),
+grain_position and grain_spread (ms behind the input). Settings,
+before Init(): ir_block and ir_tail (Convolver partition sizes), rtprio
+(the JACK thread's priority; the tail worker runs one below it).
+
+SaveState() covers both delay pairs and the reverse heads and fades, so
+a Snapshotter can bring a restarted client back mid-tail.
+
+Delay memory is sized for up to 96 kHz and lives in an Engine on the
+heap. SetSampleRate() builds a cleared engine for the new rate off the
+process thread and swaps it in at a cycle boundary (StateSwap), with the
+current delay and grain settings applied there; tails of the old rate
+are dropped.
+*/
+class PassthruDsp : public DspNode
+{
+  public:
+    // Constants
+    static constexpr float kMaxSampleRate = 96000.0f;
+    static constexpr size_t kDelaySize = 96000; // 1 second @ 96kHz
+    static constexpr float kMaxRevSeconds = 10.0f; // longest reverse delay time
+    static constexpr size_t kRevSize = static_cast<size_t>(kMaxSampleRate * kMaxRevSeconds * 2.5f);
+
+    typedef daisysp::DelayLineReverse<float, kRevSize> RevLine;
+
+    struct DelayRev
+    {
+        RevLine *del;
+        float currentDelay_;
+        //float delayTarget;
+
+        void SetDelayTime(float delayTime)
+        {
+            if(abs(delayTime - currentDelay_) > (0.005f * currentDelay_) )
+            //only update if more than 0.5% of last value
+            {
+                currentDelay_ = delayTime;
+                del -> SetDelay1(static_cast<size_t>(currentDelay_));
+                //del -> Reset();
+            }
+        }
+
+        float Read()
+        {
+            //read from head1
+            float read = del -> ReadRev();
+            return read;
+        }
+
+        float FwdFbk()
+        {
+            float read = del -> ReadFwd();
+            return read;
+        }
+
+        void Write(float in)    //sort out feedback in audiocallback
+        {
+            del -> Write(in);
+        }
+
+        void ResetHeadDiff()
+        {
+            del -> ResetHeadDiff();
+        }
+
+        void ClearBuff()
+        {
+            del -> ClearBuffer();
+        }
+    };
+
+    bool Configure(const std::string& key, const std::string& value) override
+    {
+        long n = strtol(value.c_str(), nullptr, 10);
+        if (key == "ir_block" || key == "ir_tail") {
+            // powers of two only, the head no longer than the tail
+            if (n < 16 || n > 65536 || (n & (n - 1)) != 0)
+                return false;
+            if (key == "ir_block")
+                irBlock = size_t(n);
+            else
+                irTail = size_t(n);
+            return true;
+        }
+        if (key == "rtprio") {
+            rtPriority = int(n);
+            return true;
+        }
+
+        int index = ParamIndex(key);
+        if (index < 0)
+            return false;
+        SetParam(index, strtof(value.c_str(), nullptr));
+        return true;
+    }
+
+    int ParamIndex(const std::string& key) const override
+    {
+        if (key == "delay_l") return kParamDelayL;
+        if (key == "delay_r") return kParamDelayR;
+        if (key == "reverse") return kParamReverse;
+        if (key == "ir_mix") return kParamIrMix;
+        static const char* const grainKeys[] = {"grain_mix", "grain_density", "grain_size",
+                                                "grain_pitch", "grain_jitter", "grain_reverse",
+                                                "grain_position", "grain_spread"};
+        for (int g = 0; g < kNumGrainParams; g++)
+            if (key == grainKeys[g])
+                return kParamGrainMix + g;
+        return -1;
+    }
+
+    /** times in ms; before Init() they are only stored */
+    void SetParam(int index, float value) override
+    {
+        switch (index)
+        {
+            case kParamDelayL: delayMsL = value; break;
+            case kParamDelayR: delayMsR = value; break;
+            case kParamReverse: reverseMs = value; break;
+            case kParamIrMix: irMix = Clamp(value, 0.0f, 1.0f); return;
+            default:
+                if (index < kParamGrainMix || index >= kParamGrainMix + kNumGrainParams)
+                    return;
+                grainParams[index - kParamGrainMix] = value;
+                break;
+        }
+        if (initialised) {
+            ApplyGrains();
+            ApplyTimes();
+        }
+    }
+
+    /** IR at the node's sample rate, one channel or two; empty for none */
+    void SetImpulse(std::vector<float> left, std::vector<float> right = {})
+    {
+        irL = std::move(left);
+        irR = std::move(right);
+        if (!irR.empty() && irR.size() != irL.size())
+            irR.resize(irL.size(), 0.0f);
+    }
+
+    void Init(float sample_rate) override
+    {
+        builtRate = sample_rate;
+        engine.Reset(MakeEngine(sample_rate));
+        cur = engine.Current();
+
+        activity.Init();
+        activity.SetSpan(kLineFwd, kDelaySize);
+
+        ApplyGrains();
+
+        convolving = false;
+        if (!irL.empty()) {
+            const float* ir[2] = {irL.data(), irR.data()};
+            convolving = conv.Init(ir, irR.empty() ? 1 : 2, irL.size(), std::min(irBlock, irTail),
+                                   irTail, rtPriority - 1);
+            if (convolving)
+                activity.SetSpan(kLineConv, conv.Length());
+        }
+
+        initialised = true;
+        ApplyTimes();
+    }
+
+    size_t Inputs() const override { return 2; }
+    size_t Outputs() const override { return 2; }
+
+    size_t StateBytes() const override { return sizeof(SavedState); }
+
+    bool SaveState(void* dst) override
+    {
+        // the heads as of one cycle boundary; samples the process thread
+        // writes while the buffers are copied land ahead of the saved
+        // write pointer and are written again after a restore
+
+        // engineMutex keeps SetSampleRate()/Reclaim() from freeing the
+        // captured engine until the copy is done
+        std::lock_guard<std::mutex> lock(engineMutex);
+        if (!capture.Request(500))
+            return false;
+        const Engine* e = capturedEngine;
+        if (e->sampleRate != builtRate)
+            return false; // a new rate is not in use yet
+        SavedState* saved = static_cast<SavedState*>(dst);
+        saved->revL = capturedL;
+        saved->revR = capturedR;
+        // DaisySP's DelayLine is plain data, the copy is its buffer and
+        // head; the small forward lines go first, so they stay within a
+        // few samples of the captured reverse heads
+        saved->fwdL = e->delay_L;
+        saved->fwdR = e->delay_R;
+        memcpy(saved->bufL, e->delMemsL_REV.Buffer(), sizeof(saved->bufL));
+        memcpy(saved->bufR, e->delMemsR_REV.Buffer(), sizeof(saved->bufR));
+        return true;
+    }
+
+    void LoadState(const void* src) override
+    {
+        const SavedState* saved = static_cast<const SavedState*>(src);
+        Engine* e = engine.Current();
+        e->delMemsL_REV.SetState(saved->revL, saved->bufL);
+        e->delMemsR_REV.SetState(saved->revR, saved->bufR);
+        e->delay_L = saved->fwdL;
+        e->delay_R = saved->fwdR;
+        // the current settings win over the saved delay times
+        e->delaysL_REV.currentDelay_ = 0.0f;
+        e->delaysR_REV.currentDelay_ = 0.0f;
+        ApplyTimes();
+    }
+
+    bool SetSampleRate(float sample_rate) override
+    {
+        std::lock_guard<std::mutex> lock(engineMutex);
+        if (sample_rate != builtRate) {
+            engine.Publish(MakeEngine(sample_rate));
+            builtRate = sample_rate;
+        }
+        return true;
+    }
+
+    void Reclaim() override
+    {
+        std::lock_guard<std::mutex> lock(engineMutex);
+        engine.Reclaim();
+    }
+
+    bool Convolving() const { return convolving; }
+    size_t ActiveGrains() const { return cur ? cur->grains.Active() : 0; }
+    /** tail blocks the convolver's worker delivered too late */
+    size_t ConvolverMisses() const { return convolving ? conv.Misses() : 0; }
+
+    void Process(const float* const* in,
+                 float* const*       out,
+                 size_t              nframes,
+                 const MidiEvent*    midi,
+                 size_t              nmidi) override
+    {
+        const float* inL = in[0];
+        const float* inR = in[1];
+        float* outL = out[0];
+        float* outR = out[1];
+
+        // an engine built for a new sample rate takes over here, with
+        // the current settings
+        Engine* next = engine.Acquire();
+        if (next != cur) {
+            cur = next;
+            ApplyGrains();
+            ApplyTimes();
+        }
+        FwdLine& delay_L = cur->delay_L;
+        FwdLine& delay_R = cur->delay_R;
+        DelayRev& delaysL_REV = cur->delaysL_REV;
+        DelayRev& delaysR_REV = cur->delaysR_REV;
+
+        capture.Poll([this]() {
+            capturedEngine = cur;
+            capturedL = cur->delMemsL_REV.GetState();
+            capturedR = cur->delMemsR_REV.GetState();
+        });
+
+        size_t start = 0;
+        if (activity.Idle())
+        {
+            // every tail has died away: nothing to do until the input wakes up
+            start = std::min(activity.FirstAbove(inL, nframes), activity.FirstAbove(inR, nframes));
+            memset(outL, 0, start * sizeof(float));
+            memset(outR, 0, start * sizeof(float));
+            if (start == nframes)
+                return;
+        }
+
+        float peakRev = 0.0f;
+        float peakFwd = 0.0f;
+
+        for (size_t i = start; i < nframes; ++i)
+        {
+            float dryL = inL[i];
+            float dryR = inR[i];
+
+            float wetL = delay_L.Read();
+            float wetR = delay_R.Read();
+
+            float delayRevSignalL = delaysL_REV.Read();
+            float delayRevSignalR = delaysR_REV.Read();
+
+            delaysL_REV.Write(dryL);
+            delaysR_REV.Write(dryR);
+
+            float fwdL = delayRevSignalL + wetL * 0.5f; // simple feedback
+            float fwdR = delayRevSignalR + wetR * 0.5f;
+            delay_L.Write(fwdL);
+            delay_R.Write(fwdR);
+
+            peakRev = std::max(peakRev, std::max(fabsf(dryL), fabsf(dryR)));
+            peakFwd = std::max(peakFwd, std::max(fabsf(fwdL), fabsf(fwdR)));
+
+            outL[i] = wetL + dryL;
+            outR[i] = wetR + dryR;
+        }
+
+        activity.Wrote(kLineRev, peakRev, nframes - start);
+        activity.Wrote(kLineFwd, peakFwd, nframes - start);
+
+        // the grains read what this block just wrote to the reverse lines
+        cur->grains.Render(cur->delMemsL_REV.Buffer(), cur->delMemsR_REV.Buffer(), RevLine::Size(),
+                           cur->delMemsL_REV.WritePos(), outL + start, outR + start, nframes - start);
+
+        if (convolving)
+            Convolve(outL + start, outR + start, nframes - start);
+    }
+
+  private:
+    // line 0: reverse pair, line 1: forward delay pair, line 2: IR
+    enum { kLineRev, kLineFwd, kLineConv, kNumLines };
+    enum { kParamDelayL, kParamDelayR, kParamReverse, kParamIrMix, kParamGrainMix };
+    enum { kGrainMix, kGrainDensity, kGrainSize, kGrainPitch, kGrainJitter, kGrainReverse,
+           kGrainPosition, kGrainSpread, kNumGrainParams };
+    static constexpr size_t kConvChunk = 256;
+    static constexpr size_t kMaxGrains = 128;
+
+    typedef daisysp::DelayLine<float, kDelaySize> FwdLine;
+
+    struct SavedState
+    {
+        RevLine::State revL, revR;
+        FwdLine        fwdL, fwdR;
+        float          bufL[kRevSize];
+        float          bufR[kRevSize];
+    };
+
+    // delay memory and grain cloud for one sample rate; about 20 MB, so
+    // it only ever lives on the heap
+    struct Engine
+    {
+        float    sampleRate;
+        FwdLine  delay_L;
+        FwdLine  delay_R;
+        RevLine  delMemsL_REV; //10 second reverse buffers
+        RevLine  delMemsR_REV;
+        DelayRev delaysL_REV, delaysR_REV;
+        // grain cloud over the reverse buffers
+        GrainEngine<kMaxGrains> grains;
+    };
+
+    /** cleared lines and a grain cloud for sample_rate */
+    static std::unique_ptr<Engine> MakeEngine(float sample_rate)
+    {
+        std::unique_ptr<Engine> e(new Engine);
+        e->sampleRate = sample_rate;
+
+        // Init delay line with static buffer
+        e->delay_L.Init();
+        e->delay_R.Init();
+
+        //Init rev delays
+        e->delMemsL_REV.Init();
+        e->delMemsR_REV.Init();
+
+        //point struct at SDRAM buffers
+        e->delaysL_REV.del = &e->delMemsL_REV;
+        e->delaysR_REV.del = &e->delMemsR_REV;
+        e->delaysL_REV.currentDelay_ = 0.0f;
+        e->delaysR_REV.currentDelay_ = 0.0f;
+
+        e->grains.Init(sample_rate);
+        return e;
+    }
+
+    static float Clamp(float v, float lo, float hi) { return std::min(std::max(v, lo), hi); }
+
+    // the delays' output through the IR, wet/dry by ir_mix
+    void Convolve(float* outL, float* outR, size_t nframes)
+    {
+        const float mix = irMix;
+        float peak = 0.0f;
+        for (size_t pos = 0; pos < nframes; pos += kConvChunk)
+        {
+            size_t n = std::min(kConvChunk, nframes - pos);
+            for (size_t i = 0; i < n; i++)
+                peak = std::max(peak, std::max(fabsf(outL[pos + i]), fabsf(outR[pos + i])));
+            conv.Process(outL + pos, outR + pos, convL, convR, n);
+            for (size_t i = 0; i < n; i++)
+            {
+                outL[pos + i] += (convL[i] - outL[pos + i]) * mix;
+                outR[pos + i] += (convR[i] - outR[pos + i]) * mix;
+            }
+        }
+        activity.Wrote(kLineConv, peak, nframes);
+    }
+
+    void ApplyTimes()
+    {
+        Engine& e = *cur;
+        float perMs = e.sampleRate / 1000.0f;
+        e.delay_L.SetDelay(Clamp(delayMsL * perMs, 1.0f, float(kDelaySize - 2)));
+        e.delay_R.SetDelay(Clamp(delayMsR * perMs, 1.0f, float(kDelaySize - 2)));
+
+        //25000 samples is the reverse line's minimum
+        float rev = Clamp(reverseMs * perMs, 25000.0f, kMaxRevSeconds * e.sampleRate);
+        e.delaysL_REV.SetDelayTime(rev);
+        e.delaysR_REV.SetDelayTime(rev);
+
+        // the reverse heads reach back at most two delay times, grains anywhere
+        if (grainParams[kGrainMix] > 0.0f)
+            activity.SetSpan(kLineRev, kRevSize);
+        else
+            activity.SetSpan(kLineRev, 2 * static_cast<size_t>(e.delaysL_REV.currentDelay_) + 1);
+    }
+
+    void ApplyGrains()
+    {
+        const float* p = grainParams;
+        GrainEngine<kMaxGrains>& grains = cur->grains;
+        grains.SetLevel(Clamp(p[kGrainMix], 0.0f, 1.0f));
+        grains.SetDensity(p[kGrainMix] > 0.0f ? Clamp(p[kGrainDensity], 0.0f, 2000.0f) : 0.0f);
+        grains.SetSize(Clamp(p[kGrainSize], 5.0f, 2000.0f));
+        grains.SetPitch(Clamp(p[kGrainPitch], -24.0f, 24.0f), Clamp(p[kGrainJitter], 0.0f, 24.0f));
+        grains.SetReverse(Clamp(p[kGrainReverse], 0.0f, 1.0f));
+        grains.SetPosition(std::max(p[kGrainPosition], 0.0f), std::max(p[kGrainSpread], 0.0f));
+    }
+
+    bool initialised = false;
+    float delayMsL = 5000.0f / 48.0f;   // 5000 and 4000 samples at 48 kHz
+    float delayMsR = 4000.0f / 48.0f;
+    float reverseMs = kMaxRevSeconds * 1000.0f / 3.0f; //default a third of the maximum
+
+    // the delays, swapped whole when the sample rate changes; cur is
+    // the process thread's engine for this cycle
+    StateSwap<Engine> engine;
+    Engine* cur = nullptr;
+    std::mutex engineMutex; // SetSampleRate / Reclaim vs SaveState
+    float builtRate = 0.0f;
+    ActivityTracker<kNumLines> activity;
+
+    // reverse heads as of the cycle a snapshot asked for
+    StateCapture capture;
+    Engine* capturedEngine = nullptr;
+    RevLine::State capturedL, capturedR;
+
+    // grain cloud settings, off until grain_mix > 0
+    float grainParams[kNumGrainParams] = {0.0f, 40.0f, 150.0f, 0.0f, 0.1f, 0.5f, 100.0f, 3000.0f};
+
+    // impulse response stage
+    std::vector<float> irL, irR;
+    Convolver conv;
+    bool convolving = false;
+    float irMix = 1.0f;
+    size_t irBlock = 64;
+    size_t irTail = 2048;
+    int rtPriority = 70;
+    float convL[kConvChunk];
+    float convR[kConvChunk];
+};
+
+#endif
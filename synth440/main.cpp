@@ -1,14 +1,21 @@
 #include <jack/jack.h>
+#include <jack/midiport.h>
 #include <cmath>
 #include <csignal>
+#include <cstdlib>
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <getopt.h>
+#include "jack_midi.h"
+#include "synth_dsp.h"
 
 jack_client_t* client;
 jack_port_t* output_port_l;
 jack_port_t* output_port_r;
-float phase = 0.0f;
+jack_port_t* midi_in;
+static Synth440Dsp synth;
+static MidiEvent midi_events[kMaxMidiEvents];
 bool running = true;
 
 // Ctrl+C handler
@@ -17,22 +24,57 @@ void signal_handler(int) {
 }
 
 int process(jack_nframes_t nframes, void* arg) {
-    auto* buffer_l = static_cast<float*>(jack_port_get_buffer(output_port_l, nframes));
-    auto* buffer_r = static_cast<float*>(jack_port_get_buffer(output_port_r, nframes));
+    float* out[2] = {
+        static_cast<float*>(jack_port_get_buffer(output_port_l, nframes)),
+        static_cast<float*>(jack_port_get_buffer(output_port_r, nframes)),
+    };
+    size_t nmidi = CollectMidi(jack_port_get_buffer(midi_in, nframes), midi_events, kMaxMidiEvents);
 
-    for (jack_nframes_t i = 0; i < nframes; ++i) {
-        float sample = 0.2f * sinf(phase);
-        phase += 2.0f * M_PI * 440.0f / jack_get_sample_rate(client);  // 440 Hz tone
-        if (phase > 2.0f * M_PI) phase -= 2.0f * M_PI;
+    synth.Process(nullptr, out, nframes, midi_events, nmidi);
 
-        buffer_l[i] = sample;
-        buffer_r[i] = sample;
-    }
+    return 0;
+}
 
+// notification thread: oscillators and wavetables for the new rate are
+// built here and swapped in at the top of the next cycle
+int on_sample_rate(jack_nframes_t rate, void*) {
+    synth.SetSampleRate(float(rate));
     return 0;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    const char* partials = nullptr;
+    bool midi_only = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:f:a:w:mh")) != -1) {
+        switch (c) {
+            case 'n': partials = optarg; break;
+            case 'f': synth.Configure("fundamental", optarg); break;
+            case 'a': synth.Configure("amp", optarg); break;
+            case 'm': midi_only = true; break;
+            case 'w':
+                if (!synth.Configure("wave", optarg)) {
+                    std::cerr << "unknown waveform " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            default:
+                std::cerr << "usage: synth440 [-m] [-n partials (max " << Synth440Dsp::kMaxPartials
+                          << ")] [-f fundamental Hz] [-a amplitude] [-w sine|saw|square|tri]\n"
+                          << "  -m  MIDI voices only, no test tone unless -n is given\n"
+                          << "  -w  MIDI voice waveform, band-limited wavetables except sine\n";
+                return 1;
+        }
+    }
+    if (!partials) {
+        partials = midi_only ? "0" : "1";
+    }
+    if (!synth.Configure("partials", partials)) {
+        std::cerr << "partials must be 0.." << Synth440Dsp::kMaxPartials << "\n";
+        return 1;
+    }
+
     std::signal(SIGINT, signal_handler);
 
     client = jack_client_open("jack_dsp_app", JackNullOption, nullptr);
@@ -41,10 +83,18 @@ int main() {
         return 1;
     }
 
+    synth.Init(jack_get_sample_rate(client));
+    if (synth.UsesWavetable()) {
+        std::cout << (synth.WavetableCached() ? "Loaded" : "Built") << " wavetables for "
+                  << jack_get_sample_rate(client) << " Hz\n";
+    }
+
     jack_set_process_callback(client, process, nullptr);
+    jack_set_sample_rate_callback(client, on_sample_rate, nullptr);
 
     output_port_l = jack_port_register(client, "out_l", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
     output_port_r = jack_port_register(client, "out_r", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    midi_in = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
 
     if (jack_activate(client)) {
         std::cerr << "Failed to activate JACK client\n";
@@ -55,12 +105,15 @@ int main() {
     jack_connect(client, "jack_dsp_app:out_l", "system:playback_1");
     jack_connect(client, "jack_dsp_app:out_r", "system:playback_2");
 
-    std::cout << "Running... press Ctrl+C to quit.\n";
+    std::cout << "Running " << synth.Partials() << " partial(s) on " << synth.Fundamental()
+              << " Hz, up to " << Synth440Dsp::kMaxVoices << " MIDI voices on jack_dsp_app:midi_in"
+              << "... press Ctrl+C to quit.\n";
     while (running) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        synth.Reclaim();
     }
 
     jack_client_close(client);
     std::cout << "Exited cleanly.\n";
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,132 @@
+#pragma once
+#ifndef OSC_BANK_H
+#define OSC_BANK_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "simd4.h"
+
+/** Additive sine oscillator bank
+
+Each partial is a 32 bit phase accumulator (wraps for free, no drift)
+with its own frequency and amplitude, stored as separate arrays so four
+partials are rendered at once with GCC vector extensions (NEON on the
+Pi, SSE on x86). The sine is an odd polynomial, so there is no table
+lookup and no libm call per sample.
+*/
+namespace osc
+{
+using simd::f32x4;
+using simd::i32x4;
+using simd::u32x4;
+using simd::HSum;
+
+/** sin(2*pi*phase/2^32) for four phases, max error about 4e-6 */
+inline f32x4 Sin4(u32x4 phase)
+{
+    // signed phase -> x in [-1, 1), sin(pi * x)
+    f32x4 x = __builtin_convertvector((i32x4)phase, f32x4) * (1.0f / 2147483648.0f);
+    // fold into [-0.5, 0.5] using sin(pi * x) = sin(pi * (+-1 - x))
+    x = x > 0.5f ? 1.0f - x : x;
+    x = x < -0.5f ? -1.0f - x : x;
+    f32x4 x2 = x * x;
+    // Taylor series of sin(pi * x) to x^9
+    f32x4 p = x2 * 0.0821458866f - 0.5992645293f;
+    p = p * x2 + 2.5501640399f;
+    p = p * x2 - 5.1677127800f;
+    p = p * x2 + 3.1415926536f;
+    return p * x;
+}
+
+inline uint32_t FreqToInc(float freq, float phase_per_hz)
+{
+    float inc = freq * phase_per_hz;
+    // at or above Nyquist the partial is muted by its caller
+    return inc < 2147483648.0f ? uint32_t(inc) : 0;
+}
+} // namespace osc
+
+template <size_t max_partials>
+class OscBank
+{
+    static_assert(max_partials % 4 == 0, "partials are processed in groups of 4");
+
+  public:
+    /** hoists the rate dependent scale; call again if the rate changes */
+    void Init(float sample_rate)
+    {
+        sample_rate_ = sample_rate;
+        phase_per_hz_ = 4294967296.0f / sample_rate;
+        memset(phase_, 0, sizeof(phase_));
+        memset(inc_, 0, sizeof(inc_));
+        memset(amp_, 0, sizeof(amp_));
+        count_ = 0;
+    }
+
+    /** number of partials rendered (rounded up to a multiple of 4) */
+    void SetCount(size_t n)
+    {
+        n = n < max_partials ? n : max_partials;
+        // silence anything between n and the next group boundary
+        for(size_t i = n; i < ((n + 3) & ~size_t(3)); i++)
+            amp_[i] = 0.0f;
+        count_ = n;
+    }
+
+    size_t Count() const { return count_; }
+
+    /** partials at or above Nyquist are silenced */
+    void SetPartial(size_t i, float freq, float amp)
+    {
+        if(i >= max_partials)
+            return;
+        bool audible = freq > 0.0f && freq < 0.5f * sample_rate_;
+        inc_[i] = audible ? osc::FreqToInc(freq, phase_per_hz_) : 0;
+        amp_[i] = audible ? amp : 0.0f;
+    }
+
+    /** writes the sum of all partials to out */
+    void Process(float* out, size_t nframes)
+    {
+        using osc::f32x4;
+        using osc::u32x4;
+        constexpr size_t kChunk = 256;
+        f32x4 acc[kChunk];
+        size_t groups = (count_ + 3) / 4;
+
+        for(size_t start = 0; start < nframes; start += kChunk)
+        {
+            size_t n = nframes - start < kChunk ? nframes - start : kChunk;
+            for(size_t i = 0; i < n; i++)
+                acc[i] = f32x4{0.0f, 0.0f, 0.0f, 0.0f};
+
+            for(size_t g = 0; g < groups; g++)
+            {
+                u32x4 ph, inc;
+                f32x4 amp;
+                memcpy(&ph, &phase_[g * 4], sizeof(ph));
+                memcpy(&inc, &inc_[g * 4], sizeof(inc));
+                memcpy(&amp, &amp_[g * 4], sizeof(amp));
+                for(size_t i = 0; i < n; i++)
+                {
+                    acc[i] += amp * osc::Sin4(ph);
+                    ph += inc;
+                }
+                memcpy(&phase_[g * 4], &ph, sizeof(ph));
+            }
+
+            for(size_t i = 0; i < n; i++)
+                out[start + i] = osc::HSum(acc[i]);
+        }
+    }
+
+  private:
+    alignas(16) uint32_t phase_[max_partials];
+    alignas(16) uint32_t inc_[max_partials];
+    alignas(16) float amp_[max_partials];
+    size_t count_ = 0;
+    float sample_rate_ = 48000.0f;
+    float phase_per_hz_ = 4294967296.0f / 48000.0f;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#pragma once
+#ifndef SYNTH_DSP_H
+#define SYNTH_DSP_H
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "dsp_node.h"
+#include "osc_bank.h"
+#include "state_swap.h"
+#include "voice_engine.h"
+#include "wavetable.h"
+
+/** synth440 as a node: additive test tone plus MIDI voices, mono
+rendered and copied to both outputs.
+
+Settings: partials (0 for none), fundamental, amp, wave
+(sine|saw|square|tri).
+
+Oscillators, voices and wavetables are tuned for one sample rate;
+SetSampleRate() builds a new set off the process thread (wavetables
+come from the cache when they can) and swaps it in at a cycle boundary.
+Sounding notes stop there.
+*/
+class Synth440Dsp : public DspNode
+{
+  public:
+    static constexpr size_t kMaxPartials = 1024;
+    static constexpr size_t kMaxVoices = 128;
+
+    bool Configure(const std::string& key, const std::string& value) override
+    {
+        if(key == "partials")
+        {
+            long n = strtol(value.c_str(), nullptr, 10);
+            if(n < 0 || n > long(kMaxPartials))
+                return false;
+            partials_ = size_t(n);
+            return true;
+        }
+        if(key == "fundamental")
+        {
+            fundamental_ = strtof(value.c_str(), nullptr);
+            return true;
+        }
+        if(key == "amp")
+        {
+            amp_ = strtof(value.c_str(), nullptr);
+            return true;
+        }
+        if(key == "wave")
+        {
+            if(value == "sine")
+                wave_ = -1;
+            else if(value == "saw")
+                wave_ = Wavetable::kSaw;
+            else if(value == "square")
+                wave_ = Wavetable::kSquare;
+            else if(value == "tri")
+                wave_ = Wavetable::kTriangle;
+            else
+                return false;
+            return true;
+        }
+        return false;
+    }
+
+    /** rate dependent constants are worked out once here, not per sample */
+    void Init(float sample_rate) override
+    {
+        built_rate_ = sample_rate;
+        engine_.Reset(MakeEngine(sample_rate));
+        table_cached_ = engine_.Current()->table_cached;
+    }
+
+    bool SetSampleRate(float sample_rate) override
+    {
+        std::lock_guard<std::mutex> lock(engine_mutex_);
+        if(sample_rate != built_rate_)
+        {
+            engine_.Publish(MakeEngine(sample_rate));
+            built_rate_ = sample_rate;
+        }
+        return true;
+    }
+
+    void Reclaim() override
+    {
+        std::lock_guard<std::mutex> lock(engine_mutex_);
+        engine_.Reclaim();
+    }
+
+    size_t Inputs() const override { return 0; }
+    size_t Outputs() const override { return 2; }
+
+    void Process(const float* const* in,
+                 float* const*       out,
+                 size_t              nframes,
+                 const MidiEvent*    midi,
+                 size_t              nmidi) override
+    {
+        float* buffer_l = out[0];
+        // an engine built for a new sample rate takes over here
+        Engine& e = *engine_.Acquire();
+        e.bank.Process(buffer_l, nframes);
+
+        // render voices up to each event's timestamp, then apply it
+        size_t pos = 0;
+        for(size_t i = 0; i < nmidi; ++i)
+        {
+            size_t t = midi[i].time < nframes ? midi[i].time : nframes;
+            if(t > pos)
+            {
+                e.voices.Render(buffer_l + pos, t - pos);
+                pos = t;
+            }
+            HandleMidi(e, midi[i]);
+        }
+        e.voices.Render(buffer_l + pos, nframes - pos);
+
+        memcpy(out[1], buffer_l, nframes * sizeof(float));
+    }
+
+    size_t Partials() const { return partials_; }
+    float Fundamental() const { return fundamental_; }
+    bool UsesWavetable() const { return wave_ >= 0; }
+    bool WavetableCached() const { return table_cached_; }
+
+  private:
+    struct Engine
+    {
+        OscBank<kMaxPartials> bank;
+        VoicePool<kMaxVoices> voices;
+        Wavetable             wavetable;
+        bool                  table_cached = false;
+    };
+
+    std::unique_ptr<Engine> MakeEngine(float sample_rate) const
+    {
+        std::unique_ptr<Engine> e(new Engine);
+        // Harmonic series on the fundamental, partial k at amp / k
+        e->bank.Init(sample_rate);
+        e->bank.SetCount(partials_);
+        for(size_t k = 0; k < partials_; ++k)
+            e->bank.SetPartial(k, fundamental_ * (k + 1), amp_ / (k + 1));
+
+        e->voices.Init(sample_rate);
+        if(wave_ >= 0)
+        {
+            e->table_cached = e->wavetable.Init(sample_rate, Wavetable::DefaultCachePath(sample_rate));
+            e->voices.SetWave(&e->wavetable, Wavetable::Wave(wave_));
+        }
+        return e;
+    }
+
+    void HandleMidi(Engine& e, const MidiEvent& event)
+    {
+        if(event.size < 3)
+            return;
+        const uint8_t* data = event.data;
+        switch(data[0] & 0xF0)
+        {
+            case 0x90: e.voices.NoteOn(data[1], data[2]); break;
+            case 0x80: e.voices.NoteOff(data[1]); break;
+            case 0xB0:
+                if(data[1] == 120 || data[1] == 123) // all sound / notes off
+                    e.voices.AllNotesOff();
+                break;
+        }
+    }
+
+    // swapped whole when the sample rate changes
+    StateSwap<Engine> engine_;
+    std::mutex engine_mutex_; // SetSampleRate vs Reclaim
+    float built_rate_ = 0.0f;
+    size_t partials_ = 1;
+    float fundamental_ = 440.0f;
+    float amp_ = 0.2f;
+    int wave_ = -1;
+    bool table_cached_ = false;
+};
+
+#endif
@@ -0,0 +1,271 @@
+#pragma once
+#ifndef VOICE_ENGINE_H
+#define VOICE_ENGINE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "osc_bank.h"
+#include "wavetable.h"
+
+/** Polyphonic voice pool
+
+All voice state lives in fixed arrays sized at compile time, one array
+per field, and the active voices are kept packed at the front. Render()
+therefore walks only ceil(active / 4) vector groups, four voices per
+group, and a voice whose release has decayed below -80 dB is culled by
+moving the last active voice into its slot. Nothing allocates after
+construction.
+
+Envelope: linear attack, exponential decay to sustain, exponential
+release. Note-on takes a free voice, otherwise steals the quietest
+releasing voice, otherwise the oldest.
+
+Voices are sines unless SetWave() points the pool at a Wavetable; the
+mip level is then picked per voice once per rendered chunk from its
+phase increment, and the table read is a linear interpolation with the
+index and fraction worked out four lanes at a time.
+*/
+template <size_t max_voices>
+class VoicePool
+{
+    static_assert(max_voices % 4 == 0, "voices are processed in groups of 4");
+
+  public:
+    enum Stage : int32_t
+    {
+        kAttack = 0,
+        kDecay = 1,
+        kRelease = 2
+    };
+
+    /** computes every rate dependent constant up front */
+    void Init(float sample_rate,
+              float attack_s = 0.005f,
+              float decay_s = 0.2f,
+              float sustain = 0.7f,
+              float release_s = 0.3f,
+              float gain = 0.1f)
+    {
+        float phase_per_hz = 4294967296.0f / sample_rate;
+        for(int n = 0; n < 128; n++)
+        {
+            float freq = 440.0f * powf(2.0f, (n - 69) / 12.0f);
+            note_inc_[n] = freq < 0.5f * sample_rate ? osc::FreqToInc(freq, phase_per_hz) : 0;
+        }
+        attack_inc_ = 1.0f / (attack_s * sample_rate + 1.0f);
+        // time constants reach ~-60 dB of the distance in the given time
+        decay_coef_ = 1.0f - expf(-6.9f / (decay_s * sample_rate + 1.0f));
+        release_mul_ = expf(-6.9f / (release_s * sample_rate + 1.0f));
+        sustain_ = sustain;
+        gain_ = gain;
+        active_ = 0;
+        clock_ = 0;
+    }
+
+    size_t Active() const { return active_; }
+
+    /** nullptr goes back to sines; the table must outlive the pool */
+    void SetWave(const Wavetable* table, Wavetable::Wave wave)
+    {
+        table_ = table;
+        wave_ = wave;
+    }
+
+    void NoteOn(uint8_t note, uint8_t velocity)
+    {
+        if(velocity == 0)
+        {
+            NoteOff(note);
+            return;
+        }
+        size_t v = active_ < max_voices ? active_++ : StealVoice();
+        phase_[v] = 0;
+        inc_[v] = note_inc_[note & 0x7F];
+        env_[v] = 0.0f;
+        stage_[v] = kAttack;
+        amp_[v] = gain_ * velocity / 127.0f;
+        note_[v] = note;
+        start_[v] = clock_++;
+    }
+
+    void NoteOff(uint8_t note)
+    {
+        for(size_t v = 0; v < active_; v++)
+            if(note_[v] == note && stage_[v] != kRelease)
+                stage_[v] = kRelease;
+    }
+
+    void AllNotesOff()
+    {
+        for(size_t v = 0; v < active_; v++)
+            stage_[v] = kRelease;
+    }
+
+    /** adds the active voices to out[0..nframes) */
+    void Render(float* out, size_t nframes)
+    {
+        constexpr size_t kChunk = 256;
+        osc::f32x4 acc[kChunk];
+
+        for(size_t start = 0; start < nframes; start += kChunk)
+        {
+            size_t n = nframes - start < kChunk ? nframes - start : kChunk;
+            for(size_t i = 0; i < n; i++)
+                acc[i] = osc::f32x4{0.0f, 0.0f, 0.0f, 0.0f};
+
+            size_t groups = (active_ + 3) / 4;
+            for(size_t g = 0; g < groups; g++)
+            {
+                if(table_)
+                {
+                    TableOsc o;
+                    for(size_t l = 0; l < 4; l++)
+                        o.table[l] = table_->Table(wave_, table_->Level(inc_[g * 4 + l]));
+                    RenderGroup(g * 4, acc, n, o);
+                }
+                else
+                {
+                    RenderGroup(g * 4, acc, n, SineOsc());
+                }
+            }
+
+            for(size_t i = 0; i < n; i++)
+                out[start + i] += osc::HSum(acc[i]);
+        }
+
+        Cull();
+    }
+
+  private:
+    struct SineOsc
+    {
+        inline osc::f32x4 operator()(osc::u32x4 ph) const { return osc::Sin4(ph); }
+    };
+
+    /** one table per lane, already at the lane's mip level */
+    struct TableOsc
+    {
+        const float* table[4];
+
+        inline osc::f32x4 operator()(osc::u32x4 ph) const
+        {
+            constexpr unsigned kFracBits = 32 - Wavetable::kSizeBits;
+            osc::u32x4 idx = ph >> kFracBits;
+            osc::f32x4 frac = __builtin_convertvector(ph & ((1u << kFracBits) - 1), osc::f32x4)
+                              * (1.0f / float(1u << kFracBits));
+            osc::f32x4 a = {table[0][idx[0]], table[1][idx[1]], table[2][idx[2]], table[3][idx[3]]};
+            osc::f32x4 b = {table[0][idx[0] + 1],
+                            table[1][idx[1] + 1],
+                            table[2][idx[2] + 1],
+                            table[3][idx[3] + 1]};
+            return a + (b - a) * frac;
+        }
+    };
+
+    /** four voices from base, summed per lane into acc */
+    template <typename Osc>
+    inline void RenderGroup(size_t base, osc::f32x4* acc, size_t n, const Osc& oscillator)
+    {
+        using osc::f32x4;
+        using osc::i32x4;
+        using osc::u32x4;
+        const f32x4 sustain = {sustain_, sustain_, sustain_, sustain_};
+        const float attack_inc = attack_inc_;
+        const float decay_coef = decay_coef_;
+        const float release_mul = release_mul_;
+
+        u32x4 ph, inc;
+        f32x4 env, amp;
+        i32x4 stage;
+        memcpy(&ph, &phase_[base], sizeof(ph));
+        memcpy(&inc, &inc_[base], sizeof(inc));
+        memcpy(&env, &env_[base], sizeof(env));
+        memcpy(&amp, &amp_[base], sizeof(amp));
+        memcpy(&stage, &stage_[base], sizeof(stage));
+
+        for(size_t i = 0; i < n; i++)
+        {
+            i32x4 attacking = stage == int32_t(kAttack);
+            i32x4 releasing = stage == int32_t(kRelease);
+            f32x4 next_ad = attacking ? env + attack_inc : env + (sustain - env) * decay_coef;
+            env = releasing ? env * release_mul : next_ad;
+            // attack peak reached -> decay
+            i32x4 peaked = attacking & (env >= 1.0f);
+            env = peaked ? 1.0f : env;
+            stage = peaked ? i32x4{kDecay, kDecay, kDecay, kDecay} : stage;
+
+            acc[i] += oscillator(ph) * env * amp;
+            ph += inc;
+        }
+
+        memcpy(&phase_[base], &ph, sizeof(ph));
+        memcpy(&env_[base], &env, sizeof(env));
+        memcpy(&stage_[base], &stage, sizeof(stage));
+    }
+
+    /** drops finished voices, keeping the active ones packed */
+    void Cull()
+    {
+        for(size_t v = 0; v < active_;)
+        {
+            if(stage_[v] == kRelease && env_[v] < 1e-4f)
+            {
+                Move(--active_, v);
+                // lanes past active_ in the last group must stay silent
+                amp_[active_] = 0.0f;
+                env_[active_] = 0.0f;
+            }
+            else
+            {
+                v++;
+            }
+        }
+    }
+
+    size_t StealVoice()
+    {
+        size_t quietest = max_voices;
+        size_t oldest = 0;
+        for(size_t v = 0; v < active_; v++)
+        {
+            if(stage_[v] == kRelease && (quietest == max_voices || env_[v] < env_[quietest]))
+                quietest = v;
+            if(start_[v] < start_[oldest])
+                oldest = v;
+        }
+        return quietest != max_voices ? quietest : oldest;
+    }
+
+    void Move(size_t from, size_t to)
+    {
+        phase_[to] = phase_[from];
+        inc_[to] = inc_[from];
+        env_[to] = env_[from];
+        amp_[to] = amp_[from];
+        stage_[to] = stage_[from];
+        note_[to] = note_[from];
+        start_[to] = start_[from];
+    }
+
+    alignas(16) uint32_t phase_[max_voices] = {};
+    alignas(16) uint32_t inc_[max_voices] = {};
+    alignas(16) float env_[max_voices] = {};
+    alignas(16) float amp_[max_voices] = {};
+    alignas(16) int32_t stage_[max_voices] = {};
+    uint8_t note_[max_voices] = {};
+    uint32_t start_[max_voices] = {};
+
+    uint32_t note_inc_[128] = {};
+    const Wavetable* table_ = nullptr;
+    Wavetable::Wave wave_ = Wavetable::kSaw;
+    float attack_inc_ = 0.0f;
+    float decay_coef_ = 0.0f;
+    float release_mul_ = 0.0f;
+    float sustain_ = 0.7f;
+    float gain_ = 0.1f;
+    size_t active_ = 0;
+    uint32_t clock_ = 0;
+};
+
+#endif
@@ -0,0 +1,217 @@
+#pragma once
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "fft.h"
+#include "osc_bank.h"
+
+/** Band-limited mip-mapped wavetables
+
+One table set per waveform, one level per octave of fundamental. Level k
+serves notes up to kBaseHz * 2^k and holds only the harmonics that stay
+below Nyquist for that note, so any note read from the right level is
+alias free. Tables are synthesised once from their Fourier series with
+an inverse FFT, which is why the levels depend on the sample rate. All
+levels of a waveform share one gain so switching level is inaudible.
+
+Each table has kSize + 1 points, the last repeating the first, so the
+linear interpolation never has to wrap.
+
+Building all levels takes a noticeable moment on a Pi, so the result can
+be kept in a cache file keyed on the sample rate and table layout.
+*/
+class Wavetable
+{
+  public:
+    enum Wave
+    {
+        kSaw,
+        kSquare,
+        kTriangle,
+        kNumWaves
+    };
+
+    static constexpr unsigned kSizeBits = 11;
+    static constexpr size_t kSize = size_t(1) << kSizeBits;
+    static constexpr size_t kStride = kSize + 1;
+    static constexpr unsigned kLevels = 11;
+    static constexpr float kBaseHz = 20.0f; // top note of level 0
+
+    /** fills the tables for sample_rate, reusing cache_path when it holds
+        tables for the same layout; returns true if the cache was used */
+    bool Init(float sample_rate, const std::string& cache_path = std::string())
+    {
+        sample_rate_ = sample_rate;
+        float phase_per_hz = 4294967296.0f / sample_rate;
+        for(unsigned k = 0; k < kLevels; k++)
+        {
+            float top = kBaseHz * float(1u << k);
+            level_inc_[k] = top < 0.5f * sample_rate ? osc::FreqToInc(top, phase_per_hz)
+                                                     : 0xFFFFFFFFu;
+        }
+        data_.assign(size_t(kNumWaves) * kLevels * kStride, 0.0f);
+
+        if(!cache_path.empty() && Load(cache_path))
+            return true;
+        Build();
+        if(!cache_path.empty())
+            Save(cache_path);
+        return false;
+    }
+
+    const float* Table(Wave w, unsigned level) const
+    {
+        return &data_[(size_t(w) * kLevels + level) * kStride];
+    }
+
+    /** lowest level whose band limit covers a phase increment */
+    unsigned Level(uint32_t inc) const
+    {
+        unsigned k = 0;
+        while(k < kLevels - 1 && inc > level_inc_[k])
+            k++;
+        return k;
+    }
+
+    /** $XDG_CACHE_HOME/synth440/wt_<rate>.bin, or under ~/.cache */
+    static std::string DefaultCachePath(float sample_rate)
+    {
+        std::string dir;
+        if(const char* xdg = getenv("XDG_CACHE_HOME"))
+            dir = xdg;
+        else if(const char* home = getenv("HOME"))
+            dir = std::string(home) + "/.cache";
+        else
+            return std::string();
+        mkdir(dir.c_str(), 0755);
+        dir += "/synth440";
+        mkdir(dir.c_str(), 0755);
+        return dir + "/wt_" + std::to_string(long(sample_rate)) + ".bin";
+    }
+
+  private:
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t sample_rate;
+        uint32_t size;
+        uint32_t levels;
+        uint32_t waves;
+    };
+
+    CacheHeader MakeHeader() const
+    {
+        CacheHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "S440WT1", 8);
+        h.sample_rate = uint32_t(sample_rate_);
+        h.size = uint32_t(kSize);
+        h.levels = kLevels;
+        h.waves = kNumWaves;
+        return h;
+    }
+
+    bool Load(const std::string& path)
+    {
+        FILE* f = fopen(path.c_str(), "rb");
+        if(!f)
+            return false;
+        CacheHeader want = MakeHeader(), got;
+        bool ok = fread(&got, sizeof(got), 1, f) == 1
+                  && memcmp(&want, &got, sizeof(got)) == 0
+                  && fread(data_.data(), sizeof(float), data_.size(), f) == data_.size();
+        fclose(f);
+        return ok;
+    }
+
+    void Save(const std::string& path) const
+    {
+        // write aside and rename, so a reader never sees a partial file
+        std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if(!f)
+            return;
+        CacheHeader h = MakeHeader();
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+                  && fwrite(data_.data(), sizeof(float), data_.size(), f) == data_.size();
+        ok = fclose(f) == 0 && ok;
+        if(ok)
+            rename(tmp.c_str(), path.c_str());
+        else
+            remove(tmp.c_str());
+    }
+
+    /** sine series coefficient of harmonic h, peak roughly 1 */
+    static float Coefficient(Wave w, size_t h)
+    {
+        switch(w)
+        {
+            case kSaw: return float(2.0 / M_PI) * ((h & 1) ? 1.0f : -1.0f) / float(h);
+            case kSquare: return (h & 1) ? float(4.0 / M_PI) / float(h) : 0.0f;
+            case kTriangle:
+                return (h & 1) ? float(8.0 / (M_PI * M_PI)) * ((h & 2) ? -1.0f : 1.0f)
+                                     / float(h * h)
+                               : 0.0f;
+            default: return 0.0f;
+        }
+    }
+
+    void Build()
+    {
+        Fft fft;
+        fft.Init(kSize);
+        std::vector<Fft::cfloat> bins(kSize);
+        float nyquist = 0.5f * sample_rate_;
+
+        for(int w = 0; w < kNumWaves; w++)
+        {
+            for(unsigned k = 0; k < kLevels; k++)
+            {
+                float top = kBaseHz * float(1u << k);
+                size_t harmonics = size_t(nyquist / top);
+                if(harmonics > kSize / 2 - 1)
+                    harmonics = kSize / 2 - 1;
+                if(harmonics < 1)
+                    harmonics = 1;
+
+                // b * sin(h t) = -i b/2 e^(i h t) + i b/2 e^(-i h t)
+                std::fill(bins.begin(), bins.end(), Fft::cfloat(0.0f, 0.0f));
+                for(size_t h = 1; h <= harmonics; h++)
+                {
+                    float b = 0.5f * Coefficient(Wave(w), h);
+                    bins[h] = Fft::cfloat(0.0f, -b);
+                    bins[kSize - h] = Fft::cfloat(0.0f, b);
+                }
+                fft.Inverse(bins.data());
+
+                float* t = &data_[(size_t(w) * kLevels + k) * kStride];
+                for(size_t i = 0; i < kSize; i++)
+                    t[i] = bins[i].real();
+                t[kSize] = t[0];
+            }
+
+            // one gain per waveform, from the richest level
+            const float* t0 = Table(Wave(w), 0);
+            float peak = 0.0f;
+            for(size_t i = 0; i < kSize; i++)
+                peak = fabsf(t0[i]) > peak ? fabsf(t0[i]) : peak;
+            float g = peak > 0.0f ? 1.0f / peak : 1.0f;
+            float* t = &data_[size_t(w) * kLevels * kStride];
+            for(size_t i = 0; i < kLevels * kStride; i++)
+                t[i] *= g;
+        }
+    }
+
+    float sample_rate_ = 48000.0f;
+    uint32_t level_inc_[kLevels] = {};
+    std::vector<float> data_;
+};
+
+#endif